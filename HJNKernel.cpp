@@ -10,184 +10,580 @@
 #include "jupyter_protocol.hpp"
 #include "jp_history.hpp"
 #include "jp_exec.hpp"
+#include "jp_display.hpp"
+#include "jp_complete.hpp"
+#include "ghci_modules.hpp"
+#include "exec_cache.hpp"
+#include "kernel_options.hpp"
+#include "kernel_config.hpp"
+#include "kernel_metrics.hpp"
+#include "kernel_session.hpp"
+#include "thread_pool.hpp"
 
-size_t exec_counter;
+#include <csignal>
+
+// Set by Ctrl+Break (SIGUSR1 elsewhere); the poller writes the metrics
+// snapshot as one JSON line to stderr.
+std::atomic<bool> metrics_dump_requested = false;
+
+void request_metrics_dump(int sig) {
+    metrics_dump_requested = true;
+    std::signal(sig, request_metrics_dump);
+}
+
+// Set by SIGINT/SIGTERM; the poller leaves its loop and the sessions shut
+// down normally, which is also when profiling builds write their data.
+std::atomic<bool> stop_requested = false;
+
+void request_stop(int) {
+    stop_requested = true;
+}
+
+// Cache lookup for an expression cell, pure being the ExpressionTypes
+// verdict on it. Any other kind of cell may change what expressions evaluate
+// to, so it drops the cache; IO actions are never looked up.
+bool lookup_cached(KernelSession& session, const std::string& code, bool pure, Evaluation& eval) {
+    ExecCache& exec_cache = session.exec_cache;
+    if (!exec_cache.enabled()) return false;
+    if (!is_pure_expression(code)) {
+        exec_cache.clear();
+        return false;
+    }
+    exec_cache.sync(session.modules.definitions_hash);
+    if (!pure) return false;
+    eval.cache_hit = exec_cache.lookup(code, eval.result);
+    // nothing ran, the stored statistics belong to the original evaluation
+    eval.result.stats = CellStats();
+    return eval.cache_hit;
+}
+
+// Brings up a new ghci in place of one that died, with the cell modules and
+// imports loaded again. Prompt bindings are gone. Returns how the old
+// process ended.
+std::string restart_ghci(KernelSession& session) {
+    std::string status = session.ghci.restart();
+    if (session.modules.configured) session.modules.configure(session.ghci);
+    session.modules.load_modules(session.ghci);
+    session.prompt_state = false;
+    session.expression_types.clear();
+    return status;
+}
+
+// Data channel frames the cell writes go to frame_sink as they arrive.
+Evaluation run_cell(KernelSession& session, const std::string& code, const std::string& cell_id,
+    std::function<void(DataFrame&&)> frame_sink) {
+    struct ClearSink {
+        GHCiBridge& ghci;
+        ~ClearSink() { ghci.frame_sink = nullptr; }
+    } clear_sink{ session.ghci };
+    session.ghci.frame_sink = std::move(frame_sink);
+
+    // definitions, imports and bindings change what an expression's type is
+    if (!is_pure_expression(code)) session.expression_types.clear();
+
+    Evaluation eval;
+    eval.display_dir = session.display_dir;
+    if (is_definition_cell(code)) {
+        eval.result = session.modules.load_cell(session.ghci, code, cell_id);
+        // :load drops every prompt binding
+        session.prompt_state = false;
+    }
+    else {
+        eval.result = session.ghci.send(code);
+        if (starts_with_word(trim(code), "import") && eval.result.err.empty())
+            session.modules.remember_import(code);
+        else if (!is_pure_expression(code))
+            session.prompt_state = true;
+    }
+    if (eval.result.died)
+        eval.exit_status = restart_ghci(session);
+    else
+        session.ghci.read_rts_stats(eval.result.stats);
+    session.symbols.rebuild(session.ghci, session.modules);
+    eval.frames = session.ghci.take_frames();
+    return eval;
+}
+
+// execute_reply metadata "cell_stats": ghci's own figures for the cell,
+// when it printed any, and the time the kernel spent on the request outside
+// the cell's round trip to ghci. Also recorded in the metrics.
+JsonValue cell_stats_json(const CellStats& stats, double kernel_secs) {
+    auto number = [](double v) { return JsonValue{ JsonValue::Number, false, v }; };
+    JsonValue out(JsonValue::Object);
+    if (stats.timed) {
+        out.o["secs"] = number(stats.secs);
+        out.o["allocated_bytes"] = number((double)stats.allocated_bytes);
+    }
+    out.o["round_trip_secs"] = number(stats.round_trip_secs);
+    out.o["kernel_secs"] = number(kernel_secs);
+    if (stats.rts) {
+        out.o["gcs"] = number((double)stats.gcs);
+        out.o["major_gcs"] = number((double)stats.major_gcs);
+        out.o["gc_secs"] = number(stats.gc_secs);
+        out.o["max_live_bytes"] = number((double)stats.max_live_bytes);
+    }
+    record_cell(stats.timed, stats.secs, stats.allocated_bytes, kernel_secs, stats.rts, stats.gc_secs);
+    return out;
+}
+
+// precomputed carries the output of a cell that already ran on a parallel
+// worker; only the publishing is left to do.
+void handle_execute_request(KernelSession& session, JupyterMessage& msg, Evaluation* precomputed)
+{
+    auto started = std::chrono::steady_clock::now();
+    zmq::socket_t& shell = session.shell;
+    IOPubQueue& iopub = session.iopub;
+    const std::string& key = session.key;
+    ExecCache& exec_cache = session.exec_cache;
+    size_t& exec_counter = session.exec_counter;
+    const std::vector<zmq::message_t>& identities = msg.identities;
+    const MessageHeader& header = msg.header;
+
+    if (session.aborting_queue) {
+        send_execute_aborted_reply(header, identities, key, shell);
+        return;
+    }
+
+    ExecuteRequest request = decode_message<ExecuteRequest>(msg.content);
+    if (!request.silent && request.store_history)
+        exec_counter++;
+
+    const std::string& code = request.code;
+    send_execute_input(code, exec_counter, header, identities, key, iopub);
+    std::string cell_id = msg.metadata.str("cellId", "");
+    bool side_output = false;
+    auto publish_frame = [&](DataFrame&& frame) {
+        publish_data_frame(std::move(frame), iopub, identities, header, key);
+        side_output = true;
+    };
+    Evaluation eval;
+    if (precomputed)
+        eval = std::move(*precomputed);
+    else {
+        bool pure = exec_cache.enabled() && session.expression_types.is_pure(session.ghci, code);
+        if (!lookup_cached(session, code, pure, eval))
+            eval = run_cell(session, code, cell_id, publish_frame);
+    }
+    const GHCiResult& ghci_result = eval.result;
+    bool cache_hit = eval.cache_hit;
+
+    const ResourceLimits& limits = session.ghci.limits;
+    bool limited = ghci_result.limit != LimitAction::none || ghci_result.died;
+    ExecError error = limited
+        ? limit_error(ghci_result.limit, ghci_result.died, eval.exit_status, limits.cell_timeout)
+        : parse_ghc_diagnostics(ghci_result.err);
+    if (error.failed) {
+        if (!ghci_result.out.empty())
+            send_execute_result(iopub, identities, header, ghci_result.out, exec_counter, key);
+        send_error(error, header, identities, key, iopub);
+        if (request.stop_on_error) session.aborting_queue = true;
+    }
+    else {
+        if (!ghci_result.err.empty())
+            send_stream("stderr", ghci_result.err, header, identities, key, iopub);
+        send_execute_result(iopub, identities, header, ghci_result.out, exec_counter, key);
+    }
+
+    // frames from a parallel worker were held until the cell's turn
+    side_output |= !eval.frames.empty();
+    publish_data_frames(std::move(eval.frames), iopub, identities, header, key);
+    side_output |= publish_display_files(eval.display_dir, iopub, identities, header, key) > 0;
+    if (eval.display_dir != session.display_dir && !eval.display_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(eval.display_dir, ec);
+    }
+
+    // Only plain text results of non-IO expressions are replayable; the type
+    // check was already made by lookup_cached
+    if (exec_cache.enabled() && !cache_hit && !error.failed && !side_output && session.expression_types.is_pure(session.ghci, code))
+        exec_cache.store(code, ghci_result);
+
+    JsonValue reply_metadata(JsonValue::Object);
+    if (exec_cache.enabled()) {
+        JsonValue stats(JsonValue::Object);
+        stats.o["hit"] = JsonValue{ JsonValue::Bool, cache_hit };
+        stats.o["hits"] = JsonValue{ JsonValue::Number, false, (double)exec_cache.hits };
+        stats.o["misses"] = JsonValue{ JsonValue::Number, false, (double)exec_cache.misses };
+        reply_metadata.o["exec_cache"] = stats;
+    }
+    if (limited) {
+        JsonValue limit(JsonValue::Object);
+        limit.o["reason"] = JsonValue{ JsonValue::String, false, 0.0, ghci_result.limit != LimitAction::none ? "timeout" : "exited" };
+        limit.o["action"] = JsonValue{ JsonValue::String, false, 0.0,
+            ghci_result.limit == LimitAction::interrupted && !ghci_result.died ? "interrupted"
+            : ghci_result.limit != LimitAction::none ? "killed" : "restarted" };
+        if (ghci_result.limit != LimitAction::none)
+            limit.o["timeout_secs"] = JsonValue{ JsonValue::Number, false, limits.cell_timeout };
+        if (!eval.exit_status.empty())
+            limit.o["exit_status"] = JsonValue{ JsonValue::String, false, 0.0, eval.exit_status };
+        reply_metadata.o["limit"] = limit;
+    }
+    if (session.ghci.timing) {
+        // a precomputed cell's round trip happened before this handler started
+        double handled = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        double kernel_secs = precomputed ? handled : std::max(0.0, handled - ghci_result.stats.round_trip_secs);
+        reply_metadata.o["cell_stats"] = cell_stats_json(ghci_result.stats, kernel_secs);
+    }
+    send_execute_reply(exec_counter, error, reply_metadata, header, identities, key, shell);
+}
+
+using ShellHandler = std::function<void(KernelSession&, JupyterMessage&)>;
+
+// Shell message handlers, indexed by the interned msg_type; types outside
+// the known set are looked up by name. Filled once at startup and only read
+// afterwards, so the session workers share them without locking.
+std::array<ShellHandler, msg_type_count> shell_handlers;
+std::unordered_map<std::string, ShellHandler> custom_shell_handlers;
+
+void register_shell_handler(const std::string& msg_type, ShellHandler handler) {
+    MsgType type = intern_msg_type(msg_type);
+    if (type == MsgType::unknown)
+        custom_shell_handlers[msg_type] = std::move(handler);
+    else
+        shell_handlers[(size_t)type] = std::move(handler);
+}
+
+const ShellHandler* find_shell_handler(const JupyterMessage& msg) {
+    if (msg.type != MsgType::unknown) {
+        const ShellHandler& handler = shell_handlers[(size_t)msg.type];
+        return handler ? &handler : nullptr;
+    }
+    auto it = custom_shell_handlers.find(msg.msg_type);
+    return it == custom_shell_handlers.end() ? nullptr : &it->second;
+}
+
+void register_default_handlers() {
+    register_shell_handler("kernel_info_request", [](KernelSession& s, JupyterMessage& m) {
+        send_kernel_info_reply(s.shell, m.identities, s.key, m.session, m.header);
+    });
+    register_shell_handler("history_request", [](KernelSession& s, JupyterMessage& m) {
+        handle_history_request(s.history, decode_message<HistoryRequest>(m.content), m.header, m.identities, s.key, s.shell);
+    });
+    register_shell_handler("comm_open", [](KernelSession& s, JupyterMessage& m) {
+        CommOpen open = decode_message<CommOpen>(m.content);
+        handle_comm_open(s.comms, open, m.header, m.identities, s.key, s.shell);
+        if (open.target_name == "kernel_metrics")
+            send_comm_msg(open.comm_id, metrics_json(), m.header, m.identities, s.key, s.iopub);
+    });
+    register_shell_handler("comm_msg", [](KernelSession& s, JupyterMessage& m) {
+        // any message on a kernel_metrics comm asks for a fresh snapshot
+        auto comm = s.comms.active_comms.find(m.content.str("comm_id", ""));
+        if (comm != s.comms.active_comms.end() && comm->second.target_name == "kernel_metrics") {
+            send_comm_msg(comm->first, metrics_json(), m.header, m.identities, s.key, s.iopub);
+            return;
+        }
+        handle_comm_msg(s.comms, decode_message<CommMsg>(m.content), m.header, m.identities, s.key, s.shell);
+    });
+    register_shell_handler("comm_close", [](KernelSession& s, JupyterMessage& m) {
+        handle_comm_close(s.comms, decode_message<CommClose>(m.content), m.header, m.identities);
+    });
+    register_shell_handler("comm_info_request", [](KernelSession& s, JupyterMessage& m) {
+        handle_comm_info_request(s.comms, decode_message<CommInfoRequest>(m.content), m.header, m.identities, s.key, s.shell);
+    });
+    register_shell_handler("complete_request", [](KernelSession& s, JupyterMessage& m) {
+        handle_complete_request(s.symbols, decode_message<CompleteRequest>(m.content), m.header, m.identities, s.key, s.shell);
+    });
+    register_shell_handler("inspect_request", [](KernelSession& s, JupyterMessage& m) {
+        handle_inspect_request(s.symbols, s.ghci, decode_message<InspectRequest>(m.content), m.header, m.identities, s.key, s.shell);
+    });
+    register_shell_handler("execute_request", [](KernelSession& s, JupyterMessage& m) {
+        handle_execute_request(s, m, nullptr);
+    });
+}
+
+// Requests without a handler, and handlers that fail on a malformed
+// message, get an error reply; the client stops waiting and the session
+// with its warm GHCi keeps running. Unknown notifications are only logged.
+void handle_shell_message(KernelSession& session, JupyterMessage& msg, Evaluation* precomputed = nullptr)
+{
+    const std::string& msg_type = msg.msg_type;
+    auto started = std::chrono::steady_clock::now();
+
+    send_status(session.iopub, "busy", msg.header, session.key);
+
+    StageTimer handling(Stage::handler);
+    try {
+        const ShellHandler* handler = precomputed ? nullptr : find_shell_handler(msg);
+        if (precomputed) {
+            handle_execute_request(session, msg, precomputed);
+        }
+        else if (handler) {
+            (*handler)(session, msg);
+        }
+        else {
+            std::cerr << "Unhandled message type " << msg_type << std::endl;
+            send_error_reply(msg_type, "UnsupportedMessage", "Unsupported message type " + msg_type,
+                msg.header, msg.identities, session.key, session.shell);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to handle " << msg_type << ": " << e.what() << std::endl;
+        send_error_reply(msg_type, "KernelError", e.what(), msg.header, msg.identities, session.key, session.shell);
+    }
+    handling.stop();
+
+    send_status(session.iopub, "idle", msg.header, session.key);
+    record_shell_message(msg.type, std::chrono::steady_clock::now() - started);
+}
+
+// Runs a stretch of queued expression cells on the parallel workers and
+// publishes them one by one in request order, exactly as if they had run on
+// the main ghci. A cell is published as soon as it and every cell before it
+// are done. Cells ghci types as IO actions may depend on each other's
+// effects (writeFile, then readFile), so they run in order on one worker.
+// After a failed cell with stop_on_error no further cell is started.
+void execute_parallel(KernelSession& session, std::vector<JupyterMessage>& queue, size_t begin, size_t end) {
+    std::vector<std::string> codes;
+    std::vector<bool> in_order;
+    std::vector<bool> stop_on_error;
+    std::vector<Evaluation> evals(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+        codes.push_back(queue[i].content.str("code", ""));
+        bool pure = session.expression_types.is_pure(session.ghci, codes.back());
+        lookup_cached(session, codes.back(), pure, evals[i - begin]);
+        in_order.push_back(!pure);
+        stop_on_error.push_back(decode_message<ExecuteRequest>(queue[i].content).stop_on_error);
+    }
+    evaluate_parallel(session.workers, session.modules, codes, in_order, stop_on_error, evals, [&](size_t i) {
+        handle_shell_message(session, queue[begin + i], &evals[i]);
+    });
+}
+
+// Candidates for the parallel workers, by their text; execute_parallel asks
+// ghci for their types.
+bool is_expression_request(JupyterMessage& msg) {
+    return msg.type == MsgType::execute_request && is_pure_expression(msg.content.str("code", ""));
+}
+
+// Runs everything queued on the session's shell socket, on a worker thread.
+// The queue is drained first so bursts of comm state updates can be
+// coalesced and consecutive expression cells can go to the parallel
+// workers; any other request first delivers the pending comm updates to
+// keep order.
+void service_session(KernelSession& session) {
+    auto handle = [&](JupyterMessage& msg) {
+        if (msg.type == MsgType::comm_close)
+            session.comm_throttle.forget(msg.content.str("comm_id", ""));
+        handle_shell_message(session, msg);
+    };
+
+    std::vector<JupyterMessage> queue;
+    JupyterMessage msg;
+    while (recv_message(session.shell, msg, zmq::recv_flags::dontwait)) {
+        queue.push_back(std::move(msg));
+        msg = JupyterMessage();
+    }
+
+    for (size_t i = 0; i < queue.size(); ++i) {
+        if (queue[i].type == MsgType::comm_msg && session.comm_throttle.push(queue[i]))
+            continue;
+        session.comm_throttle.flush(handle, true);
+
+        size_t end = i;
+        while (end < queue.size() && is_expression_request(queue[end])) ++end;
+        bool parallel = end - i > 1 && !session.workers.empty()
+            && !session.prompt_state && !session.aborting_queue;
+        if (parallel) {
+            execute_parallel(session, queue, i, end);
+            i = end - 1;
+        }
+        else {
+            handle(queue[i]);
+        }
+    }
+    if (!queue.empty()) session.aborting_queue = false;
+
+    session.comm_throttle.flush(handle, false);
+}
 
 int main(int argc, char* argv[]) {
-    exec_counter = 0;
+    KernelOptions options = parse_kernel_options(argc, argv, 1);
+    comm_verbose = options.verbose;
+    register_default_handlers();
 
-    if (argc < 2) {
-        std::cerr << "Usage: haskell_kernel.exe connection.json\n";
+    if (!options.valid || options.connection_files.empty()) {
+        std::cerr << "Usage: HJNKernel connection.json [connection.json ...] [--threads=N] [--ghci-workers=N] [--comm-max-rate=N] [--display-dir=PATH] [--cache-dir=PATH] [--exec-cache-mb=N] [--iopub-queue=N] [--iopub-queue-mb=N] [--record=PATH] [--stats-interval=SECONDS] [--interpreter=COMMAND] [--config=PATH] [--profile=NAME] [--cell-stats=off|time|gc] [--cell-timeout=SECONDS] [--interrupt-grace=SECONDS] [--max-heap=SIZE] [--max-memory-mb=N] [--cpu-limit=CORES] [--cgroup=PATH] [--verbose]\n";
         return 1;
     }
 
-    std::string conn_json = read_file(argv[1]);
-    if (conn_json.empty()) {
-        std::cerr << "Could not read connection file.\n";
+    LaunchProfile profile;
+    try {
+        profile = resolve_launch_profile(options, argv[0]);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
+    check_limits(options.limits);
+    iopub_publisher().capacity = options.iopub_queue;
+    iopub_publisher().max_bytes = options.iopub_queue_mb << 20;
+    data_frame_limit = options.iopub_queue_mb << 20;
 
-    Parser parser(conn_json);
-    JsonValue conn = parser.parse_value();
-
-    std::string transport = conn.o["transport"].s;
-    std::string ip = conn.o["ip"].s;
-    std::string key = conn.o["key"].s;
-    int shell_port = (int)conn.o["shell_port"].n;
-    int iopub_port = (int)conn.o["iopub_port"].n;
-    int stdin_port = (int)conn.o["stdin_port"].n;
-    int control_port = (int)conn.o["control_port"].n;
-    int hb_port = (int)conn.o["hb_port"].n;
+    TrafficLog recording;
+    if (!options.record_file.empty()) {
+        if (!recording.open(options.record_file)) {
+            std::cerr << "Could not create recording " << options.record_file << std::endl;
+            return 1;
+        }
+        traffic_log = &recording;
+    }
 
-    std::string shell_addr = transport + "://" + ip + ":" + std::to_string(shell_port);
-    std::string iopub_addr = transport + "://" + ip + ":" + std::to_string(iopub_port);
-    std::string stdin_addr = transport + "://" + ip + ":" + std::to_string(stdin_port);
-    std::string control_addr = transport + "://" + ip + ":" + std::to_string(control_port);
-    std::string hb_addr = transport + "://" + ip + ":" + std::to_string(hb_port);
+    size_t count = options.connection_files.size();
+    size_t threads = options.threads;
+    if (threads == 0)
+        threads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
 
+    // 5 sockets per session, the wake socket and one notifier per worker
     zmq::context_t ctx(1);
-    ctx.set(zmq::ctxopt::socket_limit, 5);
-    zmq::socket_t shell(ctx, zmq::socket_type::router);
-    shell.bind(shell_addr);
-    zmq::socket_t iopub(ctx, zmq::socket_type::pub);
-    iopub.bind(iopub_addr);
-    zmq::socket_t stdin_(ctx, zmq::socket_type::router);
-    stdin_.bind(stdin_addr);
-    zmq::socket_t control(ctx, zmq::socket_type::router);
-    control.bind(control_addr);
-    zmq::socket_t hb(ctx, zmq::socket_type::rep);
-    hb.bind(hb_addr);
-
-    GHCiBridge ghci;
-    ghci.start();
-
-    while (true) {
-        std::vector<zmq::message_t> parts;
-        bool got_message = false;
-
-        zmq::pollitem_t items[] = {
-            { static_cast<void*>(shell), 0, ZMQ_POLLIN, 0 }
-        };
-
-        int rc = zmq::poll(items, 1, std::chrono::milliseconds(1000));
+    ctx.set(zmq::ctxopt::max_sockets, (int)(count * 5 + threads + 16));
 
-        if (rc == -1) {
-            continue;
-        }
+    std::filesystem::path tmp = std::filesystem::temp_directory_path();
+    std::string pid = std::to_string(process_id());
+    if (options.display_dir.empty())
+        options.display_dir = (tmp / ("hjn_display_" + pid)).string();
+    if (options.cache_dir.empty())
+        options.cache_dir = (tmp / ("hjn_cache_" + pid)).string();
 
-        if (!(items[0].revents & ZMQ_POLLIN)) {
-            continue;
+    std::vector<std::unique_ptr<KernelSession>> sessions;
+    for (size_t i = 0; i < count; ++i) {
+        auto session = std::make_unique<KernelSession>();
+        if (!session->open(ctx, options.connection_files[i]))
+            return 1;
+
+        // Sessions never share directories, their files would collide
+        std::string suffix = count > 1 ? std::to_string(i) : "";
+        session->display_dir = count > 1 ? options.display_dir + "_" + suffix : options.display_dir;
+        if (!init_display_dir(session->display_dir))
+            return 1;
+        session->modules.init(count > 1 ? (std::filesystem::path(options.cache_dir) / suffix).string() : options.cache_dir);
+        session->exec_cache.max_bytes = options.exec_cache_mb << 20;
+        session->comm_throttle.set_max_rate(options.comm_max_rate);
+        session->comms.comm_targets["kernel_metrics"] = [](const std::string&, const JsonValue&) {};
+        session->ghci.env.push_back({ "HJN_DISPLAY_DIR", session->display_dir });
+        apply_launch_profile(session->ghci, profile);
+        session->ghci.timing = options.cell_stats != "off";
+        session->ghci.rts_stats = options.cell_stats == "gc";
+        session->ghci.limits = options.limits;
+        for (size_t j = 0; j < options.ghci_workers; ++j) {
+            auto worker = std::make_unique<GHCiWorker>();
+            worker->display_dir = session->display_dir + "_w" + std::to_string(j);
+            if (!init_display_dir(worker->display_dir))
+                return 1;
+            worker->ghci.env.push_back({ "HJN_DISPLAY_DIR", worker->display_dir });
+            apply_launch_profile(worker->ghci, profile);
+            worker->ghci.timing = session->ghci.timing;
+            worker->ghci.rts_stats = session->ghci.rts_stats;
+            worker->ghci.limits = options.limits;
+            session->workers.push_back(std::move(worker));
         }
+        if (traffic_log) {
+            traffic_log->add_source(session->shell, (uint16_t)i, TrafficChannel::shell);
+            traffic_log->add_source(session->iopub.socket, (uint16_t)i, TrafficChannel::iopub);
+        }
+        sessions.push_back(std::move(session));
+    }
+
+    // Workers hand a session back by clearing its busy flag and poking the
+    // poller through this socket.
+    zmq::socket_t wake(ctx, zmq::socket_type::pull);
+    wake.bind("inproc://hjn-wake");
 
-        while (true) {
-            zmq::message_t part;
-            zmq::recv_result_t received = shell.recv(part, zmq::recv_flags::none);
-            if (!received.has_value()) {
-                std::cerr << "Receive failed." << std::endl;
-                break;
+    ThreadPool pool;
+    pool.start(threads);
+
+    auto run = [&](KernelSession& session, std::function<void()> task) {
+        session.busy = true;
+        pool.submit([&session, &ctx, task = std::move(task)] {
+            task();
+            session.busy = false;
+
+            thread_local zmq::socket_t notify;
+            if (!notify) {
+                notify = zmq::socket_t(ctx, zmq::socket_type::push);
+                notify.connect("inproc://hjn-wake");
             }
-            parts.push_back(std::move(part));
-            got_message = true;
-            bool more = shell.get(zmq::sockopt::rcvmore);
-            if (!more) break;
+            notify.send(zmq::message_t(), zmq::send_flags::dontwait);
+        });
+    };
+
+    // GHCi startup dominates the launch time, so the sessions start in parallel
+    for (auto& session : sessions) {
+        KernelSession& s = *session;
+        run(s, [&s] {
+            std::thread workers([&s] { start_workers(s.workers); });
+            s.ghci.start();
+            s.symbols.rebuild(s.ghci, s.modules);
+            workers.join();
+        });
+    }
+
+    std::vector<zmq::pollitem_t> items;
+    std::vector<KernelSession*> polled;
+    auto stats_interval = std::chrono::seconds(options.stats_interval);
+    auto stats_due = std::chrono::steady_clock::now() + stats_interval;
+#ifdef SIGBREAK
+    std::signal(SIGBREAK, request_metrics_dump);
+#else
+    std::signal(SIGUSR1, request_metrics_dump);
+#endif
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    while (!stop_requested) {
+        if (metrics_dump_requested.exchange(false))
+            std::cerr << metrics_json().to_string() << std::endl;
+        if (options.stats_interval > 0 && std::chrono::steady_clock::now() >= stats_due) {
+            std::cerr << format_shell_stats();
+            stats_due += stats_interval;
         }
 
+        items.assign(1, { static_cast<void*>(wake), 0, ZMQ_POLLIN, 0 });
+        polled.clear();
 
-        if (!got_message) continue;
-        if (parts.size() < 6) {
-            std::cerr << "Incomplete message received: parts=" << parts.size() << std::endl;
-            continue;
+        std::chrono::milliseconds timeout(1000);
+        for (auto& session : sessions) {
+            if (session->busy) continue;
+            items.push_back({ static_cast<void*>(session->shell), 0, ZMQ_POLLIN, 0 });
+            polled.push_back(session.get());
+            if (!session->comm_throttle.empty())
+                timeout = std::min(timeout, session->comm_throttle.time_until_due());
         }
 
-        // Extract identities (everything before "<IDS|MSG>")
-        size_t i = 0;
-        std::vector<zmq::message_t> identities;
-        for (; i < parts.size(); ++i) {
-            std::string part_str(static_cast<char*>(parts[i].data()), parts[i].size());
-            if (part_str == "<IDS|MSG>") {
-                ++i;
-                break;
-            }
-            identities.push_back(std::move(parts[i]));
+        int rc;
+        try {
+            rc = zmq::poll(items, timeout);
+        }
+        catch (const zmq::error_t& e) {
+            if (e.num() != EINTR) throw; // a signal arrived, see above
+            continue;
         }
 
-        if (i + 4 > parts.size()) {
-            std::cerr << "Malformed message: missing header parts" << std::endl;
+        if (rc == -1) {
             continue;
-        } 
-
-        std::string signature = parts[i].to_string();
-        std::string header_json = parts[i + 1].to_string();
-        std::string parent_json = parts[i + 2].to_string();
-        std::string metadata_json = parts[i + 3].to_string();
-        std::string content_json = parts[i + 4].to_string();
-
-        Parser p(header_json);
-        JsonValue header = p.parse_value();
-        std::string msg_type = header.o["msg_type"].s;
-        std::string session = header.o["session"].s;
-
-        Parser p_parent(parent_json);
-        JsonValue parent_header = p_parent.parse_value();
-        Parser p2(content_json);
-        JsonValue content = p2.parse_value();
-
-        send_status(iopub, "busy", session, key);
-
-        if (msg_type == "kernel_info_request") {
-            send_kernel_info_reply(shell, identities, key, session, header);
-        }
-        else if (msg_type == "history_request") {
-            handle_history_request(content,
-                header,
-                identities,
-                key,
-                shell);
-        }
-        else if (msg_type == "comm_open") {
-            handle_comm_open(content, header,identities,key,shell);
-        }
-        else if (msg_type == "comm_msg") {
-            handle_comm_msg(content, header, identities, key, shell);
-        }
-        else if (msg_type == "comm_close") {
-            handle_comm_close(content, header, identities);
-        }
-        else if (msg_type == "comm_info_request") {
-            handle_comm_info_request(content, header, identities, key, shell);
-        }
-        else if (msg_type == "execute_request") {
-            if (!content.o["silent"].b && content.o["store_history"].b)
-                exec_counter++;
-
-            std::string code = content.o["code"].s;
-            send_execute_input(code, exec_counter, header, identities, key, iopub);
-            std::string ghci_result;
-            ghci_result = ghci.send(code);
-            /*
-            size_t n_new_lines = 0;
-            for (size_t i = 0; i < code.size(); i++)
-                if (code[i] == '\n') n_new_lines++;
-                
-            std::string ghci_result;
-            if (n_new_lines == 0)
-                ghci_result = ghci.send(code);
-            else
-                ghci_result = ghci.send_file_load(code);*/
-
-            send_execute_result(iopub, identities, header, ghci_result, exec_counter, key);
-            send_execute_reply(exec_counter, header, identities, key, shell);
         }
-        else {
-            std::cout << " --------------------------------------------------\n";
-            std::cout << "Unhandled message type " << msg_type << std::endl;
-            std::cout << " --------------------------------------------------\n";
-            exit(1);
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            zmq::message_t ping;
+            while (wake.recv(ping, zmq::recv_flags::dontwait)) {}
         }
 
-        send_status(iopub, "idle", session, key);
+        for (size_t i = 0; i < polled.size(); ++i) {
+            KernelSession& s = *polled[i];
+            bool readable = items[i + 1].revents & ZMQ_POLLIN;
+            bool due = !s.comm_throttle.empty() && s.comm_throttle.time_until_due().count() == 0;
+            if (readable || due)
+                run(s, [&s] { service_session(s); });
+        }
     }
 
-    ghci.stop();
+    pool.stop();
+    iopub_publisher().stop();
+    recording.close();
+    traffic_log = nullptr;
+    for (auto& session : sessions) {
+        session->ghci.stop();
+        stop_workers(session->workers);
+        session->close();
+    }
     return 0;
 }
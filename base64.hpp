@@ -0,0 +1,58 @@
+#ifndef BASE64_HPP
+#define BASE64_HPP
+
+#include <string>
+#include <stdint.h>
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encoded_size(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+// Appends the encoding of data to out. The output is sized once up front and
+// filled through a raw pointer; the main loop handles four 3-byte groups per
+// iteration with no data dependency between them.
+void base64_encode(const uint8_t* data, size_t len, std::string& out) {
+    size_t base = out.size();
+    out.resize(base + base64_encoded_size(len));
+    char* dst = &out[base];
+
+    size_t i = 0;
+    for (; i + 12 <= len; i += 12, dst += 16) {
+        for (int g = 0; g < 4; ++g) {
+            const uint8_t* src = data + i + g * 3;
+            uint32_t v = (uint32_t(src[0]) << 16) | (uint32_t(src[1]) << 8) | src[2];
+            dst[g * 4 + 0] = base64_chars[(v >> 18) & 0x3F];
+            dst[g * 4 + 1] = base64_chars[(v >> 12) & 0x3F];
+            dst[g * 4 + 2] = base64_chars[(v >> 6) & 0x3F];
+            dst[g * 4 + 3] = base64_chars[v & 0x3F];
+        }
+    }
+    for (; i + 3 <= len; i += 3, dst += 4) {
+        uint32_t v = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+        dst[0] = base64_chars[(v >> 18) & 0x3F];
+        dst[1] = base64_chars[(v >> 12) & 0x3F];
+        dst[2] = base64_chars[(v >> 6) & 0x3F];
+        dst[3] = base64_chars[v & 0x3F];
+    }
+
+    size_t rest = len - i;
+    if (rest > 0) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (rest == 2) v |= uint32_t(data[i + 1]) << 8;
+        dst[0] = base64_chars[(v >> 18) & 0x3F];
+        dst[1] = base64_chars[(v >> 12) & 0x3F];
+        dst[2] = rest == 2 ? base64_chars[(v >> 6) & 0x3F] : '=';
+        dst[3] = '=';
+    }
+}
+
+std::string base64_encode(const std::string& data) {
+    std::string out;
+    base64_encode(reinterpret_cast<const uint8_t*>(data.data()), data.size(), out);
+    return out;
+}
+
+#endif // BASE64_HPP
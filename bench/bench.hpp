@@ -0,0 +1,87 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Minimal benchmark harness: no dependencies, one line of output per case.
+
+template <class T>
+inline void do_not_optimize(const T& value) {
+#if defined(_MSC_VER)
+    const volatile char* p = reinterpret_cast<const volatile char*>(&value);
+    (void)*p;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations = 0;
+    double ns_per_op = 0;     // median over the measured batches
+    double bytes_per_sec = 0; // 0 when the case has no meaningful size
+};
+
+struct BenchOptions {
+    std::string filter;                           // run only cases whose name contains this
+    std::chrono::milliseconds min_time{ 500 };    // measuring time per case
+};
+
+// Calibrates a batch size that runs for at least 10 ms, then measures
+// batches until min_time has passed and reports the median batch.
+template <class F>
+bool run_benchmark(const BenchOptions& opts, std::vector<BenchResult>& results,
+    const std::string& name, size_t bytes_per_op, F&& fn)
+{
+    using clock = std::chrono::steady_clock;
+    if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos) return false;
+
+    for (int i = 0; i < 3; ++i) fn(); // warm caches and lazy statics
+
+    uint64_t batch = 1;
+    while (true) {
+        auto start = clock::now();
+        for (uint64_t i = 0; i < batch; ++i) fn();
+        if (clock::now() - start >= std::chrono::milliseconds(10) || batch >= (uint64_t(1) << 30)) break;
+        batch *= 2;
+    }
+
+    std::vector<double> samples;
+    auto begin = clock::now();
+    while (clock::now() - begin < opts.min_time || samples.size() < 5) {
+        auto start = clock::now();
+        for (uint64_t i = 0; i < batch; ++i) fn();
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        samples.push_back(ns / (double)batch);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult r;
+    r.name = name;
+    r.iterations = batch * samples.size();
+    r.ns_per_op = samples[samples.size() / 2];
+    if (bytes_per_op > 0) r.bytes_per_sec = (double)bytes_per_op / r.ns_per_op * 1e9;
+    results.push_back(r);
+
+    std::printf("%-40s %12llu %14.1f", r.name.c_str(), (unsigned long long)r.iterations, r.ns_per_op);
+    if (r.bytes_per_sec > 0) std::printf(" %12.1f MB/s", r.bytes_per_sec / 1e6);
+    std::printf("\n");
+    std::fflush(stdout);
+    return true;
+}
+
+inline void print_header() {
+    std::printf("%-40s %12s %14s %17s\n", "benchmark", "iterations", "ns/op", "throughput");
+}
+
+#endif
@@ -0,0 +1,304 @@
+// Microbenchmarks for the primitives on the kernel's message path. Payloads
+// are built from the notebooks in examples/: cell sources become
+// execute_request content, cell outputs become execute_result content.
+//
+// usage: bench_primitives [filter] [--examples=DIR] [--min-time-ms=N]
+
+#define _WINSOCKAPI_
+#define WIN32_LEAN_AND_MEAN
+
+#include "jupyter_protocol.hpp"
+#include "json_parser.hpp"
+#include "sha256.hpp"
+#include "jp_history.hpp"
+
+#include "bench.hpp"
+
+#include <filesystem>
+#include <iostream>
+
+#ifndef HJN_EXAMPLES_DIR
+#define HJN_EXAMPLES_DIR "examples"
+#endif
+
+struct Payloads {
+    std::vector<std::string> notebooks;       // raw .ipynb text
+    std::vector<std::string> cells;           // cell sources
+    std::vector<std::string> outputs;         // text/plain outputs
+    std::vector<std::string> requests;        // execute_request content JSON
+    std::vector<std::string> results;         // execute_result content JSON
+    std::string header;                       // a shell message header
+    std::string numbers;                      // comm_msg content with coordinate arrays
+    JsonValue numbers_value;
+    std::vector<JsonValue> result_values;
+    std::vector<JsonValue> notebook_values;
+};
+
+std::string join_lines(const JsonValue& v) {
+    if (v.type == JsonValue::String) return v.s;
+    std::string out;
+    for (const auto& line : v.a) out += line.s;
+    return out;
+}
+
+JsonValue str(const std::string& s) {
+    return JsonValue{ JsonValue::String, false, 0.0, s };
+}
+
+Payloads load_payloads(const std::string& dir) {
+    Payloads p;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() != ".ipynb") continue;
+        std::string text = read_file(entry.path().string());
+        Parser parser(text);
+        JsonValue nb = parser.parse_value();
+        p.notebooks.push_back(text);
+        p.notebook_values.push_back(nb);
+
+        for (auto& cell : nb.o["cells"].a) {
+            if (cell.o["cell_type"].s != "code") continue;
+            p.cells.push_back(join_lines(cell.o["source"]));
+            for (auto& out : cell.o["outputs"].a) {
+                if (out.o.count("data") && out.o["data"].o.count("text/plain"))
+                    p.outputs.push_back(join_lines(out.o["data"].o["text/plain"]));
+            }
+        }
+    }
+
+    for (const auto& code : p.cells) {
+        JsonValue content(JsonValue::Object);
+        content.o["code"] = str(code);
+        content.o["silent"] = JsonValue{ JsonValue::Bool, false };
+        content.o["store_history"] = JsonValue{ JsonValue::Bool, true };
+        content.o["user_expressions"] = JsonValue(JsonValue::Object);
+        content.o["allow_stdin"] = JsonValue{ JsonValue::Bool, true };
+        content.o["stop_on_error"] = JsonValue{ JsonValue::Bool, true };
+        p.requests.push_back(content.to_string());
+    }
+    for (size_t i = 0; i < p.outputs.size(); ++i) {
+        JsonValue data(JsonValue::Object);
+        data.o["text/plain"] = str(p.outputs[i]);
+        JsonValue content(JsonValue::Object);
+        content.o["data"] = data;
+        content.o["metadata"] = JsonValue(JsonValue::Object);
+        content.o["execution_count"] = JsonValue{ JsonValue::Number, false, (double)(i + 1) };
+        p.result_values.push_back(content);
+        p.results.push_back(content.to_string());
+    }
+
+    JsonValue header(JsonValue::Object);
+    header.o["msg_id"] = str(make_jupyter_style_id());
+    header.o["username"] = str("user");
+    header.o["session"] = str(make_uuid());
+    header.o["date"] = str(iso8601_now());
+    header.o["msg_type"] = str("execute_request");
+    header.o["version"] = str("5.3");
+    p.header = header.to_string();
+
+    // Newton iterates for x^3 - 2 from the example notebook, as a widget
+    // would plot them: one (step, x) point per iteration and start value
+    JsonValue xs(JsonValue::Array), ys(JsonValue::Array);
+    for (int start = 1; start <= 200; ++start) {
+        double x = start * 0.37;
+        for (int step = 0; step < 10; ++step) {
+            xs.a.push_back(JsonValue{ JsonValue::Number, false, (double)step });
+            ys.a.push_back(JsonValue{ JsonValue::Number, false, x });
+            x = x - (x * x * x - 2) / (3 * x * x);
+        }
+    }
+    JsonValue state(JsonValue::Object);
+    state.o["x"] = xs;
+    state.o["y"] = ys;
+    JsonValue data(JsonValue::Object);
+    data.o["method"] = str("update");
+    data.o["state"] = state;
+    p.numbers_value = JsonValue(JsonValue::Object);
+    p.numbers_value.o["comm_id"] = str(make_uuid());
+    p.numbers_value.o["data"] = data;
+    p.numbers = p.numbers_value.to_string();
+    return p;
+}
+
+size_t total_size(const std::vector<std::string>& v) {
+    size_t n = 0;
+    for (const auto& s : v) n += s.size();
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts;
+    std::string examples = HJN_EXAMPLES_DIR;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--examples=", 0) == 0) examples = arg.substr(11);
+        else if (arg.rfind("--min-time-ms=", 0) == 0) opts.min_time = std::chrono::milliseconds(std::stoi(arg.substr(14)));
+        else opts.filter = arg;
+    }
+
+    Payloads p = load_payloads(examples);
+    if (p.cells.empty()) {
+        std::cerr << "No notebooks found in " << examples << "\n";
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    print_header();
+
+    // JSON decoding
+    run_benchmark(opts, results, "parse_value/header", p.header.size(), [&] {
+        Parser parser(p.header);
+        do_not_optimize(parser.parse_value());
+    });
+    run_benchmark(opts, results, "parse_value/execute_request", total_size(p.requests), [&] {
+        for (const auto& r : p.requests) {
+            Parser parser(r);
+            do_not_optimize(parser.parse_value());
+        }
+    });
+    run_benchmark(opts, results, "parse_value/notebook", total_size(p.notebooks), [&] {
+        for (const auto& nb : p.notebooks) {
+            Parser parser(nb);
+            do_not_optimize(parser.parse_value());
+        }
+    });
+
+    run_benchmark(opts, results, "parse_value/comm_numbers", p.numbers.size(), [&] {
+        Parser parser(p.numbers);
+        do_not_optimize(parser.parse_value());
+    });
+
+    // What recv_message does with content: index only, then read one field
+    run_benchmark(opts, results, "lazy_index/execute_request", total_size(p.requests), [&] {
+        for (const auto& r : p.requests) {
+            LazyJson content;
+            content.index(r);
+            do_not_optimize(content.boolean("silent", false));
+        }
+    });
+    run_benchmark(opts, results, "lazy_index/notebook", total_size(p.notebooks), [&] {
+        for (const auto& nb : p.notebooks) {
+            LazyJson doc;
+            doc.index(nb);
+            do_not_optimize(doc.members.size());
+        }
+    });
+
+    // Typed decoding from the index: one pass, only declared fields
+    std::vector<LazyJson> indexed(p.requests.size());
+    for (size_t i = 0; i < p.requests.size(); ++i) indexed[i].index(p.requests[i]);
+    run_benchmark(opts, results, "decode_message/execute_request", total_size(p.requests), [&] {
+        for (const auto& content : indexed) do_not_optimize(decode_message<ExecuteRequest>(content));
+    });
+
+    // JSON encoding
+    run_benchmark(opts, results, "to_string/execute_result", total_size(p.results), [&] {
+        for (const auto& v : p.result_values) do_not_optimize(v.to_string());
+    });
+    run_benchmark(opts, results, "write_json/execute_result", total_size(p.results), [&] {
+        for (size_t i = 0; i < p.outputs.size(); ++i) {
+            ExecuteResult content;
+            content.execution_count = (int)(i + 1);
+            content.data.text = p.outputs[i];
+            std::string out;
+            write_json(content, out);
+            do_not_optimize(out);
+        }
+    });
+    run_benchmark(opts, results, "to_string/notebook", total_size(p.notebooks), [&] {
+        for (const auto& v : p.notebook_values) do_not_optimize(v.to_string());
+    });
+    run_benchmark(opts, results, "to_string/comm_numbers", p.numbers.size(), [&] {
+        do_not_optimize(p.numbers_value.to_string());
+    });
+
+    // Signing, over the four frames of a message as send_message does
+    const std::string key = make_uuid();
+    std::string small_frames = p.header + p.header + "{}" + p.requests.front();
+    std::string large_frames = p.header + p.header + "{}" + p.notebooks.front();
+    run_benchmark(opts, results, "hmac_sha256/execute_request", small_frames.size(), [&] {
+        do_not_optimize(hmac_sha256(key, small_frames));
+    });
+    run_benchmark(opts, results, "hmac_sha256/notebook", large_frames.size(), [&] {
+        do_not_optimize(hmac_sha256(key, large_frames));
+    });
+
+    // Header fields
+    run_benchmark(opts, results, "make_jupyter_style_id", 0, [&] {
+        do_not_optimize(make_jupyter_style_id());
+    });
+    run_benchmark(opts, results, "iso8601_now", 0, [&] {
+        do_not_optimize(iso8601_now());
+    });
+
+    // Full outgoing message, received on the other end of an inproc pair
+    {
+        zmq::context_t ctx(1);
+        zmq::socket_t out(ctx, zmq::socket_type::pair);
+        zmq::socket_t in(ctx, zmq::socket_type::pair);
+        out.bind("inproc://bench");
+        in.connect("inproc://bench");
+
+        Parser parser(p.header);
+        MessageHeader parent(parser.parse_value());
+        std::vector<zmq::message_t> identities;
+        std::string topic = "execute_result";
+        identities.emplace_back(topic.begin(), topic.end());
+        const JsonValue& content = p.result_values.front();
+
+        run_benchmark(opts, results, "send_message/inproc", p.results.front().size(), [&] {
+            send_message("execute_result", content, parent, identities, key, out);
+            zmq::message_t part;
+            do {
+                (void)in.recv(part);
+            } while (part.more());
+        });
+    }
+
+    // Round trip of an execute_request between a frontend's DEALER and the
+    // kernel's ROUTER on the same machine, over loopback TCP and over ipc
+    for (std::string transport : { "tcp", "ipc" }) {
+        std::string path = (std::filesystem::temp_directory_path() / ("hjn_bench_" + std::to_string(process_id()))).string();
+        zmq::context_t ctx(1);
+        zmq::socket_t kernel(ctx, zmq::socket_type::router);
+        zmq::socket_t frontend(ctx, zmq::socket_type::dealer);
+        try {
+            kernel.bind(transport == "ipc" ? "ipc://" + path : "tcp://127.0.0.1:*");
+        }
+        catch (const zmq::error_t& e) {
+            std::cerr << "Skipping round_trip/" << transport << ": " << e.what() << "\n";
+            continue;
+        }
+        frontend.connect(kernel.get(zmq::sockopt::last_endpoint));
+
+        const std::string& request = p.requests.front();
+        run_benchmark(opts, results, "round_trip/" + transport, request.size(), [&] {
+            frontend.send(zmq::buffer(request), zmq::send_flags::none);
+            zmq::message_t id, body;
+            (void)kernel.recv(id);
+            (void)kernel.recv(body);
+            kernel.send(std::move(id), zmq::send_flags::sndmore);
+            kernel.send(std::move(body), zmq::send_flags::none);
+            (void)frontend.recv(body);
+        });
+        kernel.close();
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+
+    // History search over a long session
+    {
+        std::vector<HistoryEntry> history;
+        for (int i = 0; i < 1000; ++i) {
+            const std::string& code = p.cells[i % p.cells.size()];
+            history.push_back({ 1, i + 1, code, "" });
+        }
+        run_benchmark(opts, results, "search_history/pattern", 0, [&] {
+            do_not_optimize(search_history(history, "*where*", false));
+        });
+        run_benchmark(opts, results, "search_history/unique", 0, [&] {
+            do_not_optimize(search_history(history, "*", true));
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+// End-to-end load generator for a running kernel. Every client is a shell
+// connection with one request in flight; a request counts as done when the
+// kernel publishes the idle status for it on IOPub. Run the kernel with the
+// stub interpreter to measure the kernel rather than GHC, and with
+// --comm-max-rate=0 when measuring comm traffic:
+//
+//   HJNKernel.exe conn.json --interpreter="stub_ghci.exe" --comm-max-rate=0
+//   loadgen conn.json --clients=8 --requests=2000 --mix=execute,comm,history
+
+#define _WINSOCKAPI_
+#define WIN32_LEAN_AND_MEAN
+
+#include "jupyter_protocol.hpp"
+#include "json_parser.hpp"
+#include "sha256.hpp"
+#include "kernel_metrics.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+enum class Traffic { execute, comm, history, count };
+
+const char* traffic_names[] = { "execute", "comm", "history" };
+
+struct Client {
+    zmq::socket_t shell;
+    std::string session;
+    std::string comm_id;
+    size_t sent = 0;
+    size_t done = 0;
+    Traffic pending = Traffic::execute;
+    std::chrono::steady_clock::time_point sent_at;
+};
+
+JsonValue str(const std::string& s) {
+    return JsonValue{ JsonValue::String, false, 0.0, s };
+}
+
+JsonValue boolean(bool b) {
+    return JsonValue{ JsonValue::Bool, b };
+}
+
+// Sends a signed request, returns its msg_id.
+std::string send_request(Client& client, const std::string& msg_type, const JsonValue& content, const std::string& key) {
+    std::string msg_id = make_uuid();
+    JsonValue header(JsonValue::Object);
+    header.o["msg_id"] = str(msg_id);
+    header.o["username"] = str("loadgen");
+    header.o["session"] = str(client.session);
+    header.o["date"] = str(iso8601_now());
+    header.o["msg_type"] = str(msg_type);
+    header.o["version"] = str("5.3");
+
+    std::string header_json = header.to_string();
+    std::string parent_json = "{}";
+    std::string meta_json = "{}";
+    std::string content_json = content.to_string();
+    std::string sig = hmac_sha256(key, { header_json, parent_json, meta_json, content_json });
+
+    const std::string delimiter = "<IDS|MSG>";
+    client.shell.send(zmq::buffer(delimiter), zmq::send_flags::sndmore);
+    client.shell.send(zmq::buffer(sig), zmq::send_flags::sndmore);
+    client.shell.send(zmq::buffer(header_json), zmq::send_flags::sndmore);
+    client.shell.send(zmq::buffer(parent_json), zmq::send_flags::sndmore);
+    client.shell.send(zmq::buffer(meta_json), zmq::send_flags::sndmore);
+    client.shell.send(zmq::buffer(content_json), zmq::send_flags::none);
+    return msg_id;
+}
+
+std::string send_next(Client& client, Traffic kind, const std::string& code, const std::string& key) {
+    client.pending = kind;
+    client.sent_at = std::chrono::steady_clock::now();
+    client.sent++;
+
+    JsonValue content(JsonValue::Object);
+    switch (kind) {
+    case Traffic::execute:
+        content.o["code"] = str(code);
+        content.o["silent"] = boolean(false);
+        content.o["store_history"] = boolean(true);
+        content.o["user_expressions"] = JsonValue(JsonValue::Object);
+        content.o["allow_stdin"] = boolean(false);
+        content.o["stop_on_error"] = boolean(false);
+        return send_request(client, "execute_request", content, key);
+    case Traffic::comm: {
+        JsonValue data(JsonValue::Object);
+        data.o["value"] = JsonValue{ JsonValue::Number, false, (double)client.sent };
+        content.o["comm_id"] = str(client.comm_id);
+        content.o["data"] = data;
+        return send_request(client, "comm_msg", content, key);
+    }
+    default:
+        content.o["output"] = boolean(false);
+        content.o["raw"] = boolean(true);
+        content.o["hist_access_type"] = str("tail");
+        content.o["n"] = JsonValue{ JsonValue::Number, false, 10.0 };
+        return send_request(client, "history_request", content, key);
+    }
+}
+
+// Returns the parent msg_id of an idle status message, or "".
+std::string idle_parent(std::vector<zmq::message_t>& parts) {
+    size_t i = 0;
+    while (i < parts.size() && parts[i].to_string() != "<IDS|MSG>") ++i;
+    if (i + 5 >= parts.size()) return "";
+
+    std::string header_json = parts[i + 2].to_string();
+    if (header_json.find("\"status\"") == std::string::npos) return "";
+    Parser header_parser(header_json);
+    JsonValue header = header_parser.parse_value();
+    if (header.o["msg_type"].s != "status") return "";
+
+    std::string content_json = parts[i + 5].to_string();
+    Parser content_parser(content_json);
+    JsonValue content = content_parser.parse_value();
+    if (content.o["execution_state"].s != "idle") return "";
+
+    std::string parent_json = parts[i + 3].to_string();
+    Parser parent_parser(parent_json);
+    JsonValue parent = parent_parser.parse_value();
+    return parent.o["msg_id"].s;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: loadgen connection.json [--clients=N] [--requests=N] [--mix=execute,comm,history] [--code=EXPR]\n";
+        return 1;
+    }
+
+    size_t clients_count = 4;
+    size_t requests = 1000; // per client
+    std::vector<Traffic> mix{ Traffic::execute };
+    std::string code = "1 + 1";
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--clients=", 0) == 0) clients_count = std::stoul(arg.substr(10));
+        else if (arg.rfind("--requests=", 0) == 0) requests = std::stoul(arg.substr(11));
+        else if (arg.rfind("--code=", 0) == 0) code = arg.substr(7);
+        else if (arg.rfind("--mix=", 0) == 0) {
+            mix.clear();
+            std::stringstream ss(arg.substr(6));
+            std::string kind;
+            while (std::getline(ss, kind, ',')) {
+                for (size_t k = 0; k < (size_t)Traffic::count; ++k)
+                    if (kind == traffic_names[k]) mix.push_back((Traffic)k);
+            }
+            if (mix.empty()) {
+                std::cerr << "Unknown --mix " << arg.substr(6) << "\n";
+                return 1;
+            }
+        }
+        else std::cerr << "Ignoring argument " << arg << "\n";
+    }
+
+    std::string conn_json = read_file(argv[1]);
+    if (conn_json.empty()) {
+        std::cerr << "Could not read connection file.\n";
+        return 1;
+    }
+    Parser parser(conn_json);
+    JsonValue conn = parser.parse_value();
+    std::string key = conn.o["key"].s;
+    auto endpoint = [&](const char* port) {
+        return zmq_endpoint(conn.o["transport"].s.empty() ? "tcp" : conn.o["transport"].s, conn.o["ip"].s, (int)conn.o[port].n);
+    };
+
+    zmq::context_t ctx(1);
+    zmq::socket_t iopub(ctx, zmq::socket_type::sub);
+    iopub.set(zmq::sockopt::subscribe, "");
+    iopub.connect(endpoint("iopub_port"));
+
+    std::vector<Client> clients(clients_count);
+    for (auto& c : clients) {
+        c.shell = zmq::socket_t(ctx, zmq::socket_type::dealer);
+        c.shell.connect(endpoint("shell_port"));
+        c.session = make_uuid();
+        c.comm_id = make_uuid();
+    }
+
+    // SUB sockets miss everything published before the subscription arrives
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::vector<Histogram> latency((size_t)Traffic::count);
+    std::vector<size_t> completed((size_t)Traffic::count);
+    std::unordered_map<std::string, size_t> in_flight; // msg_id -> client
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clients.size(); ++i) {
+        in_flight[send_next(clients[i], mix[0], code, key)] = i;
+    }
+
+    size_t remaining = clients.size() * requests;
+    auto last_progress = std::chrono::steady_clock::now();
+    std::vector<zmq::pollitem_t> items;
+    while (remaining > 0) {
+        items.assign(1, { static_cast<void*>(iopub), 0, ZMQ_POLLIN, 0 });
+        for (auto& c : clients) items.push_back({ static_cast<void*>(c.shell), 0, ZMQ_POLLIN, 0 });
+        zmq::poll(items, std::chrono::milliseconds(100));
+
+        // Shell replies are only drained, completion is the idle status
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (!(items[i + 1].revents & ZMQ_POLLIN)) continue;
+            zmq::message_t part;
+            while (clients[i].shell.recv(part, zmq::recv_flags::dontwait)) {}
+        }
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            while (true) {
+                std::vector<zmq::message_t> parts;
+                zmq::message_t part;
+                if (!iopub.recv(part, zmq::recv_flags::dontwait)) break;
+                parts.push_back(std::move(part));
+                while (parts.back().more()) {
+                    zmq::message_t next;
+                    (void)iopub.recv(next);
+                    parts.push_back(std::move(next));
+                }
+
+                auto it = in_flight.find(idle_parent(parts));
+                if (it == in_flight.end()) continue;
+                Client& c = clients[it->second];
+                size_t index = it->second;
+                in_flight.erase(it);
+
+                auto now = std::chrono::steady_clock::now();
+                latency[(size_t)c.pending].record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - c.sent_at).count());
+                completed[(size_t)c.pending]++;
+                c.done++;
+                remaining--;
+                last_progress = now;
+                if (c.sent < requests)
+                    in_flight[send_next(c, mix[c.sent % mix.size()], code, key)] = index;
+            }
+        }
+
+        if (std::chrono::steady_clock::now() - last_progress > std::chrono::seconds(10)) {
+            std::cerr << "No progress for 10 s, " << remaining << " requests unanswered\n";
+            break;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t total = 0;
+    std::printf("%-10s %10s %12s %10s %10s %10s\n", "traffic", "count", "msgs/s", "p50_us", "p99_us", "max_us");
+    for (size_t k = 0; k < (size_t)Traffic::count; ++k) {
+        if (completed[k] == 0) continue;
+        total += completed[k];
+        std::printf("%-10s %10zu %12.1f %10llu %10llu %10llu\n", traffic_names[k], completed[k], completed[k] / seconds,
+            (unsigned long long)latency[k].percentile(50), (unsigned long long)latency[k].percentile(99),
+            (unsigned long long)latency[k].max.load());
+    }
+    std::printf("%-10s %10zu %12.1f   clients=%zu elapsed=%.2fs\n", "total", total, total / seconds, clients.size(), seconds);
+    return remaining == 0 ? 0 : 1;
+}
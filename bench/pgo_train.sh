@@ -0,0 +1,41 @@
+#!/bin/sh
+# Collects profiles for a PGO build by running the benchmark workloads on an
+# instrumented build:
+#
+#   cmake --preset pgo-generate && cmake --build --preset pgo-generate
+#   bench/pgo_train.sh build/pgo
+#   cmake --preset pgo-use && cmake --build --preset pgo-use
+#
+# The kernel runs the loadgen mix against the stub interpreter, so the
+# profile covers the message path rather than time spent waiting on GHC.
+set -e
+
+BUILD=${1:-build/pgo}
+PORT=${HJN_PGO_PORT:-56100}
+CONN=$(mktemp)
+trap 'rm -f "$CONN"' EXIT
+
+cat > "$CONN" <<EOF
+{
+  "transport": "tcp", "ip": "127.0.0.1", "signature_scheme": "hmac-sha256",
+  "key": "pgo-training-key",
+  "shell_port": $PORT, "iopub_port": $((PORT + 1)), "stdin_port": $((PORT + 2)),
+  "control_port": $((PORT + 3)), "hb_port": $((PORT + 4))
+}
+EOF
+
+"$BUILD/bench/bench_primitives" --min-time-ms=100 > /dev/null
+
+"$BUILD/HJNKernel" "$CONN" --interpreter="$BUILD/bench/stub_ghci" --comm-max-rate=0 --exec-cache-mb=16 &
+KERNEL=$!
+sleep 2
+"$BUILD/bench/loadgen" "$CONN" --clients=8 --requests=2000 --mix=execute,comm,history
+"$BUILD/bench/loadgen" "$CONN" --clients=2 --requests=500 --mix=execute --code='map (*2) [1..10]'
+# profiles are written when the kernel exits normally
+kill -TERM $KERNEL
+wait $KERNEL
+
+# clang writes raw profiles that have to be merged first
+if ls "$BUILD"/pgo/*.profraw > /dev/null 2>&1; then
+    llvm-profdata merge -output="$BUILD/pgo/default.profdata" "$BUILD"/pgo/*.profraw
+fi
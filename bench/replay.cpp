@@ -0,0 +1,204 @@
+// Replays the shell requests of a recording (HJNKernel --record=PATH) into a
+// running kernel and compares the reply latencies with the recorded ones.
+// Start the kernel the way the recorded one was started, then:
+//
+//   HJNKernel.exe conn.json --interpreter="ghci.exe"
+//   replay capture.hjn conn.json --speed=max
+//
+// --speed=original sends every request at its recorded offset from the
+// first one. --speed=max sends as fast as the kernel allows while keeping
+// the recorded order: a request waits only for the replies the kernel had
+// sent before the request arrived, as a frontend waiting on them would.
+// Requests are re-signed with the key of the target kernel; each recorded
+// shell connection gets its own DEALER so replies route the same way.
+
+#define _WINSOCKAPI_
+#define WIN32_LEAN_AND_MEAN
+
+#include "jupyter_protocol.hpp"
+#include "json_parser.hpp"
+#include "sha256.hpp"
+#include "kernel_metrics.hpp"
+#include "traffic_log.hpp"
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+
+struct Request {
+    uint64_t time_ns;
+    size_t connection;              // index into the DEALERs
+    size_t replies_before;          // shell replies the kernel had sent when it arrived
+    std::vector<std::string_view> frames; // from the delimiter on
+    std::string msg_id;
+    std::string msg_type;
+    uint64_t recorded_us = UINT64_MAX; // until the recorded reply, none if no reply
+};
+
+// Index of the "<IDS|MSG>" frame.
+size_t delimiter_index(const std::vector<std::string_view>& frames) {
+    for (size_t i = 0; i < frames.size(); ++i)
+        if (frames[i] == "<IDS|MSG>") return i;
+    return frames.size();
+}
+
+std::string member(std::string_view json, std::string_view key) {
+    LazyJson doc;
+    if (!doc.index(std::string(json)) || !doc.has(key)) return "";
+    return doc.str(key);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: replay recording connection.json [--session=N] [--speed=original|max]\n";
+        return 1;
+    }
+
+    uint16_t session = 0;
+    bool original_speed = false;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--session=", 0) == 0) session = (uint16_t)std::stoul(arg.substr(10));
+        else if (arg == "--speed=original") original_speed = true;
+        else if (arg == "--speed=max") original_speed = false;
+        else std::cerr << "Ignoring argument " << arg << "\n";
+    }
+
+    std::string data = read_file(argv[1]);
+    std::vector<TrafficRecord> records;
+    if (!read_traffic(data, records)) {
+        std::cerr << "Not a recording: " << argv[1] << "\n";
+        return 1;
+    }
+
+    // Requests in arrival order, with the recorded latency of their replies
+    std::vector<Request> requests;
+    std::unordered_map<std::string, size_t> by_msg_id;
+    std::map<std::string, size_t> connections; // routing id -> DEALER
+    size_t replies = 0;
+    for (const auto& r : records) {
+        if (r.session != session || r.channel != TrafficChannel::shell) continue;
+        size_t d = delimiter_index(r.frames);
+        if (d + 5 >= r.frames.size()) continue;
+
+        if (r.direction == TrafficDirection::sent) {
+            replies++;
+            auto it = by_msg_id.find(member(r.frames[d + 3], "msg_id"));
+            if (it != by_msg_id.end() && requests[it->second].recorded_us == UINT64_MAX)
+                requests[it->second].recorded_us = (r.time_ns - requests[it->second].time_ns) / 1000;
+            continue;
+        }
+
+        std::string routing;
+        for (size_t i = 0; i < d; ++i) routing.append(r.frames[i]).push_back('\0');
+        Request req;
+        req.time_ns = r.time_ns;
+        req.connection = connections.emplace(routing, connections.size()).first->second;
+        req.replies_before = replies;
+        req.frames.assign(r.frames.begin() + d, r.frames.end());
+        req.msg_id = member(r.frames[d + 2], "msg_id");
+        req.msg_type = member(r.frames[d + 2], "msg_type");
+        by_msg_id[req.msg_id] = requests.size();
+        requests.push_back(std::move(req));
+    }
+    if (requests.empty()) {
+        std::cerr << "No shell requests for session " << session << " in " << argv[1] << "\n";
+        return 1;
+    }
+
+    std::string conn_json = read_file(argv[2]);
+    if (conn_json.empty()) {
+        std::cerr << "Could not read connection file.\n";
+        return 1;
+    }
+    Parser parser(conn_json);
+    JsonValue conn = parser.parse_value();
+    std::string key = conn.o["key"].s;
+    std::string transport = conn.o["transport"].s.empty() ? "tcp" : conn.o["transport"].s;
+
+    zmq::context_t ctx(1);
+    std::vector<zmq::socket_t> dealers;
+    for (size_t i = 0; i < connections.size(); ++i) {
+        dealers.emplace_back(ctx, zmq::socket_type::dealer);
+        dealers.back().connect(zmq_endpoint(transport, conn.o["ip"].s, (int)conn.o["shell_port"].n));
+    }
+
+    std::map<std::string, Histogram> replayed, recorded;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> sent_at;
+    size_t received = 0, expected = 0;
+    for (const auto& req : requests) expected += req.recorded_us != UINT64_MAX;
+
+    // Takes the replies that are waiting, for up to timeout.
+    auto receive = [&](std::chrono::milliseconds timeout) {
+        std::vector<zmq::pollitem_t> items;
+        for (auto& d : dealers) items.push_back({ static_cast<void*>(d), 0, ZMQ_POLLIN, 0 });
+        zmq::poll(items, timeout);
+        for (size_t i = 0; i < dealers.size(); ++i) {
+            if (!(items[i].revents & ZMQ_POLLIN)) continue;
+            JupyterMessage reply;
+            while (recv_message(dealers[i], reply, zmq::recv_flags::dontwait)) {
+                auto now = std::chrono::steady_clock::now();
+                auto it = sent_at.find(reply.parent_header.has("msg_id") ? reply.parent_header.str("msg_id") : "");
+                if (it != sent_at.end()) {
+                    auto req = by_msg_id.find(it->first);
+                    replayed[requests[req->second].msg_type].record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - it->second).count());
+                    sent_at.erase(it);
+                }
+                received++;
+                reply = JupyterMessage();
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto last_progress = start;
+    for (const auto& req : requests) {
+        if (original_speed) {
+            auto due = start + std::chrono::nanoseconds(req.time_ns - requests.front().time_ns);
+            while (std::chrono::steady_clock::now() < due)
+                receive(std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()));
+        }
+        else {
+            while (received < req.replies_before) {
+                size_t before = received;
+                receive(std::chrono::milliseconds(100));
+                if (received != before) last_progress = std::chrono::steady_clock::now();
+                else if (std::chrono::steady_clock::now() - last_progress > std::chrono::seconds(10)) break;
+            }
+        }
+
+        // [delimiter, signature, header, parent, metadata, content, buffers...]
+        std::string sig = hmac_sha256(key, { req.frames[2], req.frames[3], req.frames[4], req.frames[5] });
+        zmq::socket_t& dealer = dealers[req.connection];
+        for (size_t i = 0; i < req.frames.size(); ++i) {
+            std::string_view frame = i == 1 ? std::string_view(sig) : req.frames[i];
+            dealer.send(zmq::buffer(frame), i + 1 < req.frames.size() ? zmq::send_flags::sndmore : zmq::send_flags::none);
+        }
+        sent_at[req.msg_id] = std::chrono::steady_clock::now();
+        if (req.recorded_us != UINT64_MAX) recorded[req.msg_type].record(req.recorded_us);
+    }
+
+    last_progress = std::chrono::steady_clock::now();
+    while (received < expected) {
+        size_t before = received;
+        receive(std::chrono::milliseconds(100));
+        if (received != before) last_progress = std::chrono::steady_clock::now();
+        else if (std::chrono::steady_clock::now() - last_progress > std::chrono::seconds(10)) {
+            std::cerr << "No reply for 10 s, " << expected - received << " replies missing\n";
+            break;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double recorded_seconds = (double)(requests.back().time_ns - requests.front().time_ns) / 1e9;
+    std::printf("%-22s %8s %10s %10s %10s %12s %12s\n", "msg_type", "count", "p50_us", "p99_us", "max_us", "rec_p50_us", "rec_p99_us");
+    for (auto& [type, h] : replayed) {
+        Histogram& r = recorded[type];
+        std::printf("%-22s %8llu %10llu %10llu %10llu %12llu %12llu\n", type.c_str(), (unsigned long long)h.total.load(),
+            (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99), (unsigned long long)h.max.load(),
+            (unsigned long long)r.percentile(50), (unsigned long long)r.percentile(99));
+    }
+    std::printf("requests=%zu replies=%zu/%zu elapsed=%.2fs recorded=%.2fs speed=%s\n", requests.size(), received, expected,
+        seconds, recorded_seconds, original_speed ? "original" : "max");
+    return received >= expected ? 0 : 1;
+}
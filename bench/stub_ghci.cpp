@@ -0,0 +1,67 @@
+// Stand-in for ghci when benchmarking the kernel without GHC: prints a
+// ghci-like prompt, echoes every expression and paste block back as its
+// result after an optional delay, and ignores ghci commands other than
+// :set +s, which adds a ghci-style timing footer to every result.
+//
+// usage: HJNKernel.exe conn.json --interpreter="stub_ghci.exe --delay-ms=5"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+int main(int argc, char* argv[]) {
+    int delay_ms = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--delay-ms=", 0) == 0) delay_ms = std::stoi(arg.substr(11));
+    }
+
+    auto prompt = [] {
+        std::cout << "ghci> " << std::flush;
+    };
+    bool timing = false;
+    auto evaluate = [&](const std::string& code) {
+        auto started = std::chrono::steady_clock::now();
+        if (delay_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        std::cout << code << "\n";
+        if (timing) {
+            // "(0.01 secs, 1,234,000 bytes)", allocation made up from the code size
+            std::string bytes = std::to_string((code.size() + 1) * 1000);
+            for (int i = (int)bytes.size() - 3; i > 0; i -= 3) bytes.insert((size_t)i, ",");
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            std::cout << "(" << std::fixed << std::setprecision(2) << secs << " secs, " << bytes << " bytes)\n";
+        }
+    };
+
+    std::cout << "GHCi, stub interpreter for benchmarks\n";
+    prompt();
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        if (line == ":{") {
+            std::string block;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                std::cout << "ghci| " << std::flush;
+                if (line == ":}") break;
+                block += block.empty() ? line : "\n" + line;
+            }
+            evaluate(block);
+        }
+        else if (line == ":set +s") {
+            timing = true;
+        }
+        else if (line == ":q" || line == ":quit") {
+            break;
+        }
+        else if (!line.empty() && line[0] != ':' && line.rfind("import ", 0) != 0) {
+            evaluate(line);
+        }
+        prompt();
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef EXEC_CACHE_HPP
+#define EXEC_CACHE_HPP
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include "sha256.hpp"
+#include "ghci_bridge.hpp"
+#include "ghci_modules.hpp"
+
+// Opt-in memoization of expression cells (--exec-cache-mb). Entries are keyed
+// by SHA-256 of the expression and the hash of the loaded definition set, and
+// evicted least recently used once the stored output exceeds the size limit.
+// Only expressions that ExpressionTypes says are not IO actions are stored;
+// any cell that can change prompt state drops the whole cache.
+
+// Single line expression: no ghci command, import, let or <- statement and no
+// prompt binding like "x = 5".
+bool is_pure_expression(const std::string& code) {
+    std::string line = trim(code);
+    if (line.empty() || line.find('\n') != std::string::npos) return false;
+    if (line[0] == ':' || starts_with_word(line, "import") || starts_with_word(line, "let")) return false;
+    if (line.find("<-") != std::string::npos) return false;
+    return !has_binding_operator(line, false);
+}
+
+// True if ghci runs a value of this type (the text after "::" in :type
+// output) as an IO action: anything mentioning IO, or a type like "m a" whose
+// head is a variable, which the prompt instantiates to IO.
+bool type_runs_io(const std::string& type) {
+    std::vector<HsToken> t = tokenize_haskell(type);
+    size_t head = 0;
+    for (size_t i = 0; i < t.size(); ++i) {
+        const std::string& text = t[i].text;
+        if (text == "IO" || (t[i].kind == HsToken::other && text.size() > 3 && text.compare(text.size() - 3, 3, ".IO") == 0))
+            return true;
+        if (text == "=>") head = i + 1;
+    }
+    if (head < t.size() && t[head].text == "forall") {
+        while (head < t.size() && t[head].text != ".") ++head;
+        ++head;
+    }
+    return head + 1 < t.size() && t[head].kind == HsToken::varid && t[head + 1].text != "->";
+}
+
+// ghci's :type verdict on pure looking expressions (is_pure_expression):
+// whether the value is an IO action. readFile, getLine or print never change
+// their text but must run every time, and in order with each other. Asked
+// once per expression; the caller clears the verdicts whenever a cell may
+// change what names mean (definitions, imports, prompt bindings).
+struct ExpressionTypes {
+    std::unordered_map<std::string, bool> pure;
+
+    void clear() {
+        pure.clear();
+    }
+
+    bool is_pure(GHCiBridge& ghci, const std::string& code) {
+        if (!is_pure_expression(code)) return false;
+        auto it = pure.find(code);
+        if (it != pure.end()) return it->second;
+
+        std::string expr = trim(code);
+        GHCiResult res = ghci.command(":type " + expr);
+        bool verdict = res.err.empty() && !res.died && res.limit == LimitAction::none;
+        if (verdict) {
+            // "expr :: type", the expression echoed as typed
+            size_t sig = res.out.find("::", res.out.compare(0, expr.size(), expr) == 0 ? expr.size() : 0);
+            verdict = sig != std::string::npos && !type_runs_io(res.out.substr(sig + 2));
+        }
+        if (pure.size() >= 4096) pure.clear();
+        pure.emplace(code, verdict);
+        return verdict;
+    }
+};
+
+struct ExecCache {
+    struct Entry {
+        std::string key;
+        GHCiResult result;
+    };
+
+    size_t max_bytes = 0; // 0 = disabled
+    size_t bytes = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    std::string definitions_hash;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+    bool enabled() const {
+        return max_bytes > 0;
+    }
+
+    static size_t entry_size(const Entry& e) {
+        return e.key.size() + e.result.out.size() + e.result.err.size();
+    }
+
+    std::string make_key(const std::string& code, const std::string& defs_hash) const {
+        SHA256 sha;
+        sha.update(defs_hash);
+        sha.update("\n");
+        sha.update(code);
+        return sha.digest();
+    }
+
+    void clear() {
+        entries.clear();
+        index.clear();
+        bytes = 0;
+    }
+
+    // Entries for an older definition set can never hit again.
+    void sync(const std::string& defs_hash) {
+        if (defs_hash != definitions_hash) {
+            clear();
+            definitions_hash = defs_hash;
+        }
+    }
+
+    bool lookup(const std::string& code, GHCiResult& result) {
+        auto it = index.find(make_key(code, definitions_hash));
+        if (it == index.end()) {
+            misses++;
+            return false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        result = it->second->result;
+        hits++;
+        return true;
+    }
+
+    void store(const std::string& code, const GHCiResult& result) {
+        Entry e{ make_key(code, definitions_hash), result };
+        size_t size = entry_size(e);
+        if (size > max_bytes || index.count(e.key)) return;
+
+        while (bytes + size > max_bytes && !entries.empty()) {
+            bytes -= entry_size(entries.back());
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        entries.push_front(std::move(e));
+        index[entries.front().key] = entries.begin();
+        bytes += size;
+    }
+};
+
+#endif // EXEC_CACHE_HPP
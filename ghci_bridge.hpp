@@ -1,85 +1,619 @@
 #ifndef GHCIBRIDGE_HPP
 #define GHCIBRIDGE_HPP
 
-#include <windows.h>
+#include "platform.hpp"
 #include <string>
 #include <regex>
 #include <vector>
 #include <fstream>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <string_view>
+#include <cwchar>
+#include <functional>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
+#include "ghci_channel.hpp"
+#include "kernel_metrics.hpp"
+#include "resource_limits.hpp"
+#include "watchdog.hpp"
+
+// Cost of one evaluation. secs and allocated_bytes are what ghci reports
+// with :set +s; the GC counters come from GHC.Stats (--cell-stats=gc) and
+// count everything since the previous cell, including ghci's own work.
+struct CellStats {
+    bool timed = false;          // ghci printed a timing footer
+    double secs = 0.0;
+    uint64_t allocated_bytes = 0;
+    double round_trip_secs = 0.0; // from writing the cell to the next prompt, as seen by the kernel
+    bool rts = false;            // the GC counters below are set
+    uint64_t gcs = 0;
+    uint64_t major_gcs = 0;
+    double gc_secs = 0.0;
+    uint64_t max_live_bytes = 0;
+};
+
+struct GHCiResult {
+    std::string out;
+    std::string err;
+    CellStats stats;
+    LimitAction limit = LimitAction::none; // what the watchdog did to it
+    bool died = false;                     // ghci exited, restart() it
+};
+
+// Removes the footer :set +s prints after a statement, e.g.
+// "(0.02 secs, 1,234,560 bytes)", from the end of out. It follows the
+// output directly, so output without a final newline ends up on the same
+// line. Old ghcs print the bytes without separators, :load prints none.
+bool take_timing_footer(std::string& out, CellStats& stats) {
+    size_t end = out.find_last_not_of("\r\n");
+    if (end == std::string::npos || out[end] != ')') return false;
+    size_t open = out.rfind('(', end);
+    if (open == std::string::npos) return false;
+
+    const char* first = out.data() + open + 1;
+    const char* last = out.data() + end;
+    double secs = 0.0;
+    auto [ptr, ec] = std::from_chars(first, last, secs);
+    if (ec != std::errc()) return false;
+    std::string_view rest(ptr, (size_t)(last - ptr));
+    const std::string_view unit = " secs,", bytes_unit = " bytes";
+    if (rest.substr(0, unit.size()) != unit) return false;
+    rest.remove_prefix(unit.size());
+
+    uint64_t bytes = 0;
+    if (!rest.empty()) {
+        if (rest.size() <= bytes_unit.size() + 1 || rest.front() != ' '
+            || rest.substr(rest.size() - bytes_unit.size()) != bytes_unit)
+            return false;
+        for (char c : rest.substr(1, rest.size() - bytes_unit.size() - 1)) {
+            if (c == ',') continue;
+            if (c < '0' || c > '9') return false;
+            bytes = bytes * 10 + (uint64_t)(c - '0');
+        }
+    }
+
+    stats.timed = true;
+    stats.secs = secs;
+    stats.allocated_bytes = bytes;
+    out.erase(open);
+    return true;
+}
+
+// Cumulative GHC.Stats counters of a ghci process.
+struct RtsCounters {
+    uint64_t gcs = 0;
+    uint64_t major_gcs = 0;
+    uint64_t gc_elapsed_ns = 0;
+    uint64_t max_live_bytes = 0;
+};
+
+// Prints the counters on one line. Qualified names need no import, so the
+// prompt scope is left alone.
+const std::string rts_counters_query =
+    "GHC.Stats.getRTSStats >>= \\s -> putStrLn (unwords (\"HJN_RTS\" : map show "
+    "[toInteger (GHC.Stats.gcs s), toInteger (GHC.Stats.major_gcs s), "
+    "toInteger (GHC.Stats.gc_elapsed_ns s), toInteger (GHC.Stats.max_live_bytes s)]))";
+
+bool parse_rts_counters(const std::string& out, RtsCounters& counters) {
+    size_t pos = out.find("HJN_RTS ");
+    if (pos == std::string::npos) return false;
+    const char* p = out.data() + pos + 8;
+    const char* end = out.data() + out.size();
+    for (uint64_t* field : { &counters.gcs, &counters.major_gcs, &counters.gc_elapsed_ns, &counters.max_live_bytes }) {
+        while (p < end && *p == ' ') ++p;
+        auto [next, ec] = std::from_chars(p, end, *field);
+        if (ec != std::errc()) return false;
+        p = next;
+    }
+    return true;
+}
+
+// Reads whatever has arrived on one of ghci's output pipes without
+// blocking. Returns false once the write end is gone.
+#ifdef _WIN32
+using PipeHandle = HANDLE;
+
+bool read_available(OverlappedReader& pipe, std::string& acc) {
+    return pipe.read(acc);
+}
+#else
+using PipeHandle = int;
+
+bool read_available(int pipe, std::string& acc) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = ::read(pipe, buf, sizeof(buf));
+        if (n > 0) {
+            acc.append(buf, (size_t)n);
+            continue;
+        }
+        if (n == 0) return false;
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+#endif
+
+void write_all(PipeHandle pipe, const std::string& data) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+#ifdef _WIN32
+        DWORD written = 0;
+        if (!WriteFile(pipe, data.data() + pos, (DWORD)(data.size() - pos), &written, NULL)) return;
+#else
+        ssize_t written = ::write(pipe, data.data() + pos, data.size() - pos);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+#endif
+        pos += (size_t)written;
+    }
+}
+
+// Quotes one argument for the interpreter command line: for CreateProcess
+// on Windows, for /bin/sh elsewhere.
+std::string quote_arg(const std::string& arg) {
+#ifdef _WIN32
+    if (!arg.empty() && arg.find_first_of(" \t\"") == std::string::npos) return arg;
+    std::string out = "\"";
+    size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            ++backslashes;
+            continue;
+        }
+        // backslashes are only special in front of a quote
+        out.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        out += c;
+    }
+    out.append(backslashes * 2, '\\');
+    out += '"';
+    return out;
+#else
+    const char* safe = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-=.,/:@%";
+    if (!arg.empty() && arg.find_first_not_of(safe) == std::string::npos) return arg;
+    std::string out = "'";
+    for (char c : arg) {
+        if (c == '\'') out += "'\\''";
+        else out += c;
+    }
+    out += '\'';
+    return out;
+#endif
+}
+
+using EnvVars = std::vector<std::pair<std::string, std::string>>;
+
+// The kernel's environment with vars set, for a child process only: the
+// kernel's own is shared by every session and never changed.
+#ifdef _WIN32
+// A CreateProcessW environment block, sorted by name as Windows expects.
+std::wstring child_environment(const EnvVars& vars) {
+    auto widen = [](const std::string& s) {
+        std::wstring w(MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0), L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, s.c_str(), (int)s.size(), w.data(), (int)w.size());
+        return w;
+    };
+    std::vector<std::wstring> entries;
+    LPWCH inherited = GetEnvironmentStringsW();
+    for (LPWCH p = inherited; p && *p; p += wcslen(p) + 1) {
+        std::wstring entry(p);
+        std::wstring name = entry.substr(0, entry.find(L'=', 1)); // names like "=C:" start with '='
+        bool replaced = std::any_of(vars.begin(), vars.end(), [&](const auto& v) {
+            return _wcsicmp(widen(v.first).c_str(), name.c_str()) == 0;
+        });
+        if (!replaced) entries.push_back(entry);
+    }
+    if (inherited) FreeEnvironmentStringsW(inherited);
+    for (const auto& [name, value] : vars) entries.push_back(widen(name) + L"=" + widen(value));
+    std::sort(entries.begin(), entries.end(), [](const std::wstring& a, const std::wstring& b) {
+        return _wcsicmp(a.c_str(), b.c_str()) < 0;
+    });
+
+    std::wstring block;
+    for (const auto& e : entries) {
+        block += e;
+        block += L'\0';
+    }
+    block += L'\0';
+    return block;
+}
+#else
+extern char** environ;
+
+// NAME=value strings for execle.
+std::vector<std::string> child_environment(const EnvVars& vars) {
+    std::vector<std::string> entries;
+    for (char** e = environ; *e; ++e) {
+        std::string_view entry(*e);
+        std::string_view name = entry.substr(0, entry.find('='));
+        bool replaced = std::any_of(vars.begin(), vars.end(), [&](const auto& v) { return v.first == name; });
+        if (!replaced) entries.emplace_back(entry);
+    }
+    for (const auto& [name, value] : vars) entries.push_back(name + "=" + value);
+    return entries;
+}
+#endif
 
 struct GHCiBridge {
-    HANDLE in_w = NULL, out_r = NULL;
+#ifdef _WIN32
+    HANDLE in_w = NULL;
+    OverlappedReader out_r, err_r;
     PROCESS_INFORMATION pi = {};
+    HANDLE job = NULL; // ghci and everything it starts, with the memory and CPU limits
+    std::string program = "ghci.exe"; // command line of the interpreter, --interpreter replaces it
+#else
+    int in_w = -1, out_r = -1, err_r = -1;
+    pid_t pid = -1;
+    std::string cgroup_path; // carries the memory and CPU limits
+    std::string program = "ghci"; // run through /bin/sh, --interpreter replaces it
+#endif
+    EnvVars env; // set in the ghci process's environment
+    std::vector<std::string> ghc_flags;   // launch profile, see kernel_config.hpp
+    std::vector<std::string> rts_options;
+    std::string working_dir;              // empty = the kernel's
+    bool timing = false;    // :set +s, every result carries ghci's timing footer
+    bool rts_stats = false; // start ghci with +RTS -T and read GC counters after every cell
+    RtsCounters rts;        // as of the previous cell
+    ResourceLimits limits;
+    DataChannel data;
+    std::vector<DataFrame> frames; // received on the data channel, taken by take_frames()
+    // When set, data channel frames go here as soon as they arrive instead of
+    // waiting in frames, so bulk results stream out while the cell runs.
+    std::function<void(DataFrame&&)> frame_sink;
 
-    std::string wait_for_prompt() {
-        std::string acc;
-        DWORD read;
-        CHAR buf[1024];
+    // Services stdout, stderr and the data channel until the prompt shows up
+    // on stdout.
+    GHCiResult wait_for_prompt() {
+        GHCiResult res;
         const std::string prompt = "ghci>";
 
         while (true) {
-            if (!ReadFile(out_r, buf, sizeof(buf) - 1, &read, NULL) || read == 0) break;
-            buf[read] = '\0';
-            acc += buf;
-            size_t pos = acc.find(prompt);
-            if (pos != std::string::npos) {
-                acc.erase(pos);
+            bool progressed = poll_frames();
+
+            size_t err_size = res.err.size();
+            read_available(err_r, res.err);
+            progressed |= res.err.size() != err_size;
+
+            size_t out_size = res.out.size();
+            if (!read_available(out_r, res.out)) {
+                res.died = true;
                 break;
             }
+            if (res.out.size() != out_size) {
+                size_t from = out_size >= prompt.size() ? out_size - prompt.size() + 1 : 0;
+                size_t pos = res.out.find(prompt, from);
+                if (pos != std::string::npos) {
+                    res.out.erase(pos);
+                    break;
+                }
+                progressed = true;
+            }
 
+            if (!progressed) wait_idle();
         }
+
+        // ghci writes diagnostics before it prints the prompt
+        read_available(err_r, res.err);
+        poll_frames();
+        if (size_t dropped = data.reset())
+            std::cerr << "Dropped " << dropped << " bytes of an unfinished data channel frame" << std::endl;
+
         static const std::regex ansi_pattern(R"(\x1B\[[0-9;]*[A-Za-z])");
-        return std::regex_replace(acc, ansi_pattern, "");
+        res.out = std::regex_replace(res.out, ansi_pattern, "");
+        res.err = std::regex_replace(res.err, ansi_pattern, "");
+        return res;
+    }
+
+    // Reads the data channel; hands the frames to frame_sink when there is
+    // one. Returns true if anything arrived.
+    bool poll_frames() {
+        bool progressed = data.poll(frames);
+        if (frame_sink) {
+            for (auto& frame : frames) frame_sink(std::move(frame));
+            frames.clear();
+        }
+        return progressed;
+    }
+
+    // Called after a round that read nothing, returns as soon as any of the
+    // pipes has data. The timeout only bounds how late a writer that went
+    // away unnoticed is found.
+    void wait_idle() {
+#ifdef _WIN32
+        std::vector<HANDLE> handles;
+        for (const OverlappedReader* pipe : { &out_r, &err_r })
+            if (HANDLE h = pipe->wait_handle()) handles.push_back(h);
+        data.wait_handles(handles);
+        handles.resize(std::min<size_t>(handles.size(), MAXIMUM_WAIT_OBJECTS));
+        if (handles.empty()) Sleep(1);
+        else WaitForMultipleObjects((DWORD)handles.size(), handles.data(), FALSE, 100);
+#else
+        pollfd fds[] = { { out_r, POLLIN, 0 }, { err_r, POLLIN, 0 }, { data.fd, POLLIN, 0 } };
+        ::poll(fds, data.fd >= 0 ? 3 : 2, 100);
+#endif
     }
 
     void start() {
+        {
+            // The child inherits every handle (on POSIX every descriptor not
+            // yet marked close-on-exec) open at the time, so sessions starting
+            // on different threads must not interleave here. Without a data
+            // channel the variable is left out and HJN.hs reports that.
+            static std::mutex spawn_mutex;
+            static std::atomic<int> instance = 0;
+            std::lock_guard<std::mutex> lock(spawn_mutex);
+            EnvVars vars = env;
+            if (data.open("hjn_data_" + std::to_string(process_id()) + "_" + std::to_string(++instance)))
+                vars.push_back({ "HJN_DATA_CHANNEL", data.path });
+            spawn(vars);
+        }
+        wait_for_prompt();
+        if (timing) {
+            write_all(in_w, ":set +s\n");
+            wait_for_prompt();
+        }
+        if (rts_stats) {
+            write_all(in_w, rts_counters_query + "\n");
+            if (!parse_rts_counters(wait_for_prompt().out, rts)) {
+                std::cerr << "GHC.Stats is not available, GC statistics are off" << std::endl;
+                rts_stats = false;
+            }
+        }
+    }
+
+    // The program is a command line of its own and goes in as it is.
+    std::string command_line() const {
+        std::string line = program;
+        for (const auto& flag : ghc_flags)
+            line += " " + quote_arg(flag);
+        std::vector<std::string> rts = rts_options;
+        if (rts_stats) rts.push_back("-T");
+        if (!limits.max_heap.empty()) rts.push_back("-M" + limits.max_heap);
+        if (!rts.empty()) {
+            line += " +RTS";
+            for (const auto& option : rts)
+                line += " " + quote_arg(option);
+            line += " -RTS";
+        }
+        return line;
+    }
+
+#ifdef _WIN32
+    void spawn(const EnvVars& vars) {
         SECURITY_ATTRIBUTES saAttr{ sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
-        HANDLE in_r, out_w;
-        CreatePipe(&out_r, &out_w, &saAttr, 0);
-        SetHandleInformation(out_r, HANDLE_FLAG_INHERIT, 0);
+        HANDLE in_r = NULL, out_w = NULL, err_w = NULL;
+        if (!create_overlapped_pipe(out_r, out_w) || !create_overlapped_pipe(err_r, err_w)) return;
         CreatePipe(&in_r, &in_w, &saAttr, 0);
         SetHandleInformation(in_w, HANDLE_FLAG_INHERIT, 0);
         STARTUPINFOW si{};
         si.cb = sizeof(si);
-        si.hStdError = out_w;
+        si.hStdError = err_w;
         si.hStdOutput = out_w;
         si.hStdInput = in_r;
         si.dwFlags |= STARTF_USESTDHANDLES;
-        wchar_t cmd[] = L"ghci.exe";
-        CreateProcessW(NULL, cmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+        std::string line = command_line();
+        std::wstring cmd(MultiByteToWideChar(CP_UTF8, 0, line.c_str(), -1, NULL, 0), L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, line.c_str(), -1, cmd.data(), (int)cmd.size());
+        std::wstring dir(MultiByteToWideChar(CP_UTF8, 0, working_dir.c_str(), -1, NULL, 0), L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, working_dir.c_str(), -1, dir.data(), (int)dir.size());
+        // The process joins the job before it runs any code
+        job = create_ghci_job(limits);
+        std::wstring environment = child_environment(vars);
+        CreateProcessW(NULL, cmd.data(), NULL, NULL, TRUE, CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT, environment.data(),
+            working_dir.empty() ? NULL : dir.c_str(), &si, &pi);
+        if (job && !AssignProcessToJobObject(job, pi.hProcess)) {
+            CloseHandle(job);
+            job = NULL;
+        }
+        ResumeThread(pi.hThread);
         CloseHandle(out_w);
+        CloseHandle(err_w);
         CloseHandle(in_r);
-
-        wait_for_prompt();
     }
+#else
+    void spawn(const EnvVars& vars) {
+        // A ghci that died must not take the kernel down on the next write
+        std::signal(SIGPIPE, SIG_IGN);
 
-    std::string send(const std::string& line) {
-        DWORD written;
-        WriteFile(in_w, ":{", 2, &written, NULL);
-        WriteFile(in_w, "\n", 1, &written, NULL);
-        WriteFile(in_w, line.c_str(), (DWORD)line.size(), &written, NULL);
-        WriteFile(in_w, "\n", 1, &written, NULL);
-        WriteFile(in_w, ":}", 2, &written, NULL);
-        WriteFile(in_w, "\n", 1, &written, NULL);
+        int in[2], out[2], err[2];
+        if (::pipe(in) != 0 || ::pipe(out) != 0 || ::pipe(err) != 0) return;
+        for (int fd : { in[1], out[0], err[0] })
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-        std::string res = wait_for_prompt();
+        static int cgroups = 0;
+        cgroup_path = create_cgroup(limits, "hjn_" + std::to_string(process_id()) + "_" + std::to_string(++cgroups));
+        int procs = cgroup_path.empty() ? -1 : ::open((cgroup_path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+
+        std::string cmd = "exec " + command_line();
+        // built before the fork, the child only calls async-signal-safe functions
+        std::vector<std::string> environment = child_environment(vars);
+        std::vector<char*> envp;
+        for (auto& entry : environment) envp.push_back(entry.data());
+        envp.push_back(nullptr);
+        pid = ::fork();
+        if (pid == 0) {
+            // own process group, so a kill also reaches what the cell started
+            ::setpgid(0, 0);
+            apply_child_limits(limits, procs);
+            ::dup2(in[0], 0);
+            ::dup2(out[1], 1);
+            ::dup2(err[1], 2);
+            for (int fd : { in[0], out[1], err[1] })
+                if (fd > 2) ::close(fd);
+            if (!working_dir.empty() && ::chdir(working_dir.c_str()) != 0)
+                ::_exit(127);
+            ::execle("/bin/sh", "sh", "-c", cmd.c_str(), (char*)nullptr, envp.data());
+            ::_exit(127);
+        }
+        if (pid > 0) ::setpgid(pid, pid); // also here, the watchdog may signal before the child runs
+        if (procs >= 0) ::close(procs);
+        ::close(in[0]);
+        ::close(out[1]);
+        ::close(err[1]);
+        in_w = in[1];
+        out_r = out[0];
+        err_r = err[0];
+        for (int fd : { out_r, err_r })
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+
+    GHCiResult send(const std::string& line) {
+        GHCiResult res = exchange(":{\n" + line + "\n:}\n");
 
         const std::string multiline_prompt = "ghci| ";
         size_t pos = 0;
-        while ((pos = res.find(multiline_prompt, pos)) != std::string::npos) {
-            res.erase(pos, multiline_prompt.length());
+        while ((pos = res.out.find(multiline_prompt, pos)) != std::string::npos) {
+            res.out.erase(pos, multiline_prompt.length());
         }
+        return res;
+    }
+
+    // Sends a ghci command (":load ...", "import ...") as a plain line.
+    GHCiResult command(const std::string& line) {
+        return exchange(line + "\n");
+    }
 
+    // One round trip, under the watchdog when there is a time limit.
+    GHCiResult exchange(const std::string& input) {
+        StageTimer timer(Stage::ghci);
+        auto started = std::chrono::steady_clock::now();
+        std::atomic<LimitAction> action = LimitAction::none;
+        uint64_t watch = 0;
+        if (limits.cell_timeout > 0.0) {
+            using seconds = std::chrono::duration<double>;
+            watch = watchdog().watch(
+                std::chrono::duration_cast<Watchdog::clock::duration>(seconds(limits.cell_timeout)),
+                std::chrono::duration_cast<Watchdog::clock::duration>(seconds(limits.interrupt_grace)),
+                [this] { return interrupt(); }, [this] { kill(); }, action);
+        }
+        write_all(in_w, input);
+        GHCiResult res = wait_for_prompt();
+        if (watch) watchdog().unwatch(watch);
+        res.limit = action.load();
+        finish(res, started);
         return res;
     }
 
+    // Fills in the statistics of a result that just came back.
+    void finish(GHCiResult& res, std::chrono::steady_clock::time_point started) {
+        res.stats.round_trip_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        if (timing) take_timing_footer(res.out, res.stats);
+    }
+
+    // Adds the GC counters accumulated since the previous call, once per
+    // cell. The query is a statement of its own; its footer goes with it.
+    void read_rts_stats(CellStats& stats) {
+        if (!rts_stats) return;
+        StageTimer timer(Stage::ghci);
+        write_all(in_w, rts_counters_query + "\n");
+        RtsCounters now;
+        if (!parse_rts_counters(wait_for_prompt().out, now)) return;
+        stats.rts = true;
+        stats.gcs = now.gcs - rts.gcs;
+        stats.major_gcs = now.major_gcs - rts.major_gcs;
+        stats.gc_secs = (double)(now.gc_elapsed_ns - rts.gc_elapsed_ns) / 1e9;
+        stats.max_live_bytes = now.max_live_bytes;
+        rts = now;
+    }
+
+    std::vector<DataFrame> take_frames() {
+        std::vector<DataFrame> out;
+        out.swap(frames);
+        return out;
+    }
+
+    // Ctrl-C: ghci abandons the evaluation and shows the prompt again. Like
+    // a terminal, it goes to the whole process group.
+    // Windows has no way to deliver it to a process without a console.
+    bool interrupt() {
+#ifdef _WIN32
+        return false;
+#else
+        return pid > 0 && ::kill(-pid, SIGINT) == 0;
+#endif
+    }
+
+    // Kills ghci together with every process it started, which could
+    // otherwise keep the output pipes open and wait_for_prompt from seeing
+    // the end of them.
+    void kill() {
+#ifdef _WIN32
+        if (job) TerminateJobObject(job, 1);
+        else TerminateProcess(pi.hProcess, 1);
+#else
+        if (pid > 0) ::kill(-pid, SIGKILL);
+#endif
+    }
+
+    // How a process that closed its output ended, "" if it is still around
+    // after a second.
+    std::string reap() {
+#ifdef _WIN32
+        DWORD code = STILL_ACTIVE;
+        if (WaitForSingleObject(pi.hProcess, 1000) == WAIT_OBJECT_0)
+            GetExitCodeProcess(pi.hProcess, &code);
+        return code == STILL_ACTIVE ? "" : "exit code " + std::to_string(code);
+#else
+        for (int i = 0; i < 100 && pid > 0; ++i) {
+            int status = 0;
+            if (::waitpid(pid, &status, WNOHANG) == pid) {
+                pid = -1;
+                if (WIFSIGNALED(status)) return "killed by signal " + std::to_string(WTERMSIG(status));
+                return "exit code " + std::to_string(WEXITSTATUS(status));
+            }
+            ::usleep(10000);
+        }
+        return "";
+#endif
+    }
+
+    // Replaces a ghci that died, losing everything defined at its prompt.
+    // Returns how the old process ended.
+    std::string restart() {
+        std::string status = reap();
+        stop();
+        start();
+        return status;
+    }
+
     void stop() {
-        TerminateProcess(pi.hProcess, 0);
+#ifdef _WIN32
+        if (job) TerminateJobObject(job, 0);
+        else TerminateProcess(pi.hProcess, 0);
         CloseHandle(pi.hProcess);
         CloseHandle(pi.hThread);
         CloseHandle(in_w);
-        CloseHandle(out_r);
+        out_r.close();
+        err_r.close();
+        if (job) CloseHandle(job);
+        pi = {};
+        in_w = job = NULL;
+#else
+        if (pid > 0) {
+            ::kill(-pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+            pid = -1;
+        }
+        for (int fd : { in_w, out_r, err_r })
+            if (fd >= 0) ::close(fd);
+        in_w = out_r = err_r = -1;
+        remove_cgroup(cgroup_path);
+        cgroup_path.clear();
+#endif
+        data.close();
     }
 };
 
-#endif
\ No newline at end of file
+#endif
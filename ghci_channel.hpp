@@ -0,0 +1,349 @@
+#ifndef GHCICHANNEL_HPP
+#define GHCICHANNEL_HPP
+
+#include "platform.hpp"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <atomic>
+#include <memory>
+#else
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+// Binary side channel from ghci to the kernel. Haskell code opens the pipe
+// (a FIFO in the temp directory outside Windows) named by HJN_DATA_CHANNEL
+// and writes frames of the form
+//
+//   [u32 LE kind length][kind][u32 LE payload length][payload]
+//
+// where kind is a MIME type ("image/png") or "comm:<comm_id>". See haskell/HJN.hs.
+
+struct DataFrame {
+    std::string kind;
+    std::string payload;
+};
+
+uint32_t read_u32_le(const std::string& buf, size_t pos) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf.data() + pos);
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+// Largest kind or payload accepted, set from --iopub-queue-mb: a frame
+// that big could not be queued for the frontend anyway.
+size_t data_frame_limit = (size_t)256 << 20;
+
+// Bytes from one writer that do not make up a whole frame yet.
+struct FrameBuffer {
+    std::string bytes;
+    bool discarding = false; // a length was over the limit, nothing after it can be trusted
+
+    // At the end of a cell: drops an incomplete frame, which its writer can
+    // no longer finish, and starts reading fresh. Returns the bytes dropped.
+    size_t reset() {
+        size_t dropped = bytes.size();
+        bytes.clear();
+        discarding = false;
+        return dropped;
+    }
+};
+
+// Moves every complete frame at the front of in into out. A length over
+// data_frame_limit means a broken or runaway writer; the buffer is dropped
+// and so is everything else it sends until the cell ends.
+void take_frames(FrameBuffer& in, std::vector<DataFrame>& out) {
+    std::string& buf = in.bytes;
+    if (in.discarding) {
+        buf.clear();
+        return;
+    }
+    auto over_limit = [&](uint32_t len) {
+        if (len <= data_frame_limit) return false;
+        std::cerr << "Data channel frame part of " << len << " bytes is over the limit, dropping the data of this cell" << std::endl;
+        buf.clear();
+        in.discarding = true;
+        return true;
+    };
+
+    size_t pos = 0;
+    while (true) {
+        if (buf.size() - pos < 4) break;
+        uint32_t kind_len = read_u32_le(buf, pos);
+        if (over_limit(kind_len)) return;
+        if (buf.size() - pos < 8 + (size_t)kind_len) break;
+        uint32_t payload_len = read_u32_le(buf, pos + 4 + kind_len);
+        if (over_limit(payload_len)) return;
+        size_t frame_len = 8 + (size_t)kind_len + payload_len;
+        if (buf.size() - pos < frame_len) break;
+
+        DataFrame frame;
+        frame.kind = buf.substr(pos + 4, kind_len);
+        frame.payload = buf.substr(pos + 8 + kind_len, payload_len);
+        out.push_back(std::move(frame));
+        pos += frame_len;
+    }
+    buf.erase(0, pos);
+}
+
+#ifdef _WIN32
+// Read end of a pipe opened for overlapped I/O. A read is kept outstanding,
+// and its event is signalled when data arrives or the writer goes away, so
+// one thread can wait on ghci's output pipes and the data channel at once.
+// The buffer and OVERLAPPED are written by the system while a read is
+// pending, so a reader never moves.
+struct OverlappedReader {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    HANDLE event = NULL;
+    OVERLAPPED ov = {};
+    bool pending = false;
+    bool closed = true;
+    CHAR buf[1 << 16];
+
+    OverlappedReader() = default;
+    OverlappedReader(const OverlappedReader&) = delete;
+    OverlappedReader& operator=(const OverlappedReader&) = delete;
+
+    ~OverlappedReader() {
+        close();
+    }
+
+    void attach(HANDLE handle) {
+        close();
+        pipe = handle;
+        event = CreateEventA(NULL, TRUE, FALSE, NULL);
+        closed = false;
+    }
+
+    // Appends whatever has arrived to acc and leaves the next read
+    // outstanding. Returns false once the writer has closed the pipe.
+    bool read(std::string& acc) {
+        while (!closed) {
+            if (!pending) {
+                ov = {};
+                ov.hEvent = event;
+                if (!ReadFile(pipe, buf, sizeof(buf), NULL, &ov) && GetLastError() != ERROR_IO_PENDING) {
+                    closed = true;
+                    break;
+                }
+                pending = true;
+            }
+            DWORD read = 0;
+            if (!GetOverlappedResult(pipe, &ov, &read, FALSE)) {
+                if (GetLastError() == ERROR_IO_INCOMPLETE) break;
+                pending = false;
+                closed = true;
+                break;
+            }
+            pending = false;
+            acc.append(buf, read);
+        }
+        return !closed;
+    }
+
+    // Event to wait on for the outstanding read, NULL if there is none.
+    HANDLE wait_handle() const {
+        return pending ? event : NULL;
+    }
+
+    void close() {
+        if (pipe != INVALID_HANDLE_VALUE) {
+            if (pending) {
+                DWORD read = 0;
+                CancelIoEx(pipe, &ov);
+                GetOverlappedResult(pipe, &ov, &read, TRUE);
+            }
+            CloseHandle(pipe);
+        }
+        if (event) CloseHandle(event);
+        pipe = INVALID_HANDLE_VALUE;
+        event = NULL;
+        pending = false;
+        closed = true;
+    }
+};
+
+// A pipe whose read end can be waited on. Anonymous pipes cannot do
+// overlapped I/O, so this is a named pipe with a unique name and a single
+// instance. The write end is inheritable, for the child's stdout or stderr.
+bool create_overlapped_pipe(OverlappedReader& read_end, HANDLE& write_end) {
+    static std::atomic<unsigned> serial = 0;
+    std::string name = "\\\\.\\pipe\\hjn_" + std::to_string(process_id()) + "_" + std::to_string(++serial);
+    HANDLE pipe = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 0, 1 << 16, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) return false;
+    SECURITY_ATTRIBUTES inheritable{ sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    write_end = CreateFileA(name.c_str(), GENERIC_WRITE, 0, &inheritable, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (write_end == INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
+        return false;
+    }
+    read_end.attach(pipe);
+    return true;
+}
+
+struct DataChannel {
+    struct Connection {
+        OverlappedReader reader;
+        FrameBuffer buf;
+    };
+
+    std::string path;
+    HANDLE listening = INVALID_HANDLE_VALUE;
+    OVERLAPPED connect = {}; // ConnectNamedPipe on listening
+    bool connecting = false;
+    std::vector<std::unique_ptr<Connection>> connections;
+
+    // Overlapped pipe instances, waited on together with ghci's console
+    // output, see GHCiBridge::wait_idle.
+    HANDLE create_instance() {
+        return CreateNamedPipeA(path.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+            PIPE_UNLIMITED_INSTANCES, 0, 1 << 16, 0, NULL);
+    }
+
+    bool open(const std::string& name) {
+        path = "\\\\.\\pipe\\" + name;
+        connect.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        listening = create_instance();
+        return listening != INVALID_HANDLE_VALUE;
+    }
+
+    // Takes a writer that connected to the listening instance and listens
+    // on a fresh one. Returns false while nobody has connected.
+    bool accept() {
+        if (listening == INVALID_HANDLE_VALUE) return false;
+        if (!connecting) {
+            HANDLE event = connect.hEvent;
+            connect = {};
+            connect.hEvent = event;
+            if (!ConnectNamedPipe(listening, &connect)) {
+                DWORD err = GetLastError();
+                if (err == ERROR_IO_PENDING) {
+                    connecting = true;
+                    return false;
+                }
+                // connected between creation and now, possibly gone again
+                if (err != ERROR_PIPE_CONNECTED && err != ERROR_NO_DATA) return false;
+            }
+        }
+        else {
+            DWORD unused = 0;
+            if (!GetOverlappedResult(listening, &connect, &unused, FALSE) && GetLastError() == ERROR_IO_INCOMPLETE)
+                return false;
+            connecting = false;
+        }
+
+        auto c = std::make_unique<Connection>();
+        c->reader.attach(listening);
+        connections.push_back(std::move(c));
+        listening = create_instance();
+        return true;
+    }
+
+    // Accepts new writers and reads whatever has arrived. Returns true if
+    // anything happened.
+    bool poll(std::vector<DataFrame>& frames) {
+        bool progressed = false;
+        while (accept()) progressed = true;
+
+        for (size_t i = 0; i < connections.size();) {
+            Connection& c = *connections[i];
+            size_t before = c.buf.bytes.size();
+            bool open = c.reader.read(c.buf.bytes);
+            progressed |= c.buf.bytes.size() != before;
+            take_frames(c.buf, frames);
+
+            if (!open) {
+                DisconnectNamedPipe(c.reader.pipe);
+                connections.erase(connections.begin() + i);
+                progressed = true;
+            }
+            else {
+                ++i;
+            }
+        }
+        return progressed;
+    }
+
+    // Adds the events that signal a new writer or new data.
+    void wait_handles(std::vector<HANDLE>& handles) const {
+        if (connecting) handles.push_back(connect.hEvent);
+        for (const auto& c : connections)
+            if (HANDLE h = c->reader.wait_handle()) handles.push_back(h);
+    }
+
+    size_t reset() {
+        size_t dropped = 0;
+        for (auto& c : connections) dropped += c->buf.reset();
+        return dropped;
+    }
+
+    void close() {
+        connections.clear();
+        if (listening != INVALID_HANDLE_VALUE) {
+            if (connecting) {
+                DWORD unused = 0;
+                CancelIoEx(listening, &connect);
+                GetOverlappedResult(listening, &connect, &unused, TRUE);
+            }
+            CloseHandle(listening);
+        }
+        if (connect.hEvent) CloseHandle(connect.hEvent);
+        listening = INVALID_HANDLE_VALUE;
+        connect = {};
+        connecting = false;
+    }
+};
+
+#else
+struct DataChannel {
+    std::string path;
+    int fd = -1;
+    int keepalive = -1; // our own writer, so the FIFO never reports EOF
+    FrameBuffer buf;
+
+    bool open(const std::string& name) {
+        path = (std::filesystem::temp_directory_path() / name).string();
+        ::unlink(path.c_str());
+        if (::mkfifo(path.c_str(), 0600) != 0) return false;
+        fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        keepalive = ::open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    // Reads whatever is buffered. Returns true if any bytes were read.
+    bool poll(std::vector<DataFrame>& frames) {
+        if (fd < 0) return false;
+
+        bool progressed = false;
+        char chunk[1 << 16];
+        while (true) {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0) break;
+            buf.bytes.append(chunk, (size_t)n);
+            take_frames(buf, frames);
+            progressed = true;
+        }
+        return progressed;
+    }
+
+    size_t reset() {
+        return buf.reset();
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        if (keepalive >= 0) ::close(keepalive);
+        fd = keepalive = -1;
+        if (!path.empty()) ::unlink(path.c_str());
+        buf.reset();
+    }
+};
+#endif
+
+#endif
@@ -0,0 +1,753 @@
+#ifndef GHCIMODULES_HPP
+#define GHCIMODULES_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <regex>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+
+#include "sha256.hpp"
+#include "ghci_bridge.hpp"
+#include "jupyter_protocol.hpp"
+#include "jp_exec.hpp"
+
+// Definition cells are compiled as one module per cell instead of being
+// pasted into the prompt. A module keeps its name while the cell is edited
+// (it is derived from the JupyterLab cell id, or numbered) and imports only
+// the earlier cells defining a name it mentions, so after an edit GHC's
+// recompilation check rebuilds the changed cell and the cells that use what
+// it exports; everything else is loaded from the object files kept in the
+// cache directory.
+
+struct CellModule {
+    std::string cell_id;           // JupyterLab cellId from the request metadata, may be empty
+    std::string name;              // module name, assigned by ModuleCache and kept across edits
+    std::string hash;              // SHA-256 of the cell text
+    std::string source;            // cell text
+    std::vector<std::string> imports;
+    std::vector<std::string> pragmas;
+    std::set<std::string> defines; // top level names, used to match re-run cells without an id
+    std::set<std::string> references; // every unqualified name the cell mentions
+    bool has_instances = false;    // instances have no name to refer to, later cells import the cell anyway
+    bool import_all = false;       // imports every earlier cell, see ModuleCache::load_cell
+};
+
+std::string trim(const std::string& s) {
+    size_t first = s.find_first_not_of(" \t\r");
+    if (first == std::string::npos) return "";
+    size_t last = s.find_last_not_of(" \t\r");
+    return s.substr(first, last - first + 1);
+}
+
+std::vector<std::string> split_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    size_t begin = 0;
+    while (begin <= text.size()) {
+        size_t end = text.find('\n', begin);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(begin, end - begin);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        lines.push_back(line);
+        begin = end + 1;
+    }
+    return lines;
+}
+
+bool starts_with_word(const std::string& line, const char* word) {
+    size_t n = strlen(word);
+    return line.compare(0, n, word) == 0 && (line.size() == n || !(std::isalnum((unsigned char)line[n]) || line[n] == '_' || line[n] == '\''));
+}
+
+bool is_symbol_char(char c) {
+    return std::strchr("!#$%&*+./<=>?@\\^|-~:", c) != nullptr;
+}
+
+// True if the line has a binding '=' or a '::' signature outside of operators like == or =>.
+bool has_binding_operator(const std::string& line, bool signatures = true) {
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (line[i] == '"') {
+            for (++i; i < line.size() && line[i] != '"'; ++i)
+                if (line[i] == '\\') ++i;
+            continue;
+        }
+        if (line[i] != '=' && !(signatures && line[i] == ':' && i + 1 < line.size() && line[i + 1] == ':')) continue;
+        size_t end = line[i] == '=' ? i + 1 : i + 2;
+        bool before = i > 0 && is_symbol_char(line[i - 1]);
+        bool after = end < line.size() && is_symbol_char(line[end]);
+        if (!before && !after) return true;
+        i = end - 1;
+    }
+    return false;
+}
+
+static const char* declaration_keywords[] = {
+    "import", "data", "type", "newtype", "class", "instance", "deriving",
+    "infix", "infixl", "infixr", "default", "foreign", "pattern"
+};
+
+// A cell goes through the module cache when it spans several lines and every
+// line starting in column 0 begins a top level declaration. Anything else
+// (trailing expressions, let statements, ghci commands) keeps using paste mode.
+bool is_definition_cell(const std::string& code) {
+    std::vector<std::string> lines = split_lines(trim(code));
+    if (lines.size() < 2) return false;
+
+    int comment_depth = 0;
+    for (const auto& line : lines) {
+        if (comment_depth > 0 || line.compare(0, 2, "{-") == 0) {
+            for (size_t i = 0; i + 1 < line.size(); ++i) {
+                if (line[i] == '{' && line[i + 1] == '-') comment_depth++, i++;
+                else if (line[i] == '-' && line[i + 1] == '}') comment_depth--, i++;
+            }
+            continue;
+        }
+        if (line.empty() || line[0] == ' ' || line[0] == '\t') continue;
+        if (line.compare(0, 2, "--") == 0) continue;
+        if (line[0] == ':' || starts_with_word(line, "let")) return false;
+
+        bool keyword = false;
+        for (const char* kw : declaration_keywords) {
+            if (starts_with_word(line, kw)) keyword = true;
+        }
+        if (!keyword && !has_binding_operator(line)) return false;
+    }
+    return true;
+}
+
+std::string first_identifier(const std::string& s, size_t pos) {
+    while (pos < s.size() && s[pos] == ' ') ++pos;
+    if (pos < s.size() && s[pos] == '(') {
+        size_t close = s.find(')', pos);
+        return close == std::string::npos ? "" : s.substr(pos, close - pos + 1);
+    }
+    size_t end = pos;
+    while (end < s.size() && (std::isalnum((unsigned char)s[end]) || s[end] == '_' || s[end] == '\'')) ++end;
+    return s.substr(pos, end - pos);
+}
+
+// Haskell lexeme, as far as cell parsing needs it. Comments and pragmas are
+// dropped; literals and qualified names come out as other.
+struct HsToken {
+    enum Kind { varid, conid, varsym, consym, reserved, special, other };
+    Kind kind;
+    std::string text;
+    size_t line;
+    size_t column;
+};
+
+static const char* reserved_words[] = {
+    "case", "class", "data", "default", "deriving", "do", "else", "foreign", "if", "import",
+    "in", "infix", "infixl", "infixr", "instance", "let", "module", "newtype", "of", "then",
+    "type", "where", "_"
+};
+
+static const char* reserved_ops[] = { "..", "::", "=", "\\", "|", "<-", "->", "@", "~", "=>" };
+
+bool is_ident_char(char c) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == '\'';
+}
+
+std::vector<HsToken> tokenize_haskell(const std::string& s) {
+    std::vector<HsToken> out;
+    size_t i = 0, line = 0, line_start = 0;
+    auto push = [&](HsToken::Kind kind, size_t begin) {
+        out.push_back(HsToken{ kind, s.substr(begin, i - begin), line, begin - line_start });
+    };
+
+    while (i < s.size()) {
+        char c = s[i];
+        size_t begin = i;
+        if (c == '\n') {
+            line++;
+            line_start = ++i;
+        }
+        else if (std::isspace((unsigned char)c)) {
+            ++i;
+        }
+        else if (s.compare(i, 2, "{-") == 0) {
+            int depth = 0;
+            while (i < s.size()) {
+                if (s.compare(i, 2, "{-") == 0) depth++, i += 2;
+                else if (s.compare(i, 2, "-}") == 0) {
+                    i += 2;
+                    if (--depth == 0) break;
+                }
+                else if (s[i++] == '\n') line++, line_start = i;
+            }
+        }
+        else if (c == '"') {
+            for (++i; i < s.size() && s[i] != '"' && s[i] != '\n'; ++i)
+                if (s[i] == '\\') ++i;
+            i = std::min(i + 1, s.size());
+            push(HsToken::other, begin);
+        }
+        else if (c == '\'') {
+            // a character literal; a lone quote (promoted constructor, TH name) is skipped
+            size_t close = i + 1 < s.size() && s[i + 1] == '\\' ? s.find('\'', i + 3) : i + 2;
+            if (close < s.size() && s[close] == '\'' && s.find('\n', i) > close) {
+                i = close + 1;
+                push(HsToken::other, begin);
+            }
+            else {
+                ++i;
+            }
+        }
+        else if (std::isalpha((unsigned char)c) || c == '_') {
+            size_t segment = i;
+            while (i < s.size() && is_ident_char(s[i])) ++i;
+            bool qualified = false;
+            // Module.name, Module.Con or Module.+
+            while (std::isupper((unsigned char)s[segment]) && i + 1 < s.size() && s[i] == '.'
+                && (std::isalpha((unsigned char)s[i + 1]) || s[i + 1] == '_' || is_symbol_char(s[i + 1]))) {
+                qualified = true;
+                segment = ++i;
+                if (is_symbol_char(s[i])) {
+                    while (i < s.size() && is_symbol_char(s[i])) ++i;
+                    break;
+                }
+                while (i < s.size() && is_ident_char(s[i])) ++i;
+            }
+            std::string word = s.substr(begin, i - begin);
+            bool keyword = false;
+            for (const char* w : reserved_words)
+                if (word == w) keyword = true;
+            push(qualified ? HsToken::other : keyword ? HsToken::reserved
+                : std::isupper((unsigned char)c) ? HsToken::conid : HsToken::varid, begin);
+        }
+        else if (std::isdigit((unsigned char)c)) {
+            while (i < s.size() && (is_ident_char(s[i]) || (s[i] == '.' && i + 1 < s.size() && std::isdigit((unsigned char)s[i + 1])))) ++i;
+            push(HsToken::other, begin);
+        }
+        else if (is_symbol_char(c)) {
+            while (i < s.size() && is_symbol_char(s[i])) ++i;
+            std::string op = s.substr(begin, i - begin);
+            if (op.size() >= 2 && op.find_first_not_of('-') == std::string::npos) {
+                i = std::min(s.find('\n', i), s.size()); // line comment
+                continue;
+            }
+            bool keyword = false;
+            for (const char* r : reserved_ops)
+                if (op == r) keyword = true;
+            push(keyword ? HsToken::reserved : c == ':' ? HsToken::consym : HsToken::varsym, begin);
+        }
+        else {
+            ++i;
+            push(HsToken::special, begin);
+        }
+    }
+    return out;
+}
+
+bool is_open_bracket(const HsToken& t) {
+    return t.kind == HsToken::special && (t.text == "(" || t.text == "[" || t.text == "{");
+}
+
+bool is_close_bracket(const HsToken& t) {
+    return t.kind == HsToken::special && (t.text == ")" || t.text == "]" || t.text == "}");
+}
+
+bool is_name(const HsToken& t) {
+    return t.kind == HsToken::varid || t.kind == HsToken::conid || t.kind == HsToken::varsym || t.kind == HsToken::consym;
+}
+
+// First token in [b, e) outside brackets with the given text, e if none.
+size_t find_top(const std::vector<HsToken>& t, size_t b, size_t e, const char* text) {
+    int depth = 0;
+    for (size_t i = b; i < e; ++i) {
+        if (is_open_bracket(t[i])) depth++;
+        else if (is_close_bracket(t[i])) depth--;
+        else if (depth == 0 && t[i].kind != HsToken::other && t[i].text == text) return i;
+    }
+    return e;
+}
+
+// The bracket closing the one at open, e if it is not closed before e.
+size_t find_close(const std::vector<HsToken>& t, size_t open, size_t e) {
+    int depth = 0;
+    for (size_t i = open; i < e; ++i) {
+        if (is_open_bracket(t[i])) depth++;
+        else if (is_close_bracket(t[i]) && --depth == 0) return i;
+    }
+    return e;
+}
+
+// Skips a "context =>" at p, if there is one before limit.
+size_t after_context(const std::vector<HsToken>& t, size_t p, size_t limit) {
+    size_t arrow = find_top(t, p, limit, "=>");
+    return arrow < limit ? arrow + 1 : p;
+}
+
+// A name at p: an identifier, or an operator in parentheses. Returns the
+// index after it, p if there is none.
+size_t take_name(const std::vector<HsToken>& t, size_t p, size_t e, std::set<std::string>& names) {
+    if (p < e && (t[p].kind == HsToken::varid || t[p].kind == HsToken::conid)) {
+        names.insert(t[p].text);
+        return p + 1;
+    }
+    if (p + 2 < e && t[p].text == "(" && (t[p + 1].kind == HsToken::varsym || t[p + 1].kind == HsToken::consym) && t[p + 2].text == ")") {
+        names.insert(t[p + 1].text);
+        return p + 3;
+    }
+    return p;
+}
+
+// The type (or class) being declared in a head like "Maybe a", "a :+: b".
+void take_type_name(const std::vector<HsToken>& t, size_t p, size_t e, std::set<std::string>& names) {
+    if (p + 1 < e && t[p].kind == HsToken::varid && (t[p + 1].kind == HsToken::consym || t[p + 1].kind == HsToken::varsym))
+        names.insert(t[p + 1].text);
+    else
+        take_name(t, p, e, names);
+}
+
+// The operator of an infix constructor, "a :+ b" or "a `Plus` b", in [b, e).
+size_t find_infix_constructor(const std::vector<HsToken>& t, size_t b, size_t e) {
+    int depth = 0;
+    for (size_t i = b; i < e; ++i) {
+        if (is_open_bracket(t[i])) depth++;
+        else if (is_close_bracket(t[i])) depth--;
+        else if (depth > 0) continue;
+        else if (t[i].kind == HsToken::consym) return i;
+        else if (t[i].text == "`" && i + 1 < e && t[i + 1].kind == HsToken::conid) return i + 1;
+    }
+    return e;
+}
+
+// "a, (+.), b :: T" signatures: the items of a class or GADT body, one per
+// line at the body's indentation. Associated types count too.
+void take_signatures(const std::vector<HsToken>& t, size_t b, size_t e, std::set<std::string>& names) {
+    if (b >= e) return;
+    size_t column = t[b].column;
+    for (size_t item = b; item < e;) {
+        size_t next = item + 1;
+        while (next < e && !(t[next].column == column && t[next].line != t[next - 1].line)) ++next;
+        if (t[item].text == "type" || t[item].text == "data") {
+            size_t p = item + 1;
+            if (p < next && (t[p].text == "family" || t[p].text == "instance")) ++p;
+            if (t[item + 1].text != "instance") take_type_name(t, p, next, names);
+        }
+        else {
+            size_t sig = find_top(t, item, next, "::");
+            for (size_t p = item; p < sig;) {
+                size_t after = take_name(t, p, sig, names);
+                p = after == p ? p + 1 : after;
+            }
+        }
+        item = next;
+    }
+}
+
+// Constructors and record fields of "= A x | B { f, g :: Int } deriving Eq".
+void take_constructors(const std::vector<HsToken>& t, size_t b, size_t e, std::set<std::string>& names) {
+    e = find_top(t, b, e, "deriving");
+    while (b < e) {
+        size_t z = find_top(t, b, e, "|");
+        size_t a = b;
+        if (a < z && t[a].text == "forall") {
+            while (a < z && t[a].text != ".") ++a;
+            ++a;
+        }
+        a = after_context(t, a, z);
+        size_t infix = find_infix_constructor(t, a, z);
+        if (infix < z) {
+            names.insert(t[infix].text);
+        }
+        else if (a < z && t[a].kind == HsToken::conid) {
+            names.insert(t[a].text);
+            if (a + 1 < z && t[a + 1].text == "{") {
+                size_t close = find_close(t, a + 1, z);
+                std::vector<std::string> fields;
+                int depth = 0;
+                bool expecting = true;
+                for (size_t i = a + 2; i < close; ++i) {
+                    if (is_open_bracket(t[i])) depth++;
+                    else if (is_close_bracket(t[i])) depth--;
+                    else if (depth > 0) continue;
+                    else if (expecting && t[i].kind == HsToken::varid) fields.push_back(t[i].text);
+                    else if (expecting && t[i].text == "::") {
+                        names.insert(fields.begin(), fields.end());
+                        fields.clear();
+                        expecting = false;
+                    }
+                    else if (!expecting && t[i].text == ",") expecting = true;
+                }
+            }
+        }
+        else {
+            take_name(t, a, z, names); // (:+) a b
+        }
+        b = z + 1;
+    }
+}
+
+// Every variable bound by a pattern binding such as "(a, b) = ...".
+// Field names inside record patterns are not bound.
+void take_pattern_vars(const std::vector<HsToken>& t, size_t b, size_t e, std::set<std::string>& names) {
+    int braces = 0;
+    for (size_t i = b; i < e; ++i) {
+        if (t[i].text == "{") braces++;
+        else if (t[i].text == "}") braces--;
+        else if (braces == 0 && t[i].kind == HsToken::varid) names.insert(t[i].text);
+    }
+}
+
+// Names defined by a top level signature or binding in [b, e): "f x = ...",
+// "x <+> y = ...", "x `op` y = ...", "(<+>) = ...", "(x <+> y) z = ...",
+// "f, g :: T" or a pattern binding.
+void take_binding(const std::vector<HsToken>& t, size_t b, size_t e, std::set<std::string>& names) {
+    size_t stop = b;
+    for (int depth = 0; stop < e; ++stop) {
+        if (is_open_bracket(t[stop])) depth++;
+        else if (is_close_bracket(t[stop])) depth--;
+        else if (depth == 0 && t[stop].kind == HsToken::reserved
+            && (t[stop].text == "=" || t[stop].text == "|" || t[stop].text == "::")) break;
+    }
+    if (stop == e) return;
+
+    if (t[stop].text == "::") {
+        for (size_t p = b; p < stop;) {
+            size_t after = take_name(t, p, stop, names);
+            p = after == p ? p + 1 : after;
+        }
+        return;
+    }
+
+    if (t[b].kind == HsToken::varid) {
+        if (b + 1 < stop && t[b + 1].kind == HsToken::varsym) {
+            names.insert(t[b + 1].text);
+            return;
+        }
+        if (b + 2 < stop && t[b + 1].text == "`" && t[b + 2].kind == HsToken::varid) {
+            names.insert(t[b + 2].text);
+            return;
+        }
+        if (!(b + 1 < stop && (t[b + 1].kind == HsToken::consym || t[b + 1].text == "@"))) {
+            names.insert(t[b].text);
+            return;
+        }
+    }
+    else if (t[b].text == "(") {
+        size_t close = find_close(t, b, stop);
+        if (close == b + 2 && t[b + 1].kind == HsToken::varsym) {
+            names.insert(t[b + 1].text);
+            return;
+        }
+        if (close < stop && find_top(t, b + 1, close, ",") == close) {
+            int depth = 0;
+            for (size_t i = b + 1; i < close; ++i) {
+                if (is_open_bracket(t[i])) depth++;
+                else if (is_close_bracket(t[i])) depth--;
+                else if (depth > 0) continue;
+                else if (t[i].kind == HsToken::varsym) {
+                    names.insert(t[i].text);
+                    return;
+                }
+                else if (t[i].text == "`" && i + 1 < close && t[i + 1].kind == HsToken::varid) {
+                    names.insert(t[i + 1].text);
+                    return;
+                }
+            }
+        }
+    }
+    take_pattern_vars(t, b, stop, names);
+}
+
+// Names a top level declaration, tokens [b, e), brings into scope. Sets
+// instances for instance and deriving declarations.
+void take_definitions(const std::vector<HsToken>& t, size_t b, size_t e, std::set<std::string>& names, bool& instances) {
+    const std::string& kw = t[b].text;
+    auto at = [&](size_t i, const char* text) { return i < e && t[i].text == text; };
+
+    if (t[b].kind != HsToken::reserved) {
+        if (kw == "pattern" && b + 1 < e && t[b + 1].kind == HsToken::conid)
+            names.insert(t[b + 1].text);
+        else
+            take_binding(t, b, e, names);
+    }
+    else if (kw == "instance" || kw == "deriving") {
+        instances = true;
+    }
+    else if (kw == "data" || kw == "newtype") {
+        if (at(b + 1, "instance")) {
+            instances = true;
+            return;
+        }
+        size_t p = at(b + 1, "family") ? b + 2 : b + 1;
+        size_t eq = find_top(t, p, e, "=");
+        size_t where = find_top(t, p, e, "where");
+        take_type_name(t, after_context(t, p, std::min(eq, where)), e, names);
+        if (eq < e) take_constructors(t, eq + 1, e, names);
+        else if (where < e) take_signatures(t, where + 1, e, names);
+    }
+    else if (kw == "type") {
+        if (at(b + 1, "instance")) {
+            instances = true;
+            return;
+        }
+        take_type_name(t, at(b + 1, "family") ? b + 2 : b + 1, e, names);
+    }
+    else if (kw == "class") {
+        size_t where = find_top(t, b + 1, e, "where");
+        take_type_name(t, after_context(t, b + 1, where), where, names);
+        if (where < e) take_signatures(t, where + 1, e, names);
+    }
+    else if (kw == "foreign" && at(b + 1, "import")) {
+        size_t sig = find_top(t, b, e, "::");
+        if (sig < e && t[sig - 1].kind == HsToken::varid) names.insert(t[sig - 1].text);
+    }
+}
+
+// Splits a definition cell into the parts every later module needs to repeat
+// (pragmas, imports), the names it defines and the names it refers to.
+// Declarations start in column 0 and run until the next one.
+CellModule parse_cell(const std::string& code, const std::string& cell_id) {
+    CellModule cell;
+    cell.cell_id = cell_id;
+    cell.source = code;
+
+    SHA256 sha;
+    sha.update(code);
+    cell.hash = sha.digest();
+
+    for (const auto& line : split_lines(code)) {
+        if (line.compare(0, 3, "{-#") == 0 && line.find("LANGUAGE") != std::string::npos)
+            cell.pragmas.push_back(line);
+        else if (starts_with_word(line, "import"))
+            cell.imports.push_back(line);
+    }
+
+    std::vector<HsToken> tokens = tokenize_haskell(code);
+    for (size_t b = 0; b < tokens.size();) {
+        size_t e = b + 1;
+        while (e < tokens.size() && tokens[e].column != 0) ++e;
+        if (tokens[b].text != "import") {
+            take_definitions(tokens, b, e, cell.defines, cell.has_instances);
+            for (size_t i = b; i < e; ++i)
+                if (is_name(tokens[i])) cell.references.insert(tokens[i].text);
+        }
+        b = e;
+    }
+    return cell;
+}
+
+// True if GHC reports a name out of scope: the diagnostic codes of GHC 9.6
+// and later, or the "Not in scope:" / "Variable not in scope:" wording of
+// older versions, which starts a line or follows "error:". Other diagnostics
+// that merely quote such text do not count.
+bool has_scope_error(const std::string& err) {
+    static const std::regex code(R"(\[GHC-(88464|76037)\])");
+    static const std::regex text(R"((^|error:)\s*(variable\s+|data constructor\s+)?not in scope:)", std::regex::icase);
+    for (const auto& line : split_lines(err)) {
+        if (std::regex_search(line, code) || std::regex_search(line, text)) return true;
+    }
+    return false;
+}
+
+struct ModuleCache {
+    std::string dir;
+    std::vector<CellModule> cells;        // notebook order
+    std::vector<std::string> prompt_imports; // single line import cells, replayed after every :load
+    std::string definitions_hash;         // changes whenever the loaded definition set changes
+    unsigned next_number = 0;             // for cells without an id
+    bool configured = false;
+
+    void init(const std::string& cache_dir) {
+        std::error_code ec;
+        // forward slashes: the path is quoted as a Haskell string in :set
+        dir = std::filesystem::path(cache_dir).generic_string();
+        std::filesystem::create_directories(dir, ec);
+    }
+
+    std::string module_path(const CellModule& cell) const {
+        return (std::filesystem::path(dir) / (cell.name + ".hs")).string();
+    }
+
+    // The earlier cells module i imports: those defining a name it mentions,
+    // and those with instances.
+    bool depends_on(size_t index, size_t earlier) const {
+        const CellModule& cell = cells[index];
+        if (cell.import_all || cells[earlier].has_instances) return true;
+        for (const auto& name : cells[earlier].defines)
+            if (cell.references.count(name)) return true;
+        return false;
+    }
+
+    // Module i repeats the pragmas and imports of cells 0..i, as they apply
+    // to the whole notebook, and imports the modules it depends on. Import and
+    // pragma lines of the cell itself are blanked so the LINE pragma keeps
+    // error positions cell-relative.
+    std::string module_source(size_t index) const {
+        std::set<std::string> seen;
+        std::string out;
+        for (size_t i = 0; i <= index; ++i) {
+            for (const auto& p : cells[i].pragmas)
+                if (seen.insert(p).second) out += p + "\n";
+        }
+        out += "module " + cells[index].name + " where\n";
+        for (size_t i = 0; i <= index; ++i) {
+            for (const auto& imp : cells[i].imports)
+                if (seen.insert(imp).second) out += imp + "\n";
+        }
+        for (size_t i = 0; i < index; ++i) {
+            if (depends_on(index, i)) out += "import " + cells[i].name + "\n";
+        }
+        out += "{-# LINE 1 \"cell\" #-}\n";
+        for (const auto& line : split_lines(cells[index].source)) {
+            bool hoisted = starts_with_word(line, "import")
+                || (line.compare(0, 3, "{-#") == 0 && line.find("LANGUAGE") != std::string::npos);
+            out += hoisted ? "\n" : line + "\n";
+        }
+        return out;
+    }
+
+    // Rewrites only the files whose text changed, so untouched modules keep
+    // their timestamps and GHC reuses their object code.
+    void write_modules() const {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            std::string path = module_path(cells[i]);
+            std::string source = module_source(i);
+            if (read_file(path) == source) continue;
+            std::ofstream f(path, std::ios::binary);
+            f << source;
+        }
+    }
+
+    void update_hash() {
+        SHA256 sha;
+        for (const auto& cell : cells) sha.update(cell.name + " " + cell.hash + "\n");
+        for (const auto& imp : prompt_imports) sha.update(imp + "\n");
+        definitions_hash = sha.digest();
+    }
+
+    void configure(GHCiBridge& ghci) const {
+        ghci.command(":set -fobject-code -outputdir \"" + dir + "\" -i\"" + dir + "\"");
+    }
+
+    // Loads the current module set and prompt imports into ghci. Also used to
+    // bring the parallel workers up to date with the object files the main
+    // ghci already compiled. Returns the result of the load, or of the first
+    // scope or import command that failed after it.
+    GHCiResult load_modules(GHCiBridge& ghci) const {
+        std::string load = ":load";
+        std::string scope = ":module +";
+        for (const auto& cell : cells) {
+            load += " " + cell.name;
+            scope += " " + cell.name;
+        }
+        GHCiResult res = ghci.command(cells.empty() ? ":load" : load);
+        auto failed = [](const GHCiResult& r) {
+            return r.died || r.limit != LimitAction::none || parse_ghc_diagnostics(r.err).failed;
+        };
+        if (failed(res)) return res;
+
+        // :load resets the prompt scope
+        std::vector<std::string> commands;
+        if (!cells.empty()) commands.push_back(scope);
+        std::set<std::string> seen;
+        for (const auto& cell : cells) {
+            for (const auto& imp : cell.imports)
+                if (seen.insert(imp).second) commands.push_back(imp);
+        }
+        commands.insert(commands.end(), prompt_imports.begin(), prompt_imports.end());
+        for (const auto& command : commands) {
+            GHCiResult r = ghci.command(command);
+            if (failed(r)) return r;
+        }
+        return res;
+    }
+
+    GHCiResult reload(GHCiBridge& ghci) {
+        if (!configured) {
+            configure(ghci);
+            configured = true;
+        }
+        write_modules();
+        GHCiResult res = load_modules(ghci);
+        update_hash();
+        return res;
+    }
+
+    // Module name for a new cell: from its id, so a notebook reopened with the
+    // same --cache-dir finds its object files, or numbered.
+    std::string new_module_name(const std::string& cell_id) {
+        std::string name;
+        if (!cell_id.empty()) {
+            SHA256 sha;
+            sha.update(cell_id);
+            name = "Cell_" + sha.digest().substr(0, 16);
+        }
+        auto taken = [&](const std::string& n) {
+            for (const auto& cell : cells)
+                if (cell.name == n) return true;
+            return false;
+        };
+        while (name.empty() || taken(name)) name = "Cell_n" + std::to_string(++next_number);
+        return name;
+    }
+
+    // Adds or replaces the module for a definition cell and reloads. A cell
+    // replaces the earlier version with the same cell id, or failing that the
+    // cells defining any of the same names, and takes over its module name.
+    // The names a cell mentions decide its imports; a cell that still fails
+    // with a name out of scope (Template Haskell, RecordWildCards) is retried
+    // once importing every earlier cell. On a compile error, or when the load
+    // overran its time limit, the previous module set is restored.
+    GHCiResult load_cell(GHCiBridge& ghci, const std::string& code, const std::string& cell_id) {
+        CellModule cell = parse_cell(code, cell_id);
+        std::vector<CellModule> previous = cells;
+
+        size_t slot = cells.size();
+        for (size_t i = 0; i < cells.size();) {
+            bool same_cell = !cell_id.empty() && cells[i].cell_id == cell_id;
+            bool overlaps = false;
+            for (const auto& name : cell.defines) {
+                if (cells[i].defines.count(name)) overlaps = true;
+            }
+            if (!same_cell && !overlaps) {
+                ++i;
+                continue;
+            }
+            if (slot == cells.size()) {
+                slot = i;
+                ++i;
+            }
+            else {
+                cells.erase(cells.begin() + i);
+            }
+        }
+        if (slot == cells.size()) {
+            cell.name = new_module_name(cell_id);
+            cells.push_back(cell);
+        }
+        else {
+            cell.name = cells[slot].name;
+            cells[slot] = cell;
+        }
+
+        GHCiResult res = reload(ghci);
+        if (!res.died && res.limit == LimitAction::none && parse_ghc_diagnostics(res.err).failed
+            && has_scope_error(res.err)) {
+            cells[slot].import_all = true;
+            res = reload(ghci);
+        }
+        if (res.died) {
+            // the caller restarts ghci and loads the previous set
+            cells = previous;
+            update_hash();
+        }
+        else if (res.limit != LimitAction::none || parse_ghc_diagnostics(res.err).failed) {
+            cells = previous;
+            reload(ghci);
+        }
+        return res;
+    }
+
+    void remember_import(const std::string& line) {
+        prompt_imports.push_back(trim(line));
+        update_hash();
+    }
+};
+
+#endif
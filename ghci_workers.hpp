@@ -0,0 +1,176 @@
+#ifndef GHCI_WORKERS_HPP
+#define GHCI_WORKERS_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+
+#include "ghci_bridge.hpp"
+#include "ghci_channel.hpp"
+#include "ghci_modules.hpp"
+
+// Extra GHCi processes (--ghci-workers) that evaluate independent expression
+// cells side by side. Workers only ever see the module-cached definitions
+// and prompt imports, never prompt bindings, so a cell is only sent to them
+// while the main ghci holds no other prompt state.
+
+// Output of one cell, collected before anything about it is published.
+struct Evaluation {
+    GHCiResult result;
+    std::string exit_status; // how ghci ended when the cell took it down
+    std::vector<DataFrame> frames;
+    std::string display_dir; // where the cell's files were written
+    bool cache_hit = false;
+};
+
+struct GHCiWorker {
+    GHCiBridge ghci;
+    std::string display_dir;
+    std::string definitions_hash; // definition set currently loaded
+    bool configured = false;
+
+    // Replays the module loads when the definitions changed. The main ghci
+    // already compiled everything, so this only loads object files.
+    void sync(const ModuleCache& modules) {
+        if (definitions_hash == modules.definitions_hash) return;
+        if (!configured) {
+            modules.configure(ghci);
+            configured = true;
+        }
+        modules.load_modules(ghci);
+        definitions_hash = modules.definitions_hash;
+    }
+
+    // Replaces a ghci that died and loads the definitions into the new one.
+    std::string restart(const ModuleCache& modules) {
+        std::string status = ghci.restart();
+        configured = false;
+        definitions_hash.clear();
+        sync(modules);
+        return status;
+    }
+};
+
+void start_workers(std::vector<std::unique_ptr<GHCiWorker>>& workers) {
+    std::vector<std::thread> threads;
+    for (auto& w : workers) {
+        threads.emplace_back([&w] { w->ghci.start(); });
+    }
+    for (auto& t : threads) t.join();
+}
+
+void stop_workers(std::vector<std::unique_ptr<GHCiWorker>>& workers) {
+    for (auto& w : workers) w->ghci.stop();
+}
+
+// Moves the files a cell wrote into the worker's display directory aside, so
+// the next cell on the same worker starts with an empty one. The target is a
+// dot-named subdirectory of dir, which only the kernel creates and which is
+// removed once published. Returns the directory to publish from, empty if
+// the cell wrote nothing.
+std::string take_display_files(const std::string& dir, const std::string& target) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    std::vector<fs::path> files;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.path().filename().string().rfind('.', 0) == 0) continue; // the marker and earlier targets
+        files.push_back(entry.path());
+    }
+    if (files.empty()) return "";
+
+    fs::create_directories(target, ec);
+    for (const auto& f : files) {
+        fs::rename(f, fs::path(target) / f.filename(), ec);
+    }
+    return target;
+}
+
+// Evaluates codes[i] into out[i] for every entry that is not already a cache
+// hit, and calls publish(i) for each cell in order as soon as it and every
+// cell before it are done. Each worker takes the next cell as soon as it is
+// free, so long and short cells balance out; the cells marked in_order all
+// go to the first worker, in order, each only once every cell before it is
+// done. When a cell marked stop_on_error fails, no later cell is started:
+// they stay unevaluated and are published as aborted. Cells that were
+// already running are side-effect free, since in_order ones wait their turn.
+void evaluate_parallel(std::vector<std::unique_ptr<GHCiWorker>>& workers,
+    const ModuleCache& modules,
+    const std::vector<std::string>& codes,
+    const std::vector<bool>& in_order,
+    const std::vector<bool>& stop_on_error,
+    std::vector<Evaluation>& out,
+    const std::function<void(size_t)>& publish)
+{
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<bool> done(codes.size());
+    for (size_t i = 0; i < codes.size(); ++i) done[i] = out[i].cache_hit;
+
+    size_t stop_at = codes.size(); // first failed stop_on_error cell + 1
+    size_t next = 0;               // cells any worker may take
+    size_t next_in_order = 0;      // only advanced by the first worker
+    size_t running = workers.size();
+    auto take = [&](bool first) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (first) {
+                while (next_in_order < stop_at && !(in_order[next_in_order] && !out[next_in_order].cache_hit)) ++next_in_order;
+                if (next_in_order < stop_at
+                    && std::find(done.begin(), done.begin() + next_in_order, false) == done.begin() + next_in_order)
+                    return next_in_order++;
+            }
+            while (next < stop_at && (in_order[next] || out[next].cache_hit)) ++next;
+            if (next < stop_at) return next++;
+            if (!first || next_in_order >= stop_at) return codes.size();
+            finished.wait(lock); // the next in_order cell waits for earlier ones
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (auto& w : workers) {
+        threads.emplace_back([&, worker = w.get(), first = threads.empty()] {
+            worker->sync(modules);
+            size_t i;
+            while ((i = take(first)) < codes.size()) {
+                Evaluation eval;
+                eval.result = worker->ghci.send(codes[i]);
+                if (eval.result.died)
+                    eval.exit_status = worker->restart(modules);
+                else
+                    worker->ghci.read_rts_stats(eval.result.stats);
+                eval.frames = worker->ghci.take_frames();
+                eval.display_dir = take_display_files(worker->display_dir,
+                    (std::filesystem::path(worker->display_dir) / (".cell" + std::to_string(i))).string());
+                bool failed = eval.result.died || eval.result.limit != LimitAction::none
+                    || parse_ghc_diagnostics(eval.result.err).failed;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                out[i] = std::move(eval);
+                done[i] = true;
+                if (failed && stop_on_error[i]) stop_at = std::min(stop_at, i + 1);
+                finished.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            --running;
+            finished.notify_all();
+        });
+    }
+
+    // a cell that is not done once every worker has finished was never started
+    for (size_t i = 0; i < codes.size(); ++i) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&] { return done[i] || running == 0; });
+        }
+        publish(i);
+    }
+    for (auto& t : threads) t.join();
+}
+
+#endif
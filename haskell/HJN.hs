@@ -0,0 +1,70 @@
+-- Helpers for sending binary data from notebook cells to HJNKernel over the
+-- data channel named by HJN_DATA_CHANNEL, bypassing the console output.
+--
+-- Frame layout: [u32 LE kind length][kind][u32 LE payload length][payload]
+
+module HJN
+    ( sendFrame
+    , displayBytes
+    , displayPNG
+    , displaySVG
+    , displayHTML
+    , displayFile
+    , commBuffer
+    ) where
+
+import qualified Data.ByteString as B
+import qualified Data.ByteString.Builder as BB
+import qualified Data.ByteString.Char8 as BC
+import Data.IORef
+import System.Environment (lookupEnv)
+import System.IO
+import System.IO.Unsafe (unsafePerformIO)
+
+channel :: IORef (Maybe Handle)
+channel = unsafePerformIO (newIORef Nothing)
+{-# NOINLINE channel #-}
+
+openChannel :: IO Handle
+openChannel = do
+    cached <- readIORef channel
+    case cached of
+        Just h -> return h
+        Nothing -> do
+            path <- lookupEnv "HJN_DATA_CHANNEL"
+            case path of
+                Nothing -> ioError (userError "HJN_DATA_CHANNEL is not set, not running under HJNKernel?")
+                Just p -> do
+                    h <- openBinaryFile p WriteMode
+                    hSetBuffering h (BlockBuffering Nothing)
+                    writeIORef channel (Just h)
+                    return h
+
+sendFrame :: String -> B.ByteString -> IO ()
+sendFrame kind payload = do
+    h <- openChannel
+    let k = BC.pack kind
+    BB.hPutBuilder h $
+        BB.word32LE (fromIntegral (B.length k)) <> BB.byteString k <>
+        BB.word32LE (fromIntegral (B.length payload)) <> BB.byteString payload
+    hFlush h
+
+displayBytes :: String -> B.ByteString -> IO ()
+displayBytes = sendFrame
+
+displayPNG :: B.ByteString -> IO ()
+displayPNG = sendFrame "image/png"
+
+displaySVG :: String -> IO ()
+displaySVG = sendFrame "image/svg+xml" . BC.pack
+
+displayHTML :: String -> IO ()
+displayHTML = sendFrame "text/html" . BC.pack
+
+-- Sends an existing file, e.g. a chart rendered with toFile.
+displayFile :: String -> FilePath -> IO ()
+displayFile mime path = B.readFile path >>= sendFrame mime
+
+-- Sends a raw buffer to the frontend side of an open comm.
+commBuffer :: String -> B.ByteString -> IO ()
+commBuffer commId = sendFrame ("comm:" ++ commId)
@@ -0,0 +1,323 @@
+#ifndef IOPUB_HPP
+#define IOPUB_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.hpp>
+
+#include "json_parser.hpp"
+#include "jupyter_protocol.hpp"
+#include "kernel_metrics.hpp"
+
+// IOPub output of every session goes through a bounded queue to one
+// publisher thread, the only one touching the IOPub sockets. The sockets
+// are XPUB with ZMQ_XPUB_NODROP: when a subscriber stops reading (a
+// throttled browser tab) sends fail instead of dropping frames at the
+// high-water mark, and the messages wait in the queue.
+//
+// While a queue is backed up, a stream chunk is merged into the previous
+// one of the same cell, and a busy status is skipped when its idle arrives
+// with nothing else from the request queued in between. A queue is full
+// once it holds --iopub-queue messages or --iopub-queue-mb of frames. Then
+// new stream and display messages are dropped, and a comm_msg (widget
+// updates, binary buffers from the data channel) replaces the queued
+// comm_msg messages of the same comm, so only the newest of each comm waits.
+// Everything else is always queued: replies, results, errors and statuses
+// come at a fixed number per request, and clients wait for the idle status.
+
+struct IOPubMessage {
+    std::string msg_type;
+    std::vector<zmq::message_t> frames; // see make_frames
+};
+
+// The IOPub socket of a session with its queue.
+struct IOPubQueue {
+    zmq::socket_t socket;
+    std::string key;                // signs merged messages
+    std::deque<IOPubMessage> queue; // guarded by the publisher's mutex
+    size_t in_flight = 0;           // taken out of queue by the publisher thread, being sent
+    size_t bytes = 0;               // frame bytes queued or in flight
+    bool blocked = false;           // the last send found a subscriber full
+    bool registered = false;
+};
+
+// Merged stream messages stop growing at this size, so a flood of output
+// still ends up being dropped rather than held in one huge message.
+constexpr size_t iopub_max_merged_text = 1 << 20;
+
+// Index of the "<IDS|MSG>" frame, the signed frames follow it.
+size_t frames_delimiter(const std::vector<zmq::message_t>& frames) {
+    for (size_t i = 0; i < frames.size(); ++i)
+        if (frames[i].size() == 9 && memcmp(frames[i].data(), "<IDS|MSG>", 9) == 0) return i;
+    return frames.size();
+}
+
+size_t message_bytes(const IOPubMessage& msg) {
+    size_t n = 0;
+    for (const auto& f : msg.frames) n += f.size();
+    return n;
+}
+
+bool same_frame(const zmq::message_t& a, const zmq::message_t& b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// Appends the text of stream message next to last when both belong to the
+// same request and stream, and re-signs last. Returns false if they do not
+// merge.
+bool merge_stream(IOPubMessage& last, const IOPubMessage& next, const std::string& key) {
+    if (last.msg_type != "stream" || next.msg_type != "stream") return false;
+    size_t a = frames_delimiter(last.frames), b = frames_delimiter(next.frames);
+    if (a + 5 >= last.frames.size() || b + 5 >= next.frames.size()) return false;
+    if (!same_frame(last.frames[a + 3], next.frames[b + 3])) return false;
+
+    LazyJson first, second;
+    first.index(last.frames[a + 5].to_string());
+    second.index(next.frames[b + 5].to_string());
+    Stream merged{ first.str("name"), first.str("text") };
+    std::string more = second.str("text");
+    if (second.str("name") != merged.name || merged.text.size() + more.size() > iopub_max_merged_text) return false;
+    merged.text += more;
+
+    std::string content_json;
+    write_json(merged, content_json);
+    auto view = [](const zmq::message_t& m) { return std::string_view(static_cast<const char*>(m.data()), m.size()); };
+    std::string sig = hmac_sha256(key, { view(last.frames[a + 2]), view(last.frames[a + 3]), view(last.frames[a + 4]), content_json });
+    last.frames[a + 1] = zmq::message_t(sig.data(), sig.size());
+    last.frames[a + 5] = zmq::message_t(content_json.data(), content_json.size());
+    return true;
+}
+
+// True if msg is a status message with the given execution state.
+bool is_status(const IOPubMessage& msg, const char* state) {
+    if (msg.msg_type != "status") return false;
+    size_t d = frames_delimiter(msg.frames);
+    return d + 5 < msg.frames.size() && msg.frames[d + 5].to_string().find(state) != std::string::npos;
+}
+
+// Both are signed messages with the same parent header, i.e. belong to the
+// same request.
+bool same_parent(const IOPubMessage& a, const IOPubMessage& b) {
+    size_t i = frames_delimiter(a.frames), j = frames_delimiter(b.frames);
+    return i + 3 < a.frames.size() && j + 3 < b.frames.size() && same_frame(a.frames[i + 3], b.frames[j + 3]);
+}
+
+// Removes the queued busy status of the request an idle status is for, when
+// nothing else from that request was queued after it; a busy followed by
+// the request's output stays. The idle itself is always queued. Returns
+// whether a busy was removed.
+bool skip_stale_status(IOPubQueue& q, const IOPubMessage& idle) {
+    if (!is_status(idle, "\"idle\"")) return false;
+    for (auto it = q.queue.begin(); it != q.queue.end(); ++it) {
+        if (!is_status(*it, "\"busy\"") || !same_parent(*it, idle)) continue;
+        for (auto later = std::next(it); later != q.queue.end(); ++later)
+            if (same_parent(*later, idle)) return false;
+        q.bytes -= message_bytes(*it);
+        q.queue.erase(it);
+        return true;
+    }
+    return false;
+}
+
+std::string comm_id_of(const IOPubMessage& msg) {
+    size_t d = frames_delimiter(msg.frames);
+    if (msg.msg_type != "comm_msg" || d + 5 >= msg.frames.size()) return "";
+    LazyJson content;
+    if (!content.index(msg.frames[d + 5].to_string()) || !content.has("comm_id")) return "";
+    return content.str("comm_id");
+}
+
+// Removes the queued comm_msg messages of the comm msg is for, which msg
+// supersedes in a full queue. Returns how many were removed.
+size_t supersede_comm_msgs(IOPubQueue& q, const IOPubMessage& msg) {
+    std::string comm_id = comm_id_of(msg);
+    if (comm_id.empty()) return 0;
+    size_t removed = 0;
+    for (auto it = q.queue.begin(); it != q.queue.end();) {
+        if (it->msg_type == "comm_msg" && comm_id_of(*it) == comm_id) {
+            q.bytes -= message_bytes(*it);
+            it = q.queue.erase(it);
+            removed++;
+        }
+        else {
+            ++it;
+        }
+    }
+    return removed;
+}
+
+bool is_droppable(const std::string& msg_type) {
+    return msg_type == "stream" || msg_type == "display_data" || msg_type == "update_display_data";
+}
+
+struct IOPubPublisher {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<IOPubQueue*> queues;
+    size_t capacity = 1000; // messages per queue, --iopub-queue
+    size_t max_bytes = (size_t)256 << 20; // frame bytes per queue, --iopub-queue-mb
+    bool pending = false;
+    bool stopping = false;
+    std::thread thread;
+
+    ~IOPubPublisher() {
+        stop();
+    }
+
+    void push(IOPubQueue& q, IOPubMessage&& msg) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!thread.joinable()) thread = std::thread([this] { run(); });
+            if (!q.registered) {
+                queues.push_back(&q);
+                q.registered = true;
+            }
+            if (q.blocked) {
+                size_t before = q.queue.empty() ? 0 : message_bytes(q.queue.back());
+                if (!q.queue.empty() && merge_stream(q.queue.back(), msg, q.key)) {
+                    q.bytes += message_bytes(q.queue.back()) - before;
+                    iopub_metrics.coalesced++;
+                    return;
+                }
+                if (skip_stale_status(q, msg)) iopub_metrics.stale_status++;
+            }
+            if (q.queue.size() + q.in_flight >= capacity || q.bytes >= max_bytes) {
+                if (is_droppable(msg.msg_type)) {
+                    iopub_metrics.dropped++;
+                    return;
+                }
+                if (msg.msg_type == "comm_msg") iopub_metrics.superseded += supersede_comm_msgs(q, msg);
+            }
+            q.bytes += message_bytes(msg);
+            q.queue.push_back(std::move(msg));
+            if (q.queue.size() > iopub_metrics.max_depth) iopub_metrics.max_depth = q.queue.size();
+            pending = true;
+        }
+        wake.notify_one();
+    }
+
+    // Sends what the subscribers take, then drops the rest. Call before the
+    // sessions go away.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+    // Sends from the front of batch until it is empty or a subscriber is
+    // full. Runs without the lock, only the publisher thread touches the
+    // sockets. Returns the frame bytes sent.
+    size_t send_batch(IOPubQueue& q, std::deque<IOPubMessage>& batch, bool& blocked) {
+        // XPUB passes subscriptions up, unread they would pile up
+        zmq::message_t subscription;
+        while (q.socket.recv(subscription, zmq::recv_flags::dontwait)) {}
+
+        size_t sent = 0;
+        blocked = false;
+        while (!batch.empty()) {
+            std::vector<zmq::message_t>& frames = batch.front().frames;
+            size_t size = message_bytes(batch.front()); // a sent frame is left empty
+            // a copy of the topic frame, so a refused message stays intact
+            zmq::message_t topic;
+            topic.copy(frames[0]);
+            if (!q.socket.send(topic, zmq::send_flags::sndmore | zmq::send_flags::dontwait)) {
+                blocked = true;
+                iopub_metrics.blocked++;
+                break;
+            }
+            std::string record = traffic_log ? traffic_log->encode(static_cast<void*>(q.socket), TrafficDirection::sent, frames) : "";
+            // the rest of a message is never refused once the first frame is in
+            for (size_t i = 1; i < frames.size(); ++i)
+                q.socket.send(frames[i], i + 1 < frames.size() ? zmq::send_flags::sndmore : zmq::send_flags::none);
+            batch.pop_front();
+            sent += size;
+            iopub_metrics.sent++;
+            if (traffic_log) traffic_log->write(record);
+        }
+        return sent;
+    }
+
+    // Takes the queued messages out under the lock and sends them without
+    // it, so a slow subscriber never holds up push() on the session
+    // threads. What was not sent goes back in front of what arrived since.
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            pending = false;
+            bool last_round = stopping; // anything pushed before stop() goes out
+            std::vector<IOPubQueue*> ready = queues;
+            std::vector<std::deque<IOPubMessage>> batches(ready.size());
+            for (size_t i = 0; i < ready.size(); ++i) {
+                batches[i].swap(ready[i]->queue);
+                ready[i]->in_flight = batches[i].size();
+            }
+
+            lock.unlock();
+            std::vector<size_t> sent(ready.size());
+            std::vector<char> refused(ready.size());
+            for (size_t i = 0; i < ready.size(); ++i) {
+                bool b = false;
+                sent[i] = send_batch(*ready[i], batches[i], b);
+                refused[i] = b;
+            }
+            lock.lock();
+
+            bool blocked = false;
+            for (size_t i = 0; i < ready.size(); ++i) {
+                IOPubQueue& q = *ready[i];
+                q.bytes -= sent[i];
+                q.blocked = refused[i];
+                q.in_flight = 0;
+                blocked |= q.blocked;
+                while (!batches[i].empty()) {
+                    q.queue.push_front(std::move(batches[i].back()));
+                    batches[i].pop_back();
+                }
+            }
+            if (last_round) break;
+            // a full subscriber gives no signal when it drains, so retry
+            if (blocked) wake.wait_for(lock, std::chrono::milliseconds(5));
+            else wake.wait(lock, [this] { return pending || stopping; });
+        }
+    }
+};
+
+// Shared by all sessions, the thread starts with the first message.
+IOPubPublisher& iopub_publisher() {
+    static IOPubPublisher instance;
+    return instance;
+}
+
+void send_frames(IOPubQueue& iopub, std::string_view msg_type, std::vector<zmq::message_t>&& frames) {
+    iopub_publisher().push(iopub, IOPubMessage{ std::string(msg_type), std::move(frames) });
+}
+
+void send_status(IOPubQueue& iopub_sock, const std::string& execution_state, const std::string& session, const std::string& key) {
+    // IOPub uses topic as first frame
+    std::string topic = "status";
+    std::vector<zmq::message_t> identities;
+    zmq::message_t topic_message(topic.begin(),topic.end());
+    identities.push_back(std::move(topic_message));
+
+    send_message("status", Status{ execution_state }, identities, key, iopub_sock, session);
+}
+
+// Status for a request, with the request as parent so clients can tell
+// when their request has been fully handled.
+void send_status(IOPubQueue& iopub_sock, const std::string& execution_state, const MessageHeader& parent_header, const std::string& key) {
+    std::vector<zmq::message_t> identities;
+    std::string topic = "status";
+    identities.emplace_back(topic.begin(), topic.end());
+
+    send_message(Status{ execution_state }, parent_header, identities, key, iopub_sock);
+}
+
+#endif // IOPUB_HPP
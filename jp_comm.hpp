@@ -6,10 +6,12 @@
 #include <vector>
 #include <unordered_map>
 #include <functional>
+#include <chrono>
 
 #include "json_parser.hpp"
 #include "sha256.hpp"
 #include "jupyter_protocol.hpp"
+#include "iopub.hpp"
 #include "jp_history.hpp"
 
 
@@ -18,18 +20,24 @@ struct CommInstance {
     JsonValue init_data;
 };
 
-std::unordered_map<std::string, std::function<void(const std::string&, const JsonValue&)>> comm_targets;
-std::unordered_map<std::string, CommInstance> active_comms;
+// Comm targets and open comms of one kernel session.
+struct CommRegistry {
+    std::unordered_map<std::string, std::function<void(const std::string&, const JsonValue&)>> comm_targets;
+    std::unordered_map<std::string, CommInstance> active_comms;
+};
+
+bool comm_verbose = false;
 
-bool comm_target_exists(const std::string& name) {
-    return comm_targets.find(name) != comm_targets.end();
+bool comm_target_exists(const CommRegistry& comms, const std::string& name) {
+    return comms.comm_targets.find(name) != comms.comm_targets.end();
 }
 
-bool comm_instance_exists(const std::string& id) {
-    return active_comms.find(id) != active_comms.end();
+bool comm_instance_exists(const CommRegistry& comms, const std::string& id) {
+    return comms.active_comms.find(id) != comms.active_comms.end();
 }
 
-void create_comm_instance(const std::string& comm_id,
+void create_comm_instance(CommRegistry& comms,
+    const std::string& comm_id,
     const std::string& target_name,
     const JsonValue& init_data)
 {
@@ -37,62 +45,56 @@ void create_comm_instance(const std::string& comm_id,
     inst.target_name = target_name;
     inst.init_data = init_data;
 
-    active_comms[comm_id] = inst;
+    comms.active_comms[comm_id] = inst;
 
-    auto it = comm_targets.find(target_name);
-    if (it != comm_targets.end()) {
+    auto it = comms.comm_targets.find(target_name);
+    if (it != comms.comm_targets.end()) {
         it->second(comm_id, init_data);
     }
 }
 
-void handle_comm_data(const std::string& comm_id,
+void handle_comm_data(CommRegistry& comms,
+    const std::string& comm_id,
     const JsonValue& data,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    auto it = active_comms.find(comm_id);
-    if (it == active_comms.end()) {
+    auto it = comms.active_comms.find(comm_id);
+    if (it == comms.active_comms.end()) {
         std::cerr << "[COMM] Received data for unknown comm_id=" << comm_id << "\n";
         return;
     }
 
-    std::cerr << "[COMM] Data for comm_id=" << comm_id
-        << " = " << data.to_string() << "\n";
-
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-    content.o["data"] = data; // send back exactly what we got
+    if (comm_verbose) {
+        std::cerr << "[COMM] Data for comm_id=" << comm_id
+            << " = " << data.to_string() << "\n";
+    }
 
     send_message(comm_id, data, parent_header, identities, key, socket);
 }
 
 
-void destroy_comm_instance(const std::string& comm_id)
+void destroy_comm_instance(CommRegistry& comms, const std::string& comm_id)
 {
-    auto it = active_comms.find(comm_id);
-    if (it != active_comms.end()) {
+    auto it = comms.active_comms.find(comm_id);
+    if (it != comms.active_comms.end()) {
         std::cerr << "[COMM] Destroying comm_id=" << comm_id
             << " target=" << it->second.target_name << "\n";
-        active_comms.erase(it);
+        comms.active_comms.erase(it);
     }
 }
 
 void send_comopen_reply(const std::vector<HistoryEntry>& entries,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     bool include_output,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["status"] = JsonValue{ JsonValue::String, false, 0.0, "ok" };
-
-    JsonValue history;
-    history.type = JsonValue::Array;
+    HistoryReply content;
+    JsonValue& history = content.history;
 
     for (auto& e : entries) {
         JsonValue tuple;
@@ -114,139 +116,201 @@ void send_comopen_reply(const std::vector<HistoryEntry>& entries,
         history.a.push_back(tuple);
     }
 
-    content.o["history"] = history;
-
-    send_message("history_reply", content, parent_header, identities, key, socket);
+    send_message(content, parent_header, identities, key, socket);
 }
 
-void handle_comm_open(const JsonValue& content,
-    const JsonValue& parent_header,
+void handle_comm_open(CommRegistry& comms,
+    const CommOpen& open,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    std::string comm_id = content.o.at("comm_id").s;
-    std::string target_name = content.o.at("target_name").s;
-    JsonValue data = content.o.at("data");
-
-    if (!comm_target_exists(target_name))
+    if (!comm_target_exists(comms, open.target_name))
     {
-        JsonValue close_content;
-        close_content.type = JsonValue::Object;
-        close_content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-        close_content.o["data"] = JsonValue{ JsonValue::Object }; // empty dict
-
-        send_message("comm_close", close_content, parent_header, identities, key, socket);
+        send_message(CommClose{ open.comm_id }, parent_header, identities, key, socket);
         return;
     }
 
-    create_comm_instance(comm_id, target_name, data);
+    create_comm_instance(comms, open.comm_id, open.target_name, open.data);
 }
 
-void handle_comm_msg(const JsonValue& content,
-    const JsonValue& parent_header,
+void handle_comm_msg(CommRegistry& comms,
+    const CommMsg& msg,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    std::string comm_id = content.o.at("comm_id").s;
-    JsonValue data = content.o.at("data");
-
-    if (!comm_instance_exists(comm_id)) {
-        JsonValue close_content;
-        close_content.type = JsonValue::Object;
-        close_content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-        close_content.o["data"] = JsonValue{ JsonValue::Object };
-        send_message("comm_close", close_content, parent_header, identities, key, socket);
+    if (!comm_instance_exists(comms, msg.comm_id)) {
+        send_message(CommClose{ msg.comm_id }, parent_header, identities, key, socket);
         return;
     }
 
-    handle_comm_data(comm_id, data, parent_header, identities, key, socket);
+    handle_comm_data(comms, msg.comm_id, msg.data, parent_header, identities, key, socket);
 }
 
-void handle_comm_close(const JsonValue& content,
-    const JsonValue& parent_header,
+void handle_comm_close(CommRegistry& comms,
+    const CommClose& close,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities)
 {
-    std::string comm_id = content.o.at("comm_id").s;
-
-    destroy_comm_instance(comm_id);
+    destroy_comm_instance(comms, close.comm_id);
 }
 
 void send_comm_open(const std::string& comm_id,
     const std::string& target_name,
     const JsonValue& data,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
-    zmq::socket_t& socket)
+    IOPubQueue& socket)
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-    content.o["target_name"] = JsonValue{ JsonValue::String, false, 0.0, target_name };
-    content.o["data"] = data;
-
-    send_message("comm_open", content, parent_header, identities, key, socket);
+    send_message(CommOpen{ comm_id, target_name, data }, parent_header, identities, key, socket);
 }
 
 void send_comm_msg(const std::string& comm_id,
     const JsonValue& data,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
-    zmq::socket_t& socket)
+    IOPubQueue& socket,
+    const std::vector<std::string>& buffers = {})
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-    content.o["data"] = data;
-
-    send_message("comm_msg", content, parent_header, identities, key, socket);
+    send_message(CommMsg{ comm_id, data }, parent_header, identities, key, socket, JsonValue{ JsonValue::Object }, buffers);
 }
 
 void send_comm_close(const std::string& comm_id,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
-    zmq::socket_t& socket)
+    IOPubQueue& socket)
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["comm_id"] = JsonValue{ JsonValue::String, false, 0.0, comm_id };
-    content.o["data"] = JsonValue{ JsonValue::Object };
-
-    send_message("comm_close", content, parent_header, identities, key, socket);
+    send_message(CommClose{ comm_id }, parent_header, identities, key, socket);
 }
 
-void handle_comm_info_request(const JsonValue& content,
-    const JsonValue& parent_header,
+void handle_comm_info_request(const CommRegistry& registry,
+    const CommInfoRequest& request,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    std::string target_name;
-    if (content.o.count("target_name")) {
-        target_name = content.o.at("target_name").s;
+    CommInfoReply reply;
+
+    for (const auto& kv : registry.active_comms) {
+        const std::string& comm_id = kv.first;
+        const CommInstance& inst = kv.second;
+
+        if (request.target_name.empty() || inst.target_name == request.target_name)
+            reply.comms[comm_id] = CommInfo{ inst.target_name };
     }
 
-    JsonValue comms(JsonValue::Object);
+    send_message(reply, parent_header, identities, key, socket);
+}
 
-    for (const auto& kv : active_comms) {
-        const std::string& comm_id = kv.first;
-        const CommInstance inst = kv.second;
+// Coalesces bursts of widget state updates per comm_id: while a comm is
+// waiting for its next delivery slot, its pending comm_msg with method
+// "update" absorbs newer ones, their state merged key by key with the newer
+// value winning. The absorbed messages get no reply or busy/idle pair. Any
+// other comm_msg is not held here; the caller flushes the pending updates
+// and handles it in order, like every other request.
+struct CommThrottle {
+    using clock = std::chrono::steady_clock;
+
+    clock::duration min_interval = clock::duration::zero();
+    std::unordered_map<std::string, JupyterMessage> pending;
+    std::unordered_map<std::string, clock::time_point> last_delivery;
+    std::vector<std::string> order;
+    size_t coalesced = 0;
+
+    void set_max_rate(double per_second) {
+        if (per_second > 0.0)
+            min_interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / per_second));
+        else
+            min_interval = clock::duration::zero();
+    }
+
+    bool empty() const {
+        return pending.empty();
+    }
+
+    // Updates that carry binary buffers are left alone: buffer_paths point
+    // into one message's state and would not survive a merge.
+    static bool is_state_update(const JsonValue& data) {
+        if (data.type != JsonValue::Object) return false;
+        auto method = data.o.find("method");
+        auto state = data.o.find("state");
+        auto paths = data.o.find("buffer_paths");
+        return method != data.o.end() && method->second.s == "update"
+            && state != data.o.end() && state->second.type == JsonValue::Object
+            && (paths == data.o.end() || paths->second.a.empty());
+    }
 
-        if (target_name.empty() || inst.target_name == target_name) {
-            JsonValue comm_info(JsonValue::Object);
-            comm_info.o["target_name"] = JsonValue{ JsonValue::String, false, 0.0, inst.target_name };
-            comms.o[comm_id] = comm_info;
+    // Takes msg if it is a state update and returns true; leaves any other
+    // message to the caller.
+    bool push(JupyterMessage& msg) {
+        if (!msg.content.has("data")) return false;
+        JsonValue data = msg.content.value("data");
+        if (!is_state_update(data)) return false;
+
+        std::string comm_id = msg.content.str("comm_id", "");
+        auto it = pending.find(comm_id);
+        if (it != pending.end()) {
+            JsonValue older = it->second.content.value("data");
+            JsonObject& state = data.o["state"].o;
+            for (auto& [name, value] : older.o["state"].o)
+                state.emplace(name, std::move(value)); // keeps the newer value
+            JsonValue content = msg.content.value();
+            content.o["data"] = std::move(data);
+            msg.content.index(content.to_string());
+            it->second = std::move(msg);
+            coalesced++;
+            return true;
         }
+        pending.emplace(comm_id, std::move(msg));
+        order.push_back(comm_id);
+        return true;
     }
 
-    JsonValue reply_content(JsonValue::Object);
-    reply_content.o["status"] = JsonValue{ JsonValue::String, false, 0.0, "ok" };
-    reply_content.o["comms"] = comms;
+    // Delivers every pending update whose comm is out of its rate window
+    // (all of them when force is set), in arrival order.
+    template<class Deliver>
+    void flush(Deliver&& deliver, bool force) {
+        clock::time_point now = clock::now();
+        std::vector<std::string> waiting;
+
+        for (const auto& comm_id : order) {
+            auto last = last_delivery.find(comm_id);
+            if (!force && last != last_delivery.end() && now - last->second < min_interval) {
+                waiting.push_back(comm_id);
+                continue;
+            }
+            auto it = pending.find(comm_id);
+            JupyterMessage msg = std::move(it->second);
+            pending.erase(it);
+            last_delivery[comm_id] = now;
+            deliver(msg);
+        }
+        order.swap(waiting);
+    }
 
-    send_message("comm_info_reply", reply_content, parent_header, identities, key, socket);
-}
+    // Time until the earliest pending update may be delivered.
+    std::chrono::milliseconds time_until_due() const {
+        clock::time_point now = clock::now();
+        clock::duration wait = clock::duration::max();
+        for (const auto& comm_id : order) {
+            auto last = last_delivery.find(comm_id);
+            if (last == last_delivery.end()) return std::chrono::milliseconds(0);
+            clock::duration left = last->second + min_interval - now;
+            if (left < wait) wait = left;
+        }
+        if (wait <= clock::duration::zero()) return std::chrono::milliseconds(0);
+        return std::chrono::duration_cast<std::chrono::milliseconds>(wait) + std::chrono::milliseconds(1);
+    }
+
+    void forget(const std::string& comm_id) {
+        last_delivery.erase(comm_id);
+    }
+};
 #endif // COMM_HPP
\ No newline at end of file
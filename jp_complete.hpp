@@ -0,0 +1,103 @@
+#ifndef COMPLETE_HPP
+#define COMPLETE_HPP
+
+#include <string>
+#include <vector>
+#include <cctype>
+
+#include "jupyter_protocol.hpp"
+#include "ghci_bridge.hpp"
+#include "symbol_index.hpp"
+
+// cursor_pos counts unicode code points, the code is UTF-8.
+size_t utf8_byte_offset(const std::string& s, size_t code_points) {
+    size_t i = 0;
+    while (i < s.size() && code_points > 0) {
+        ++i;
+        while (i < s.size() && ((unsigned char)s[i] & 0xC0) == 0x80) ++i;
+        --code_points;
+    }
+    return i;
+}
+
+size_t utf8_code_points(const std::string& s, size_t bytes) {
+    size_t n = 0;
+    for (size_t i = 0; i < bytes && i < s.size(); ++i) {
+        if (((unsigned char)s[i] & 0xC0) != 0x80) ++n;
+    }
+    return n;
+}
+
+bool is_identifier_char(char c) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == '\'' || c == '.';
+}
+
+// Byte range of the (possibly qualified) identifier around pos.
+void identifier_at(const std::string& code, size_t pos, size_t& start, size_t& end) {
+    start = pos;
+    while (start > 0 && is_identifier_char(code[start - 1])) --start;
+    end = pos;
+    while (end < code.size() && is_identifier_char(code[end])) ++end;
+}
+
+void handle_complete_request(const SymbolIndex& index,
+    const CompleteRequest& request,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    zmq::socket_t& socket)
+{
+    const std::string& code = request.code;
+    size_t cursor = utf8_byte_offset(code, (size_t)request.cursor_pos);
+    size_t start, end;
+    identifier_at(code, cursor, start, end);
+    std::string prefix = code.substr(start, cursor - start);
+
+    CompleteReply reply;
+    reply.cursor_start = (int)utf8_code_points(code, start);
+    reply.cursor_end = (int)utf8_code_points(code, cursor);
+    if (!prefix.empty()) {
+        for (const Symbol* sym : index.complete(prefix, 200)) {
+            reply.matches.push_back(sym->name);
+            reply.metadata.types.push_back({ sym->name, sym->kind, sym->signature, reply.cursor_start, reply.cursor_end });
+        }
+    }
+
+    send_message(reply, parent_header, identities, key, socket);
+}
+
+// Answers from the index; a higher detail_level or a name the index does
+// not know (a prompt binding, say) asks ghci for :info.
+void handle_inspect_request(const SymbolIndex& index,
+    GHCiBridge& ghci,
+    const InspectRequest& request,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    zmq::socket_t& socket)
+{
+    const std::string& code = request.code;
+    size_t cursor = utf8_byte_offset(code, (size_t)request.cursor_pos);
+    size_t start, end;
+    identifier_at(code, cursor, start, end);
+    std::string name = code.substr(start, end - start);
+
+    std::string text;
+    const Symbol* sym = name.empty() ? nullptr : index.find(name);
+    if (sym && request.detail_level == 0) {
+        text = sym->signature + "\n-- " + sym->module;
+    }
+    else if (!name.empty()) {
+        GHCiResult res = ghci.command(":info " + name);
+        if (res.err.empty()) text = trim(res.out);
+        else if (sym) text = sym->signature + "\n-- " + sym->module;
+    }
+
+    InspectReply reply;
+    reply.found = !text.empty();
+    if (reply.found) reply.data.text = text;
+
+    send_message(reply, parent_header, identities, key, socket);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef DISPLAY_HPP
+#define DISPLAY_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "base64.hpp"
+#include "jupyter_protocol.hpp"
+#include "iopub.hpp"
+#include "jp_comm.hpp"
+#include "ghci_channel.hpp"
+
+// Cells publish rich output by writing files into the session's display
+// directory, which ghci sees as HJN_DISPLAY_DIR. After each execution the files are sent as
+// display_data and removed. Files sharing a name form one MIME bundle,
+// e.g. plot.png and plot.txt become {"image/png", "text/plain"}.
+
+struct DisplayMime {
+    const char* extension;
+    const char* mime;
+    bool binary;
+};
+
+static const DisplayMime display_mimes[] = {
+    { ".png",  "image/png",     true },
+    { ".jpg",  "image/jpeg",    true },
+    { ".jpeg", "image/jpeg",    true },
+    { ".gif",  "image/gif",     true },
+    { ".svg",  "image/svg+xml", false },
+    { ".html", "text/html",     false },
+    { ".htm",  "text/html",     false },
+    { ".md",   "text/markdown", false },
+    { ".tex",  "text/latex",    false },
+    { ".txt",  "text/plain",    false },
+};
+
+// Types whose data_frame payload is base64 encoded in display_data, as the
+// notebook format stores them. Every other type is text.
+bool is_binary_mime(const std::string& mime) {
+    auto starts = [&](const char* prefix) { return mime.rfind(prefix, 0) == 0; };
+    if (mime == "image/svg+xml") return false;
+    return starts("image/") || starts("audio/") || starts("video/")
+        || mime == "application/octet-stream" || mime == "application/pdf";
+}
+
+// application/json and the "+json" types (vnd.vegalite.v5+json, geo+json)
+// go out as JSON values rather than strings.
+bool is_json_mime(const std::string& mime) {
+    const std::string suffix = "+json";
+    return mime == "application/json" || (mime.rfind("application/", 0) == 0 && mime.size() > suffix.size()
+        && mime.compare(mime.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+const DisplayMime* find_display_mime(std::string extension) {
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+        [](unsigned char c) { return (char)std::tolower(c); });
+    for (const auto& m : display_mimes) {
+        if (extension == m.extension) return &m;
+    }
+    return nullptr;
+}
+
+// Marks a display directory the kernel created. Only marked directories are
+// emptied at startup; cells and publish_display_files never see the marker,
+// it has no extension.
+constexpr const char* display_dir_marker = ".hjn_display";
+
+// Prepares dir for a session or worker. A missing directory is created and
+// marked; a marked one is left over from an earlier run and is emptied. An
+// existing directory without the marker belongs to the user: it is used
+// when empty and refused (false) otherwise, it is never cleaned.
+bool init_display_dir(const std::string& dir) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path root(dir);
+    if (!fs::exists(root, ec)) {
+        if (!fs::create_directories(root, ec)) {
+            std::cerr << "Could not create display directory " << dir << ": " << ec.message() << std::endl;
+            return false;
+        }
+        std::ofstream(root / display_dir_marker);
+        return true;
+    }
+    if (!fs::is_directory(root, ec)) {
+        std::cerr << "Display directory " << dir << " is not a directory" << std::endl;
+        return false;
+    }
+
+    bool owned = fs::exists(root / display_dir_marker, ec);
+    for (const auto& entry : fs::directory_iterator(root, ec)) {
+        if (entry.path().filename() == display_dir_marker) continue;
+        if (!owned) {
+            std::cerr << "Display directory " << dir << " is not empty and was not created by the kernel, "
+                << "choose an empty or new directory with --display-dir" << std::endl;
+            return false;
+        }
+        fs::remove_all(entry.path(), ec);
+    }
+    return true;
+}
+
+void send_display_data(IOPubQueue& sock,
+    const std::vector<zmq::message_t>& identities,
+    const MessageHeader& parent_header,
+    JsonValue&& data,
+    const std::string& key)
+{
+    JsonValue content(JsonValue::Object);
+    content.o["data"] = std::move(data);
+    content.o["metadata"] = JsonValue(JsonValue::Object);
+    content.o["transient"] = JsonValue(JsonValue::Object);
+
+    send_message("display_data", content, parent_header, identities, key, sock);
+}
+
+// Binary payloads are base64 encoded straight into the string that ends up
+// in the message, text payloads are moved in as read.
+size_t publish_display_files(const std::string& display_dir,
+    IOPubQueue& sock,
+    const std::vector<zmq::message_t>& identities,
+    const MessageHeader& parent_header,
+    const std::string& key)
+{
+    namespace fs = std::filesystem;
+    if (display_dir.empty()) return 0;
+
+    struct Bundle {
+        fs::file_time_type written;
+        JsonValue data;
+    };
+    std::map<std::string, Bundle> bundles;
+
+    std::error_code ec;
+    std::vector<fs::directory_entry> files;
+    for (const auto& entry : fs::directory_iterator(display_dir, ec)) {
+        if (entry.is_regular_file(ec)) files.push_back(entry);
+    }
+
+    for (const auto& entry : files) {
+        const fs::path& path = entry.path();
+        const DisplayMime* mime = find_display_mime(path.extension().string());
+        if (!mime) continue;
+
+        std::string bytes = read_file(path.string());
+        fs::file_time_type written = entry.last_write_time(ec);
+        fs::remove(path, ec);
+
+        auto inserted = bundles.emplace(path.stem().string(), Bundle{ written, JsonValue(JsonValue::Object) });
+        Bundle& bundle = inserted.first->second;
+        if (written < bundle.written) bundle.written = written;
+
+        JsonValue& value = bundle.data.o[mime->mime];
+        value.type = JsonValue::String;
+        if (mime->binary)
+            base64_encode(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(), value.s);
+        else
+            value.s = std::move(bytes);
+    }
+
+    std::vector<Bundle*> ordered;
+    for (auto& kv : bundles) ordered.push_back(&kv.second);
+    std::stable_sort(ordered.begin(), ordered.end(),
+        [](const Bundle* a, const Bundle* b) { return a->written < b->written; });
+
+    for (Bundle* bundle : ordered) {
+        send_display_data(sock, identities, parent_header, std::move(bundle->data), key);
+    }
+    return ordered.size();
+}
+
+// Forwards a frame from the ghci data channel: "comm:<comm_id>" frames go out
+// as comm_msg with the payload as a raw buffer, anything else is a MIME type
+// for display_data.
+void publish_data_frame(DataFrame&& frame,
+    IOPubQueue& sock,
+    const std::vector<zmq::message_t>& identities,
+    const MessageHeader& parent_header,
+    const std::string& key)
+{
+    if (frame.kind.rfind("comm:", 0) == 0) {
+        std::vector<std::string> buffers;
+        buffers.push_back(std::move(frame.payload));
+        send_comm_msg(frame.kind.substr(5), JsonValue(JsonValue::Object),
+            parent_header, identities, key, sock, buffers);
+        return;
+    }
+
+    JsonValue data(JsonValue::Object);
+    JsonValue& value = data.o[frame.kind];
+    if (is_json_mime(frame.kind)) {
+        Parser p(frame.payload);
+        value = p.parse_value();
+    }
+    else if (is_binary_mime(frame.kind)) {
+        value.type = JsonValue::String;
+        base64_encode(reinterpret_cast<const uint8_t*>(frame.payload.data()), frame.payload.size(), value.s);
+    }
+    else {
+        value = JsonValue{ JsonValue::String, false, 0.0, std::move(frame.payload) };
+    }
+    send_display_data(sock, identities, parent_header, std::move(data), key);
+}
+
+void publish_data_frames(std::vector<DataFrame>&& frames,
+    IOPubQueue& sock,
+    const std::vector<zmq::message_t>& identities,
+    const MessageHeader& parent_header,
+    const std::string& key)
+{
+    for (auto& frame : frames)
+        publish_data_frame(std::move(frame), sock, identities, parent_header, key);
+}
+
+#endif // DISPLAY_HPP
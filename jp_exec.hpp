@@ -1,64 +1,163 @@
 #ifndef EXEC_HPP
 #define EXEC_HPP
 
+#include <string>
+#include <vector>
+#include <regex>
+
 #include "jupyter_protocol.hpp"
+#include "iopub.hpp"
+#include "watchdog.hpp"
+
+struct ExecError {
+    bool failed = false;
+    std::string ename;
+    std::string evalue;
+    std::vector<std::string> traceback;
+};
+
+// Recognizes the first GHC error diagnostic ("<file>:<line>:<col>: error: [GHC-xxxxx]")
+// or runtime exception ("*** Exception: ...") in ghci's stderr. Warnings do
+// not count as failures.
+ExecError parse_ghc_diagnostics(const std::string& err) {
+    ExecError error;
+
+    std::vector<std::string> lines;
+    size_t begin = 0;
+    while (begin < err.size()) {
+        size_t end = err.find('\n', begin);
+        if (end == std::string::npos) end = err.size();
+        std::string line = err.substr(begin, end - begin);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        lines.push_back(line);
+        begin = end + 1;
+    }
+
+    static const std::regex compile_error(R"(^\S.*:\d+:\d+(-\d+)?: error:\s*(\[([^\]]+)\])?\s*(.*)$)");
+    static const std::regex exception(R"(^\*\*\* Exception: (.*)$)");
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        std::smatch m;
+        if (std::regex_match(lines[i], m, compile_error)) {
+            error.ename = m[3].matched ? m[3].str() : "CompileError";
+            error.evalue = m[4].str();
+            for (size_t j = i + 1; error.evalue.empty() && j < lines.size(); ++j) {
+                size_t first = lines[j].find_first_not_of(' ');
+                if (first != std::string::npos) error.evalue = lines[j].substr(first);
+            }
+        }
+        else if (std::regex_match(lines[i], m, exception)) {
+            error.ename = "Exception";
+            error.evalue = m[1].str();
+        }
+        else {
+            continue;
+        }
+        error.failed = true;
+        error.traceback.assign(lines.begin() + i, lines.end());
+        break;
+    }
+    return error;
+}
 
-void send_execute_result(zmq::socket_t& sock,
+// The error for a cell the watchdog stopped or that took ghci down with it.
+// exit_status says how the old process ended when ghci had to be restarted.
+ExecError limit_error(LimitAction action, bool died, const std::string& exit_status, double timeout) {
+    ExecError error;
+    error.failed = true;
+    std::string limit;
+    write_json_number(timeout, limit);
+    std::string restarted = "GHCi was restarted and prompt bindings were lost";
+    if (action == LimitAction::interrupted && !died) {
+        error.ename = "TimeoutError";
+        error.evalue = "Cell exceeded the time limit of " + limit + " s and was interrupted";
+    }
+    else if (action != LimitAction::none) {
+        error.ename = "TimeoutError";
+        error.evalue = "Cell exceeded the time limit of " + limit + " s and was killed; " + restarted;
+    }
+    else {
+        error.ename = "GHCiExited";
+        error.evalue = "GHCi exited" + (exit_status.empty() ? "" : " (" + exit_status + ")") + "; " + restarted;
+    }
+    error.traceback.push_back(error.ename + ": " + error.evalue);
+    return error;
+}
+
+void send_execute_result(IOPubQueue& sock,
     const std::vector<zmq::message_t>& identities,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::string& result,
     int execution_count,
     const std::string& key)
 {
-    // Escape quotes and backslashes in the result
-    std::string escaped_result;
-    for (char c : result) {
-        if (c == '\\') escaped_result += "\\\\";
-        else if (c == '"') escaped_result += "\\\"";
-        else escaped_result += c;
-    }
-
-    JsonValue content(JsonValue::Object);
-    content.o["execution_count"] = JsonValue{ JsonValue::Number, false, (double)execution_count, "" };
-
-    JsonValue data(JsonValue::Object);
-    data.o["text/plain"] = JsonValue{ JsonValue::String, false, 0.0, result };
-
-    content.o["data"] = data;
-    content.o["metadata"] = JsonValue(JsonValue::Object);
+    ExecuteResult content;
+    content.execution_count = execution_count;
+    content.data.text = result;
 
-    send_message("execute_result", content, parent_header, identities, key, sock);
+    send_message(content, parent_header, identities, key, sock);
 }
 
 void send_execute_input(const std::string& code,
     int execution_count,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    IOPubQueue& socket) {
+
+    send_message(ExecuteInput{ code, execution_count }, parent_header, identities, key, socket);
+}
+
+void send_execute_reply(int execution_count,
+    const ExecError& error,
+    const JsonValue& metadata,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket) {
 
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["code"] = JsonValue{ JsonValue::String, false, 0.0, code };
-    content.o["execution_count"] = JsonValue{ JsonValue::Number, false, (double)execution_count, "" };
+    ExecuteReply content;
+    content.status = error.failed ? "error" : "ok";
+    content.execution_count = execution_count;
+    if (error.failed) {
+        content.ename = error.ename;
+        content.evalue = error.evalue;
+        content.traceback = error.traceback;
+    }
+    content.user_expressions.emplace();
+    content.payload.emplace();
 
-    send_message("execute_input", content, parent_header, identities, key, socket);
+    send_message(content, parent_header, identities, key, socket, metadata);
 }
 
-void send_execute_reply(int execution_count,
-    const JsonValue& parent_header,
+// Reply for requests skipped because an earlier cell failed with stop_on_error.
+void send_execute_aborted_reply(const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket) {
 
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["status"] = JsonValue{ JsonValue::String, false, 0.0, "ok" };
-    content.o["execution_count"] = JsonValue{ JsonValue::Number, false, (double)execution_count, "" };
-    JsonValue expressions = JsonValue{ JsonValue::Object };
-    content.o["user_expressions"] = expressions;
-    content.o["payload"] = JsonValue{ JsonValue::Array, {} };
+    ExecuteReply content;
+    content.status = "aborted";
+
+    send_message(content, parent_header, identities, key, socket);
+}
+
+void send_stream(const std::string& name,
+    const std::string& text,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    IOPubQueue& socket) {
+
+    send_message(Stream{ name, text }, parent_header, identities, key, socket);
+}
+
+void send_error(const ExecError& error,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    IOPubQueue& socket) {
 
-    send_message("execute_reply", content, parent_header, identities, key, socket);
+    send_message(Error{ error.ename, error.evalue, error.traceback }, parent_header, identities, key, socket);
 }
 #endif // EXEC_HPP
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <algorithm>
 #include <regex>
 
 #include"jupyter_protocol.hpp"
@@ -15,9 +16,7 @@ struct HistoryEntry {
     std::string output;
 };
 
-std::vector<HistoryEntry> execution_history;
-
-std::vector<HistoryEntry> get_history_range(int session, int start, int stop) {
+std::vector<HistoryEntry> get_history_range(const std::vector<HistoryEntry>& execution_history, int session, int start, int stop) {
     std::vector<HistoryEntry> result;
     for (const auto& entry : execution_history) {
         if (entry.session == session &&
@@ -29,19 +28,19 @@ std::vector<HistoryEntry> get_history_range(int session, int start, int stop) {
     return result;
 }
 
-std::vector<HistoryEntry> get_history_tail(int n) {
+std::vector<HistoryEntry> get_history_tail(const std::vector<HistoryEntry>& execution_history, int n) {
     std::vector<HistoryEntry> result;
     if (n <= 0) return result;
 
     int total = static_cast<int>(execution_history.size());
-    int start = max(0, total - n);
+    int start = std::max(0, total - n);
     for (int i = start; i < total; ++i) {
         result.push_back(execution_history[i]);
     }
     return result;
 }
 
-std::vector<HistoryEntry> search_history(const std::string& pattern, bool unique) {
+std::vector<HistoryEntry> search_history(const std::vector<HistoryEntry>& execution_history, const std::string& pattern, bool unique) {
     std::vector<HistoryEntry> result;
     std::set<std::string> seen;
 
@@ -64,18 +63,14 @@ std::vector<HistoryEntry> search_history(const std::string& pattern, bool unique
 }
 
 void send_history_reply(const std::vector<HistoryEntry>& entries,
-    const JsonValue& parent_header,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     bool include_output,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["status"] = JsonValue{ JsonValue::String, false, 0.0, "ok" };
-
-    JsonValue history;
-    history.type = JsonValue::Array;
+    HistoryReply content;
+    JsonValue& history = content.history;
 
     for (auto& e : entries) {
         JsonValue tuple;
@@ -97,45 +92,37 @@ void send_history_reply(const std::vector<HistoryEntry>& entries,
         history.a.push_back(tuple);
     }
 
-    content.o["history"] = history;
-
-    send_message("history_reply", content, parent_header, identities, key, socket);
+    send_message(content, parent_header, identities, key, socket);
 }
 
-void handle_history_request(const JsonValue& content,
-    const JsonValue& parent_header,
+void handle_history_request(const std::vector<HistoryEntry>& execution_history,
+    const HistoryRequest& request,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     zmq::socket_t& socket)
 {
-    bool output = content.o.at("output").b;
-    bool raw = content.o.at("raw").b;
-    std::string hist_type = content.o.at("hist_access_type").s;
-
-    int session = content.o.count("session") ? (int)content.o.at("session").n : 0;
-    int start = content.o.count("start") ? (int)content.o.at("start").n : 0;
-    int stop = content.o.count("stop") ? (int)content.o.at("stop").n : 0;
-    int n = content.o.count("n") ? (int)content.o.at("n").n : 10;
-    std::string pattern = content.o.count("pattern") ? content.o.at("pattern").s : "";
-    bool unique = content.o.count("unique") ? content.o.at("unique").b : false;
+    const std::string& hist_type = request.hist_access_type;
 
     std::vector<HistoryEntry> selected;
 
     if (hist_type == "range") {
-        selected = get_history_range(session, start, stop);
+        selected = get_history_range(execution_history, request.session, request.start, request.stop);
     }
     else if (hist_type == "tail") {
-        selected = get_history_tail(n);
+        selected = get_history_tail(execution_history, request.n);
     }
     else if (hist_type == "search") {
-        selected = search_history(pattern, unique);
+        selected = search_history(execution_history, request.pattern, request.unique);
     }
     else {
         std::cerr << "Unhandled history type " << hist_type << std::endl;
-        exit(1);
+        send_error_reply("history_request", "ValueError", "Unsupported hist_access_type " + hist_type,
+            parent_header, identities, key, socket);
+        return;
     }
 
-    send_history_reply(selected, parent_header, identities, output, key, socket);
+    send_history_reply(selected, parent_header, identities, request.output, key, socket);
 }
 
 #endif // HISTORY_HPP
\ No newline at end of file
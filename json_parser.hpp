@@ -6,7 +6,13 @@
 #include <vector>
 #include <map>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
 
 struct JsonValue;
 
@@ -22,6 +28,7 @@ struct JsonValue {
     JsonObject o;
 
     std::string to_string() const;
+    void write(std::string& out) const;
 };
 
 struct Parser {
@@ -68,21 +75,37 @@ struct Parser {
         return out;
     }
 
+    // Integers of up to 15 digits (counts, ports, cursor positions) are
+    // accumulated directly, anything else goes through from_chars, which
+    // rounds correctly and ignores the locale.
     double parse_number() {
         skip();
         size_t start = pos;
-        if (text[pos] == '-') pos++;
-        while (pos < text.size() && std::isdigit(text[pos])) pos++;
+        bool negative = pos < text.size() && text[pos] == '-';
+        if (negative) pos++;
+        uint64_t integer = 0;
+        size_t digits_start = pos;
+        while (pos < text.size() && std::isdigit((unsigned char)text[pos])) {
+            integer = integer * 10 + (uint64_t)(text[pos] - '0');
+            pos++;
+        }
+        bool is_integer = pos - digits_start <= 15;
         if (pos < text.size() && text[pos] == '.') {
+            is_integer = false;
             pos++;
-            while (pos < text.size() && std::isdigit(text[pos])) pos++;
+            while (pos < text.size() && std::isdigit((unsigned char)text[pos])) pos++;
         }
         if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+            is_integer = false;
             pos++;
             if (text[pos] == '+' || text[pos] == '-') pos++;
-            while (pos < text.size() && std::isdigit(text[pos])) pos++;
+            while (pos < text.size() && std::isdigit((unsigned char)text[pos])) pos++;
         }
-        return std::stod(text.substr(start, pos - start));
+        if (is_integer) return negative ? -(double)integer : (double)integer;
+
+        double value = 0.0;
+        std::from_chars(text.data() + start, text.data() + pos, value);
+        return value;
     }
 
     JsonValue parse_value() {
@@ -111,37 +134,190 @@ struct Parser {
             pos++;
             JsonArray arr;
             skip();
-            if (match(']')) return JsonValue{ JsonValue::Array, false, 0.0, "", arr };
+            if (match(']')) return JsonValue{ JsonValue::Array, false, 0.0, "", std::move(arr) };
             while (true) {
                 arr.push_back(parse_value());
                 skip();
                 if (match(']')) break;
                 match(',');
             }
-            return JsonValue{ JsonValue::Array, false, 0.0, "", arr };
+            return JsonValue{ JsonValue::Array, false, 0.0, "", std::move(arr) };
         }
         if (text[pos] == '{') {
             pos++;
             JsonObject obj;
             skip();
-            if (match('}')) return JsonValue{ JsonValue::Object, false, 0.0, "", {}, obj };
+            if (match('}')) return JsonValue{ JsonValue::Object, false, 0.0, "", {}, std::move(obj) };
             while (true) {
                 skip();
                 std::string key = parse_string();
                 skip();
                 match(':');
-                JsonValue val = parse_value();
-                obj[key] = val;
+                obj[std::move(key)] = parse_value();
                 skip();
                 if (match('}')) break;
                 match(',');
             }
-            return JsonValue{ JsonValue::Object, false, 0.0, "", {}, obj };
+            return JsonValue{ JsonValue::Object, false, 0.0, "", {}, std::move(obj) };
         }
         return JsonValue{ JsonValue::Null };
     }
 };
 
+// Returns the position just past the value starting at pos. Strings are
+// skipped with memchr and containers by bracket depth, nothing is decoded.
+size_t skip_json_string(const std::string& text, size_t pos) {
+    size_t from = pos + 1;
+    while (true) {
+        const void* quote = std::memchr(text.data() + from, '"', text.size() - from);
+        if (!quote) return text.size();
+        size_t q = (const char*)quote - text.data();
+        size_t backslashes = 0;
+        while (q - backslashes > pos + 1 && text[q - backslashes - 1] == '\\') backslashes++;
+        if (backslashes % 2 == 0) return q + 1;
+        from = q + 1;
+    }
+}
+
+size_t skip_json_value(const std::string& text, size_t pos) {
+    if (pos >= text.size()) return pos;
+    char c = text[pos];
+    if (c == '"') return skip_json_string(text, pos);
+    if (c == '{' || c == '[') {
+        int depth = 0;
+        while (pos < text.size()) {
+            c = text[pos];
+            if (c == '"') {
+                pos = skip_json_string(text, pos);
+                continue;
+            }
+            if (c == '{' || c == '[') depth++;
+            else if ((c == '}' || c == ']') && --depth == 0) return pos + 1;
+            pos++;
+        }
+        return pos;
+    }
+    while (pos < text.size() && !std::strchr(",}] \t\r\n", text[pos])) pos++;
+    return pos;
+}
+
+// A JSON object that is decoded on demand. index() makes one pass over the
+// text and records where each top-level member's key and value are; the
+// accessors decode one member when asked. Handlers that never look at a
+// large member (a cell's code, a comm's data) never pay for decoding it.
+struct LazyJson {
+    struct Member {
+        uint32_t key_start;
+        uint32_t key_len;
+        uint32_t value_start;
+        uint32_t value_len;
+    };
+
+    std::string text;
+    std::vector<Member> members;
+
+    // Returns false if text is not an object; the document is then empty.
+    bool index(std::string t) {
+        text = std::move(t);
+        members.clear();
+        Parser p(text);
+        if (!p.match('{')) return false;
+        while (true) {
+            p.skip();
+            if (p.pos >= text.size() || text[p.pos] == '}') break;
+            if (text[p.pos] != '"') return false;
+            size_t key_end = skip_json_string(text, p.pos);
+            Member m{ (uint32_t)(p.pos + 1), (uint32_t)(key_end - p.pos - 2), 0, 0 };
+            p.pos = key_end;
+            if (!p.match(':')) return false;
+            p.skip();
+            size_t value_end = skip_json_value(text, p.pos);
+            m.value_start = (uint32_t)p.pos;
+            m.value_len = (uint32_t)(value_end - p.pos);
+            members.push_back(m);
+            p.pos = value_end;
+            if (!p.match(',')) break;
+        }
+        return true;
+    }
+
+    // Searched from the back: with duplicate keys the last one wins, as in
+    // a parsed JsonObject.
+    const Member* find(std::string_view key) const {
+        for (auto it = members.rbegin(); it != members.rend(); ++it) {
+            if (std::string_view(text.data() + it->key_start, it->key_len) == key) return &*it;
+        }
+        return nullptr;
+    }
+
+    // Like JsonObject::at, throws when the member is missing.
+    const Member& at(std::string_view key) const {
+        const Member* m = find(key);
+        if (!m) throw std::out_of_range("missing field " + std::string(key));
+        return *m;
+    }
+
+    bool has(std::string_view key) const {
+        return find(key) != nullptr;
+    }
+
+    // Raw text of a member's value, e.g. to pass it on without decoding.
+    std::string_view raw(const Member& m) const {
+        return std::string_view(text.data() + m.value_start, m.value_len);
+    }
+
+    std::string str(const Member& m) const {
+        if (text[m.value_start] != '"') return "";
+        std::string_view body = raw(m).substr(1, m.value_len - 2);
+        if (body.find('\\') == std::string_view::npos) return std::string(body);
+        Parser p(text);
+        p.pos = m.value_start;
+        return p.parse_string();
+    }
+
+    double number(const Member& m) const {
+        char c = text[m.value_start];
+        if (c != '-' && !std::isdigit((unsigned char)c)) return 0.0;
+        Parser p(text);
+        p.pos = m.value_start;
+        return p.parse_number();
+    }
+
+    bool boolean(const Member& m) const {
+        return text.compare(m.value_start, 4, "true") == 0;
+    }
+
+    JsonValue value(const Member& m) const {
+        Parser p(text);
+        p.pos = m.value_start;
+        return p.parse_value();
+    }
+
+    std::string str(std::string_view key) const { return str(at(key)); }
+    double number(std::string_view key) const { return number(at(key)); }
+    bool boolean(std::string_view key) const { return boolean(at(key)); }
+    JsonValue value(std::string_view key) const { return value(at(key)); }
+
+    std::string str(std::string_view key, const std::string& fallback) const {
+        const Member* m = find(key);
+        return m ? str(*m) : fallback;
+    }
+    double number(std::string_view key, double fallback) const {
+        const Member* m = find(key);
+        return m ? number(*m) : fallback;
+    }
+    bool boolean(std::string_view key, bool fallback) const {
+        const Member* m = find(key);
+        return m ? boolean(*m) : fallback;
+    }
+
+    // The whole document.
+    JsonValue value() const {
+        Parser p(text);
+        return p.parse_value();
+    }
+};
+
 void print_json(const JsonValue& v, int indent = 0) {
     std::string pad(indent, ' ');
     switch (v.type) {
@@ -180,52 +356,87 @@ void print_json(const JsonValue& v, int indent = 0) {
     }
 }
 
-std::string JsonValue::to_string() const {
-    std::ostringstream os;
+void write_json_string(const std::string& s, std::string& out) {
+    out += '"';
+    size_t run = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char* esc = nullptr;
+        switch (s[i]) {
+        case '\\': esc = "\\\\"; break;
+        case '"': esc = "\\\""; break;
+        case '\n': esc = "\\n"; break;
+        case '\r': esc = "\\r"; break;
+        case '\t': esc = "\\t"; break;
+        default: continue;
+        }
+        out.append(s, run, i - run);
+        out += esc;
+        run = i + 1;
+    }
+    out.append(s, run, std::string::npos);
+    out += '"';
+}
 
+// Shortest text that reads back as the same double; whole numbers print as
+// integers. JSON has no NaN or infinity.
+void write_json_number(double n, std::string& out) {
+    char buf[32];
+    std::to_chars_result res;
+    if (!std::isfinite(n)) {
+        out += "null";
+        return;
+    }
+    if (n == std::trunc(n) && std::fabs(n) < 1e15)
+        res = std::to_chars(buf, buf + sizeof(buf), (int64_t)n);
+    else
+        res = std::to_chars(buf, buf + sizeof(buf), n);
+    out.append(buf, res.ptr);
+}
+
+// Serializes into a single caller-owned buffer so large strings (base64
+// images, code cells) are copied once instead of once per nesting level.
+void JsonValue::write(std::string& out) const {
     switch (type) {
     case Null:
-        os << "null";
+        out += "null";
         break;
     case Bool:
-        os << (b ? "true" : "false");
+        out += b ? "true" : "false";
         break;
     case Number:
-        os << n;
+        write_json_number(n, out);
         break;
     case String:
-        os << '"';
-        for (char c : s) {
-            if (c == '\\') os << "\\\\";
-            else if (c == '"') os << "\\\"";
-            else if (c == '\n') os << "\\n";
-            else if (c == '\r') os << "\\r";
-            else if (c == '\t') os << "\\t";
-            else os << c;
-        }
-        os << '"';
+        write_json_string(s, out);
         break;
     case Array:
-        os << '[';
+        out += '[';
         for (size_t i = 0; i < a.size(); ++i) {
-            if (i > 0) os << ',';
-            os << a[i].to_string();
+            if (i > 0) out += ',';
+            a[i].write(out);
         }
-        os << ']';
+        out += ']';
         break;
-    case Object:
-        os << '{';
+    case Object: {
+        out += '{';
         bool first = true;
         for (const auto& [key, val] : o) {
-            if (!first) os << ',';
+            if (!first) out += ',';
             first = false;
-            os << '"' << key << "\":" << val.to_string();
+            write_json_string(key, out);
+            out += ':';
+            val.write(out);
         }
-        os << '}';
+        out += '}';
         break;
     }
+    }
+}
 
-    return os.str();
+std::string JsonValue::to_string() const {
+    std::string out;
+    write(out);
+    return out;
 }
 
 #endif // JSON_HPP
@@ -1,15 +1,21 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
-#include <windows.h>
+#include "platform.hpp"
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <zmq.hpp>
 #include "json_parser.hpp"
+#include "protocol_messages.hpp"
 #include "sha256.hpp"
+#include "message_types.hpp"
+#include "kernel_metrics.hpp"
+#include "traffic_log.hpp"
 #include <random>
+#include <atomic>
 
 std::string read_file(const std::string& path) {
     std::ifstream f(path, std::ios::binary);
@@ -18,10 +24,19 @@ std::string read_file(const std::string& path) {
     return s;
 }
 
+// Endpoint of a kernel socket as a connection file describes it:
+// "tcp://127.0.0.1:5555", or for the ipc transport a socket file named after
+// ip and the port, "ipc://kernel-ab12-ipc-5555".
+std::string zmq_endpoint(const std::string& transport, const std::string& ip, int port) {
+    if (transport == "ipc") return "ipc://" + ip + "-" + std::to_string(port);
+    return transport + "://" + ip + ":" + std::to_string(port);
+}
+
+// Message ids are generated on the worker threads of every session, so each
+// thread keeps its own generator.
 std::string make_uuid() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<uint32_t> dist(0, 0xFFFFFFFF);
+    thread_local std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<uint32_t> dist(0, 0xFFFFFFFF);
 
     std::ostringstream ss;
     ss << std::hex << std::setfill('0')
@@ -34,12 +49,10 @@ std::string make_uuid() {
     return ss.str();
 }
 
- //not cross-platform and not needed now
 std::string make_jupyter_style_id() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<uint32_t> dist(0, 0xFFFFFFFF);
-    static int counter = 0;
+    thread_local std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<uint32_t> dist(0, 0xFFFFFFFF);
+    static std::atomic<int> counter = 0;
 
     // Generate standard UUID part
     std::ostringstream ss;
@@ -52,7 +65,7 @@ std::string make_jupyter_style_id() {
         << std::setw(4) << (dist(gen) & 0xFFFF);
 
     // Add process ID and counter
-    ss << "_" << GetCurrentProcessId() << "_" << ++counter;
+    ss << "_" << process_id() << "_" << ++counter;
     return ss.str();
 }
 
@@ -65,7 +78,7 @@ std::string iso8601_now() {
     auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration) % 1000000;
 
     struct tm utc_tm;
-    if (gmtime_s(&utc_tm, &t) != 0) {
+    if (!utc_time(t, utc_tm)) {
         return "";
     }
 
@@ -75,57 +88,192 @@ std::string iso8601_now() {
     return ss.str();
 }
 
+// Header of a received message, the parent of everything sent in reply. The
+// frame is kept as received and shared into each reply's parent frame
+// (zmq_msg_copy only takes a reference), so the parent is never serialized
+// again and goes out with exactly the bytes the client sent.
+struct MessageHeader {
+    JsonValue value;
+    mutable zmq::message_t frame; // copying out marks it shared, the bytes do not change
+
+    MessageHeader() = default;
+    explicit MessageHeader(const JsonValue& v) : value(v), frame(v.to_string()) {}
+};
+
+// The header is decoded on receipt, it routes the message and is the parent
+// of every reply. The other dicts are only indexed, see LazyJson.
+struct JupyterMessage {
+    std::vector<zmq::message_t> identities;
+    MessageHeader header;
+    LazyJson parent_header;
+    LazyJson metadata;
+    LazyJson content;
+    std::string msg_type;
+    MsgType type = MsgType::unknown; // msg_type interned
+    std::string session;
+};
+
+// Reads one multipart message. Returns false when nothing is queued (with
+// recv_flags::dontwait) or the frames are malformed.
+bool recv_message(zmq::socket_t& socket, JupyterMessage& msg, zmq::recv_flags flags) {
+    std::vector<zmq::message_t> parts;
+
+    while (true) {
+        zmq::message_t part;
+        zmq::recv_result_t received = socket.recv(part, parts.empty() ? flags : zmq::recv_flags::none);
+        if (!received.has_value()) {
+            if (!parts.empty()) std::cerr << "Receive failed." << std::endl;
+            return false;
+        }
+        parts.push_back(std::move(part));
+        bool more = socket.get(zmq::sockopt::rcvmore);
+        if (!more) break;
+    }
+    if (traffic_log) traffic_log->record(static_cast<void*>(socket), TrafficDirection::received, parts);
+
+    if (parts.size() < 6) {
+        std::cerr << "Incomplete message received: parts=" << parts.size() << std::endl;
+        return false;
+    }
+
+    // Extract identities (everything before "<IDS|MSG>")
+    size_t i = 0;
+    msg.identities.clear();
+    for (; i < parts.size(); ++i) {
+        std::string part_str(static_cast<char*>(parts[i].data()), parts[i].size());
+        if (part_str == "<IDS|MSG>") {
+            ++i;
+            break;
+        }
+        msg.identities.push_back(std::move(parts[i]));
+    }
+
+    if (i + 4 >= parts.size()) {
+        std::cerr << "Malformed message: missing header parts" << std::endl;
+        return false;
+    }
+
+    std::string header_json = parts[i + 1].to_string();
+
+    StageTimer parse_header(Stage::parse_header);
+    Parser p(header_json);
+    msg.header.value = p.parse_value();
+    msg.header.frame = std::move(parts[i + 1]);
+    msg.msg_type = msg.header.value.o["msg_type"].s;
+    msg.type = intern_msg_type(msg.msg_type);
+    msg.session = msg.header.value.o["session"].s;
+    parse_header.stop();
+
+    StageTimer parse_parent(Stage::parse_parent);
+    msg.parent_header.index(parts[i + 2].to_string());
+    parse_parent.stop();
+
+    StageTimer parse_metadata(Stage::parse_metadata);
+    msg.metadata.index(parts[i + 3].to_string());
+    parse_metadata.stop();
+
+    StageTimer parse_content(Stage::parse_content);
+    msg.content.index(parts[i + 4].to_string());
+    return true;
+}
+
+// Signs a message and lays out its frames:
+// [identities, "<IDS|MSG>", sig, header, parent, metadata, content, buffers]
+std::vector<zmq::message_t> make_frames(const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    const std::string& header_json,
+    zmq::message_t&& parent,
+    const std::string& meta_json,
+    const std::string& content_json,
+    const std::vector<std::string>& buffers)
+{
+    std::string_view parent_json(static_cast<const char*>(parent.data()), parent.size());
+    StageTimer sign(Stage::sign);
+    std::string sig = hmac_sha256(key, { header_json, parent_json, meta_json, content_json });
+    sign.stop();
+
+    std::vector<zmq::message_t> frames;
+    frames.reserve(identities.size() + 6 + buffers.size());
+    for (const auto& id : identities)
+        frames.emplace_back(id.data(), id.size());
+    const std::string delimiter = "<IDS|MSG>";
+    frames.emplace_back(delimiter.data(), delimiter.size());
+    frames.emplace_back(sig.data(), sig.size());
+    frames.emplace_back(header_json.data(), header_json.size());
+    frames.push_back(std::move(parent));
+    frames.emplace_back(meta_json.data(), meta_json.size());
+    frames.emplace_back(content_json.data(), content_json.size());
+    // Raw binary buffers trail the signed frames
+    for (const auto& buffer : buffers)
+        frames.emplace_back(buffer.data(), buffer.size());
+    return frames;
+}
+
+// Shell, control and stdin messages go out directly; IOPub messages are
+// queued instead, see iopub.hpp.
+void send_frames(zmq::socket_t& socket, std::vector<zmq::message_t>&& frames) {
+    if (traffic_log) traffic_log->record(static_cast<void*>(socket), TrafficDirection::sent, frames);
+    StageTimer send(Stage::send);
+    for (size_t i = 0; i < frames.size(); ++i)
+        socket.send(std::move(frames[i]), i + 1 < frames.size() ? zmq::send_flags::sndmore : zmq::send_flags::none);
+}
+
+// Content is a JsonValue or a described message struct, see
+// protocol_messages.hpp; either is written straight into the content frame.
+// Socket is a zmq::socket_t or an IOPubQueue.
+template<class Content, class Socket>
 void send_message(const std::string& msg_type,
-    const JsonValue& content,
-    const JsonValue& parent_header,
+    const Content& content,
+    const MessageHeader& parent_header,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
-    zmq::socket_t& socket
+    Socket& socket,
+    const JsonValue& metadata = JsonValue{ JsonValue::Object },
+    const std::vector<std::string>& buffers = {}
 )
 {
     JsonValue header;
     header.type = JsonValue::Object;
     header.o["msg_id"] = JsonValue{ JsonValue::String, false, 0.0, make_jupyter_style_id() };
     header.o["username"] = JsonValue{ JsonValue::String, false, 0.0, "user" };
-    header.o["session"] = parent_header.o.at("session");
+    header.o["session"] = parent_header.value.o.at("session");
     header.o["date"] = JsonValue{ JsonValue::String, false, 0.0, iso8601_now() };
     header.o["msg_type"] = JsonValue{ JsonValue::String, false, 0.0, msg_type };
     header.o["version"] = JsonValue{ JsonValue::String, false, 0.0, "5.3" };
 
-    JsonValue metadata;
-    metadata.type = JsonValue::Object;
-
+    StageTimer encode(Stage::encode);
     std::string header_json = header.to_string();
-    std::string parent_json = parent_header.to_string();
     std::string meta_json = metadata.to_string();
-    std::string content_json = content.to_string();
-
-    std::string sig = hmac_sha256(key,
-        header_json + parent_json + meta_json + content_json);
-
-    // Send frames: [identities, "<IDS|MSG>", sig, header, parent, metadata, content]
-
-    // Send identities
-    for (const auto& id : identities) {
-        zmq::message_t msg(id.size());
-        memcpy(msg.data(), id.data(), id.size());
-        socket.send(std::move(msg), zmq::send_flags::sndmore);
-    }
+    std::string content_json;
+    write_json(content, content_json);
+    encode.stop();
+
+    zmq::message_t parent;
+    parent.copy(parent_header.frame);
+    std::vector<zmq::message_t> frames = make_frames(identities, key, header_json, std::move(parent), meta_json, content_json, buffers);
+    // the IOPub queue needs the type to decide what it may merge or drop
+    if constexpr (std::is_same_v<Socket, zmq::socket_t>) send_frames(socket, std::move(frames));
+    else send_frames(socket, msg_type, std::move(frames));
+}
 
-    const std::string delimiter = "<IDS|MSG>";
-    socket.send(zmq::message_t(delimiter.data(), delimiter.size()), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(sig), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(header_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(parent_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(meta_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(content_json), zmq::send_flags::none);
+template<Message Content, class Socket>
+void send_message(const Content& content,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    Socket& socket,
+    const JsonValue& metadata = JsonValue{ JsonValue::Object },
+    const std::vector<std::string>& buffers = {})
+{
+    send_message(std::string(MessageFields<Content>::msg_type), content, parent_header, identities, key, socket, metadata, buffers);
 }
 
+template<class Content, class Socket>
 void send_message(const std::string& msg_type,
-    const JsonValue& content,
+    const Content& content,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
-    zmq::socket_t& socket,
+    Socket& socket,
     const std::string session
 )
 {
@@ -144,85 +292,56 @@ void send_message(const std::string& msg_type,
     JsonValue parent_header;
     parent_header.type = JsonValue::Object;
 
+    StageTimer encode(Stage::encode);
     std::string header_json = header.to_string();
     std::string parent_json = parent_header.to_string();
     std::string meta_json = metadata.to_string();
-    std::string content_json = content.to_string();
-
-    std::string sig = hmac_sha256(key,
-        header_json + parent_json + meta_json + content_json);
+    std::string content_json;
+    write_json(content, content_json);
+    encode.stop();
 
-    // Send frames: [identities, "<IDS|MSG>", sig, header, parent, metadata, content]
-
-    // Send identities
-    for (const auto& id : identities) {
-        zmq::message_t msg(id.size());
-        memcpy(msg.data(), id.data(), id.size());
-        socket.send(std::move(msg), zmq::send_flags::sndmore);
-    }
-
-    const std::string delimiter = "<IDS|MSG>";
-    socket.send(zmq::message_t(delimiter.data(), delimiter.size()), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(sig), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(header_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(parent_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(meta_json), zmq::send_flags::sndmore);
-    socket.send(zmq::buffer(content_json), zmq::send_flags::none);
+    std::vector<zmq::message_t> frames = make_frames(identities, key, header_json, zmq::message_t(parent_json.data(), parent_json.size()), meta_json, content_json, {});
+    if constexpr (std::is_same_v<Socket, zmq::socket_t>) send_frames(socket, std::move(frames));
+    else send_frames(socket, msg_type, std::move(frames));
 }
 
-void send_status(zmq::socket_t& iopub_sock, const std::string& execution_state, const std::string& session, const std::string& key) {
-
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["execution_state"] = JsonValue{ JsonValue::String, false, 0.0, execution_state };
-
-    JsonValue parent_header;
-    parent_header.type = JsonValue::Object;
+// Error reply to a request of type request_type ("foo_request" is answered
+// with "foo_reply"). Other messages expect no reply and get none.
+void send_error_reply(const std::string& request_type,
+    const std::string& ename,
+    const std::string& evalue,
+    const MessageHeader& parent_header,
+    const std::vector<zmq::message_t>& identities,
+    const std::string& key,
+    zmq::socket_t& socket)
+{
+    const std::string suffix = "_request";
+    if (request_type.size() <= suffix.size()
+        || request_type.compare(request_type.size() - suffix.size(), suffix.size(), suffix) != 0)
+        return;
+    std::string reply_type = request_type.substr(0, request_type.size() - suffix.size()) + "_reply";
 
-    // IOPub uses topic as first frame
-    std::string topic = "status";
-    std::vector<zmq::message_t> identities;
-    zmq::message_t topic_message(topic.begin(),topic.end());
-    identities.push_back(std::move(topic_message));
+    ErrorReply content;
+    content.ename = ename;
+    content.evalue = evalue;
 
-    send_message("status", content, identities, key, iopub_sock, session);
+    send_message(reply_type, content, parent_header, identities, key, socket);
 }
 
 void send_kernel_info_reply(zmq::socket_t& sock,
     const std::vector<zmq::message_t>& identities,
     const std::string& key,
     const std::string& session,
-    const JsonValue& parent_header)
+    const MessageHeader& parent_header)
 {
-    JsonValue content;
-    content.type = JsonValue::Object;
-    content.o["status"] = JsonValue{ JsonValue::String, false, 0.0, "ok" };
-    content.o["protocol_version"] = JsonValue{ JsonValue::String, false, 0.0, "5.3" };
-    content.o["implementation"] = JsonValue{ JsonValue::String, false, 0.0, "haskell-cpp" };
-    content.o["implementation_version"] = JsonValue{ JsonValue::String, false, 0.0, "0.1" };
-    content.o["banner"] = JsonValue{ JsonValue::String, false, 0.0, "Simple kernel for haskell suport in Jupyter" };
-
-    JsonValue language_info;
-    language_info.type = JsonValue::Object;
-    language_info.o["name"] = JsonValue{ JsonValue::String, false, 0.0, "haskell" };
-    language_info.o["version"] = JsonValue{ JsonValue::String, false, 0.0, "9.8" };
-    language_info.o["mimetype"] = JsonValue{ JsonValue::String, false, 0.0, "text/x-haskell" };
-    language_info.o["file_extension"] = JsonValue{ JsonValue::String, false, 0.0, ".hs" };
-    content.o["language_info"] = language_info;
-
-    JsonValue help_links;
-    help_links.type = JsonValue::Array;
-
-    JsonValue help_link;
-    help_link.type = JsonValue::Object;
-    help_link.o["text"] = JsonValue{ JsonValue::String, false, 0.0, "Help" };
-    help_link.o["url"] = JsonValue{ JsonValue::String, false, 0.0, "https://example.com" };
-
-    help_links.a.push_back(help_link);
-    content.o["help_links"] = help_links;
-
-    content.o["debugger"] = JsonValue{ JsonValue::Bool, false, 0.0, "" };
-    send_message("status", content, parent_header, identities, key, sock);
+    KernelInfoReply content;
+    content.implementation = "haskell-cpp";
+    content.implementation_version = "0.1";
+    content.banner = "Simple kernel for haskell suport in Jupyter";
+    content.language_info = { "haskell", "9.8", "text/x-haskell", ".hs" };
+    content.help_links.push_back({ "Help", "https://example.com" });
+
+    send_message(content, parent_header, identities, key, sock);
 }
 
 #endif // UTILS_HPP
\ No newline at end of file
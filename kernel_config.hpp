@@ -0,0 +1,119 @@
+#ifndef KERNEL_CONFIG_HPP
+#define KERNEL_CONFIG_HPP
+
+#include <filesystem>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json_parser.hpp"
+#include "protocol_messages.hpp"
+#include "jupyter_protocol.hpp"
+#include "ghci_bridge.hpp"
+#include "kernel_options.hpp"
+
+// How GHCi is started for a notebook. Profiles are kept in a kernel config
+// file and each kernelspec picks one with --profile=NAME, e.g.
+//
+//   {
+//     "default_profile": "teaching",
+//     "profiles": {
+//       "teaching": { "ghc_flags": ["-XGHC2021"] },
+//       "numeric": {
+//         "ghc_flags": ["-fobject-code", "-O2"],
+//         "rts_options": ["-N4", "-A64m"],
+//         "env": { "HJN_DATA_SIZE": "large" },
+//         "working_dir": "/home/me/notebooks"
+//       }
+//     }
+//   }
+struct LaunchProfile {
+    std::string interpreter;                // command line of the interpreter, empty = ghci
+    std::vector<std::string> ghc_flags;     // added to the command line
+    std::vector<std::string> rts_options;   // added as +RTS ... -RTS
+    std::map<std::string, std::string> env; // exported to the ghci processes
+    std::string working_dir;                // empty = the kernel's
+};
+
+template<> struct MessageFields<LaunchProfile> {
+    static constexpr auto fields = std::make_tuple(
+        field("interpreter", &LaunchProfile::interpreter),
+        field("ghc_flags", &LaunchProfile::ghc_flags),
+        field("rts_options", &LaunchProfile::rts_options),
+        field("env", &LaunchProfile::env),
+        field("working_dir", &LaunchProfile::working_dir));
+};
+
+struct KernelConfig {
+    std::string default_profile;
+    std::map<std::string, LaunchProfile> profiles;
+};
+
+template<> struct MessageFields<KernelConfig> {
+    static constexpr auto fields = std::make_tuple(
+        field("default_profile", &KernelConfig::default_profile),
+        field("profiles", &KernelConfig::profiles));
+};
+
+KernelConfig load_kernel_config(const std::string& path) {
+    LazyJson doc;
+    std::string text = read_file(path);
+    if (text.empty()) throw std::runtime_error("Could not read config file " + path);
+    if (!doc.index(std::move(text))) throw std::invalid_argument("Config file " + path + " is not a JSON object");
+    try {
+        return decode_message<KernelConfig>(doc);
+    }
+    catch (const std::invalid_argument& e) {
+        throw std::invalid_argument("Config file " + path + ": " + e.what());
+    }
+}
+
+// The profile named by --profile, or the config's default profile. The
+// config comes from --config, or hjn_config.json next to the executable if
+// there is one; without either GHCi starts with no extra flags.
+// --interpreter overrides the profile's interpreter. Throws when the file
+// cannot be read or the profile does not exist.
+LaunchProfile resolve_launch_profile(const KernelOptions& options, const std::string& executable) {
+    std::string path = options.config_file;
+    if (path.empty()) {
+        std::filesystem::path beside = std::filesystem::path(executable).parent_path() / "hjn_config.json";
+        std::error_code ec;
+        if (std::filesystem::exists(beside, ec)) path = beside.string();
+    }
+
+    LaunchProfile profile;
+    if (path.empty()) {
+        if (!options.profile.empty())
+            throw std::invalid_argument("--profile=" + options.profile + " needs a config file (--config=PATH)");
+    }
+    else {
+        KernelConfig config = load_kernel_config(path);
+        std::string name = options.profile.empty() ? config.default_profile : options.profile;
+        if (!name.empty()) {
+            auto it = config.profiles.find(name);
+            if (it == config.profiles.end()) {
+                std::string known;
+                for (const auto& entry : config.profiles) known += " " + entry.first;
+                throw std::invalid_argument("No profile " + name + " in " + path + ", available:" + (known.empty() ? " none" : known));
+            }
+            profile = it->second;
+        }
+    }
+
+    if (!options.interpreter.empty())
+        profile.interpreter = options.interpreter;
+    return profile;
+}
+
+void apply_launch_profile(GHCiBridge& ghci, const LaunchProfile& profile) {
+    if (!profile.interpreter.empty())
+        ghci.program = profile.interpreter;
+    ghci.ghc_flags = profile.ghc_flags;
+    ghci.rts_options = profile.rts_options;
+    ghci.working_dir = profile.working_dir;
+    for (const auto& [name, value] : profile.env)
+        ghci.env.push_back({ name, value });
+}
+
+#endif // KERNEL_CONFIG_HPP
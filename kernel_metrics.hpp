@@ -0,0 +1,236 @@
+#ifndef KERNEL_METRICS_HPP
+#define KERNEL_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <iomanip>
+#include <string>
+
+#include "json_parser.hpp"
+#include "message_types.hpp"
+
+// Lock-free log-linear histogram, in the spirit of HdrHistogram: every power
+// of two is split into 16 linear sub-buckets, so any recorded value is off by
+// at most 1/16 when read back. Sessions on different worker threads record
+// into the same histograms.
+struct Histogram {
+    static constexpr int sub_bits = 4;
+    static constexpr size_t sub_count = size_t(1) << sub_bits;
+    static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+    std::array<std::atomic<uint64_t>, bucket_count> counts{};
+    std::atomic<uint64_t> total = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+
+    static size_t index(uint64_t v) {
+        if (v < sub_count) return (size_t)v;
+        int msb = 63 - std::countl_zero(v);
+        int shift = msb - sub_bits;
+        size_t sub = (size_t)(v >> shift) & (sub_count - 1);
+        return ((size_t)(shift + 1) << sub_bits) + sub;
+    }
+
+    static uint64_t lower_bound(size_t i) {
+        if (i < sub_count) return i;
+        int shift = (int)(i >> sub_bits) - 1;
+        return (uint64_t)(sub_count + (i & (sub_count - 1))) << shift;
+    }
+
+    void record(uint64_t v) {
+        counts[index(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t seen = max.load(std::memory_order_relaxed);
+        while (v > seen && !max.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+    }
+
+    // Lower bound of the bucket holding the p-th percentile (0..100).
+    uint64_t percentile(double p) const {
+        uint64_t n = total.load(std::memory_order_relaxed);
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)(n - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return lower_bound(i);
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+};
+
+// Shell handling time per message type, from receipt to the idle status.
+struct MessageStats {
+    std::atomic<uint64_t> count = 0;
+    Histogram latency_us;
+};
+
+std::array<MessageStats, msg_type_count> shell_stats;
+
+void record_shell_message(MsgType type, std::chrono::steady_clock::duration elapsed) {
+    MessageStats& stats = shell_stats[(size_t)type];
+    stats.count.fetch_add(1, std::memory_order_relaxed);
+    stats.latency_us.record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+// One line per message type that was seen, latencies in microseconds.
+std::string format_shell_stats() {
+    std::ostringstream ss;
+    ss << std::left << std::setw(22) << "msg_type" << std::right
+        << std::setw(10) << "count" << std::setw(12) << "p50" << std::setw(12) << "p99"
+        << std::setw(12) << "max" << std::setw(14) << "total_ms" << "\n";
+    for (size_t i = 0; i < msg_type_count; ++i) {
+        const MessageStats& stats = shell_stats[i];
+        uint64_t count = stats.count.load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        ss << std::left << std::setw(22) << msg_type_name((MsgType)i) << std::right
+            << std::setw(10) << count
+            << std::setw(12) << stats.latency_us.percentile(50)
+            << std::setw(12) << stats.latency_us.percentile(99)
+            << std::setw(12) << stats.latency_us.max.load(std::memory_order_relaxed)
+            << std::setw(14) << stats.latency_us.sum.load(std::memory_order_relaxed) / 1000 << "\n";
+    }
+    return ss.str();
+}
+
+// Stages of handling a message, timed in nanoseconds across all sessions.
+enum class Stage : uint8_t {
+    parse_header,
+    parse_parent,
+    parse_metadata,
+    parse_content,
+    handler,  // whole shell handler, includes the stages below
+    ghci,     // one round trip to the prompt
+    encode,   // JSON serialization of an outgoing message
+    sign,     // HMAC of an outgoing message
+    send,     // zmq send of all frames
+    count,
+};
+
+constexpr std::array<std::string_view, (size_t)Stage::count> stage_names = {
+    "parse_header",
+    "parse_parent",
+    "parse_metadata",
+    "parse_content",
+    "handler",
+    "ghci",
+    "encode",
+    "sign",
+    "send",
+};
+
+std::array<Histogram, (size_t)Stage::count> stage_stats;
+
+// Records the time until the end of the enclosing scope, or until stop().
+struct StageTimer {
+    Stage stage;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool running = true;
+
+    explicit StageTimer(Stage s) : stage(s) {}
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        stage_stats[(size_t)stage].record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// Cost of executed cells: ghci's :set +s figures (and GC time with
+// --cell-stats=gc) and the kernel's time around them.
+struct CellMetrics {
+    Histogram ghc_us;
+    Histogram allocated_bytes;
+    Histogram kernel_us;
+    Histogram gc_us;
+};
+
+CellMetrics cell_metrics;
+
+void record_cell(bool timed, double secs, uint64_t allocated_bytes, double kernel_secs, bool rts, double gc_secs) {
+    if (timed) {
+        cell_metrics.ghc_us.record((uint64_t)(secs * 1e6));
+        cell_metrics.allocated_bytes.record(allocated_bytes);
+    }
+    cell_metrics.kernel_us.record((uint64_t)(kernel_secs * 1e6));
+    if (rts) cell_metrics.gc_us.record((uint64_t)(gc_secs * 1e6));
+}
+
+// IOPub publisher counters, see iopub.hpp.
+struct IOPubMetrics {
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> blocked = 0;      // sends refused by a full subscriber
+    std::atomic<uint64_t> coalesced = 0;    // stream chunks merged into the one before
+    std::atomic<uint64_t> stale_status = 0; // busy statuses skipped
+    std::atomic<uint64_t> dropped = 0;      // output dropped with the queue full
+    std::atomic<uint64_t> superseded = 0;   // comm_msg replaced by a newer one of the same comm with the queue full
+    std::atomic<uint64_t> max_depth = 0;
+};
+
+IOPubMetrics iopub_metrics;
+
+JsonValue histogram_json(const Histogram& h) {
+    JsonValue out(JsonValue::Object);
+    auto number = [](uint64_t v) { return JsonValue{ JsonValue::Number, false, (double)v }; };
+    out.o["count"] = number(h.total.load(std::memory_order_relaxed));
+    out.o["sum"] = number(h.sum.load(std::memory_order_relaxed));
+    out.o["p50"] = number(h.percentile(50));
+    out.o["p90"] = number(h.percentile(90));
+    out.o["p99"] = number(h.percentile(99));
+    out.o["p999"] = number(h.percentile(99.9));
+    out.o["max"] = number(h.max.load(std::memory_order_relaxed));
+    return out;
+}
+
+// Snapshot of all counters: {"unit": {...}, "stages": {name: histogram},
+// "messages": {msg_type: histogram}, "cells": {name: histogram}}. Readers run concurrently with the
+// writers, so the numbers of one histogram can be a few records apart.
+JsonValue metrics_json() {
+    JsonValue units(JsonValue::Object);
+    units.o["stages"] = JsonValue{ JsonValue::String, false, 0.0, "ns" };
+    units.o["messages"] = JsonValue{ JsonValue::String, false, 0.0, "us" };
+    units.o["cells"] = JsonValue{ JsonValue::String, false, 0.0, "us, allocated_bytes in bytes" };
+
+    JsonValue stages(JsonValue::Object);
+    for (size_t i = 0; i < (size_t)Stage::count; ++i) {
+        stages.o[std::string(stage_names[i])] = histogram_json(stage_stats[i]);
+    }
+
+    JsonValue messages(JsonValue::Object);
+    for (size_t i = 0; i < msg_type_count; ++i) {
+        if (shell_stats[i].count.load(std::memory_order_relaxed) == 0) continue;
+        messages.o[std::string(msg_type_name((MsgType)i))] = histogram_json(shell_stats[i].latency_us);
+    }
+
+    JsonValue cells(JsonValue::Object);
+    cells.o["ghc_us"] = histogram_json(cell_metrics.ghc_us);
+    cells.o["allocated_bytes"] = histogram_json(cell_metrics.allocated_bytes);
+    cells.o["kernel_us"] = histogram_json(cell_metrics.kernel_us);
+    cells.o["gc_us"] = histogram_json(cell_metrics.gc_us);
+
+    auto count = [](const std::atomic<uint64_t>& v) { return JsonValue{ JsonValue::Number, false, (double)v.load(std::memory_order_relaxed) }; };
+    JsonValue iopub(JsonValue::Object);
+    iopub.o["sent"] = count(iopub_metrics.sent);
+    iopub.o["blocked"] = count(iopub_metrics.blocked);
+    iopub.o["coalesced"] = count(iopub_metrics.coalesced);
+    iopub.o["stale_status"] = count(iopub_metrics.stale_status);
+    iopub.o["dropped"] = count(iopub_metrics.dropped);
+    iopub.o["superseded"] = count(iopub_metrics.superseded);
+    iopub.o["max_depth"] = count(iopub_metrics.max_depth);
+
+    JsonValue out(JsonValue::Object);
+    out.o["unit"] = units;
+    out.o["stages"] = stages;
+    out.o["messages"] = messages;
+    out.o["cells"] = cells;
+    out.o["iopub"] = iopub;
+    return out;
+}
+
+#endif
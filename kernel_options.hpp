@@ -0,0 +1,146 @@
+#ifndef KERNEL_OPTIONS_HPP
+#define KERNEL_OPTIONS_HPP
+
+#include <charconv>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "resource_limits.hpp"
+
+// Settings passed on the kernel command line,
+// e.g. "argv": ["HJNKernel.exe", "{connection_file}", "--comm-max-rate=30"]
+// Every argument that is not an option names a connection file; each one is
+// served as a separate session by the same process.
+struct KernelOptions {
+    std::vector<std::string> connection_files;
+    double comm_max_rate = 30.0; // comm_msg deliveries per second per comm, 0 = unlimited
+    std::string display_dir;     // empty = per-process directory under the system temp dir
+    std::string cache_dir;       // compiled definition cells, same default as display_dir
+    size_t exec_cache_mb = 0;    // expression result cache size, 0 = off
+    size_t ghci_workers = 0;     // extra GHCi processes per session for parallel expression cells
+    size_t threads = 0;          // worker threads shared by the sessions, 0 = one per session up to the core count
+    std::string interpreter;     // command line started instead of ghci.exe, e.g. the stub from bench/
+    std::string config_file;     // launch profiles, see kernel_config.hpp; empty = hjn_config.json next to the executable
+    std::string profile;         // launch profile to use, empty = the config's default
+    std::string record_file;     // shell and IOPub traffic log, see traffic_log.hpp; empty = off
+    size_t iopub_queue = 1000;   // IOPub messages held per session for a slow frontend, see iopub.hpp
+    size_t iopub_queue_mb = 256; // and their size
+    size_t stats_interval = 0;   // seconds between shell statistics dumps to stderr, 0 = off
+    std::string cell_stats = "time"; // per-cell cost in execute_reply metadata: off, time (:set +s) or gc (also +RTS -T)
+    ResourceLimits limits;       // --cell-timeout, --interrupt-grace, --max-heap, --max-memory-mb, --cpu-limit, --cgroup
+    bool verbose = false;
+    bool valid = true;           // false after a malformed option value, main prints the usage
+};
+
+bool split_option(const std::string& arg, std::string& name, std::string& value) {
+    if (arg.rfind("--", 0) != 0) return false;
+    size_t eq = arg.find('=');
+    name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+    value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    return true;
+}
+
+// Reads the value of a numeric option, which must be a whole number (or any
+// number for a double) not below zero. On failure prints why and returns
+// false, leaving out unchanged.
+template<class T>
+bool parse_number_option(const std::string& name, const std::string& value, T& out) {
+    T parsed{};
+    auto res = std::from_chars(value.data(), value.data() + value.size(), parsed);
+    bool ok = !value.empty() && res.ec == std::errc() && res.ptr == value.data() + value.size();
+    if constexpr (std::is_floating_point_v<T>) ok = ok && std::isfinite(parsed) && parsed >= 0;
+    if (!ok) {
+        std::cerr << "Invalid --" << name << " value '" << value << "', expected a number of at least 0" << std::endl;
+        return false;
+    }
+    out = parsed;
+    return true;
+}
+
+KernelOptions parse_kernel_options(int argc, char* argv[], int first) {
+    KernelOptions opts;
+
+    for (int i = first; i < argc; ++i) {
+        std::string name, value;
+        if (!split_option(argv[i], name, value)) {
+            opts.connection_files.push_back(argv[i]);
+            continue;
+        }
+
+        if (name == "comm-max-rate") {
+            opts.valid &= parse_number_option(name, value, opts.comm_max_rate);
+        }
+        else if (name == "display-dir") {
+            opts.display_dir = value;
+        }
+        else if (name == "cache-dir") {
+            opts.cache_dir = value;
+        }
+        else if (name == "exec-cache-mb") {
+            opts.valid &= parse_number_option(name, value, opts.exec_cache_mb);
+        }
+        else if (name == "ghci-workers") {
+            opts.valid &= parse_number_option(name, value, opts.ghci_workers);
+        }
+        else if (name == "threads") {
+            opts.valid &= parse_number_option(name, value, opts.threads);
+        }
+        else if (name == "interpreter") {
+            opts.interpreter = value;
+        }
+        else if (name == "config") {
+            opts.config_file = value;
+        }
+        else if (name == "profile") {
+            opts.profile = value;
+        }
+        else if (name == "record") {
+            opts.record_file = value;
+        }
+        else if (name == "iopub-queue") {
+            opts.valid &= parse_number_option(name, value, opts.iopub_queue);
+        }
+        else if (name == "iopub-queue-mb") {
+            opts.valid &= parse_number_option(name, value, opts.iopub_queue_mb);
+        }
+        else if (name == "stats-interval") {
+            opts.valid &= parse_number_option(name, value, opts.stats_interval);
+        }
+        else if (name == "cell-stats") {
+            if (value == "off" || value == "time" || value == "gc")
+                opts.cell_stats = value;
+            else
+                std::cerr << "Unknown --cell-stats value " << value << ", expected off, time or gc" << std::endl;
+        }
+        else if (name == "cell-timeout") {
+            opts.valid &= parse_number_option(name, value, opts.limits.cell_timeout);
+        }
+        else if (name == "interrupt-grace") {
+            opts.valid &= parse_number_option(name, value, opts.limits.interrupt_grace);
+        }
+        else if (name == "max-heap") {
+            opts.limits.max_heap = value;
+        }
+        else if (name == "max-memory-mb") {
+            opts.valid &= parse_number_option(name, value, opts.limits.max_memory_mb);
+        }
+        else if (name == "cpu-limit") {
+            opts.valid &= parse_number_option(name, value, opts.limits.cpu_limit);
+        }
+        else if (name == "cgroup") {
+            opts.limits.cgroup = value;
+        }
+        else if (name == "verbose") {
+            opts.verbose = true;
+        }
+        else {
+            std::cerr << "Unknown option --" << name << std::endl;
+        }
+    }
+    return opts;
+}
+
+#endif // KERNEL_OPTIONS_HPP
@@ -0,0 +1,97 @@
+#ifndef KERNEL_SESSION_HPP
+#define KERNEL_SESSION_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <filesystem>
+#include <zmq.hpp>
+
+#include "json_parser.hpp"
+#include "jupyter_protocol.hpp"
+#include "iopub.hpp"
+#include "ghci_bridge.hpp"
+#include "jp_comm.hpp"
+#include "jp_history.hpp"
+#include "ghci_modules.hpp"
+#include "exec_cache.hpp"
+#include "ghci_workers.hpp"
+#include "symbol_index.hpp"
+
+// Everything that belongs to one notebook: its sockets, GHCi process and
+// prompt state. One process can host many sessions; they only share the ZMQ
+// context and the worker threads.
+struct KernelSession {
+    std::string name; // connection file
+    std::string key;
+    zmq::socket_t shell, stdin_, control, hb;
+    IOPubQueue iopub;
+    std::vector<std::string> ipc_files; // socket files of the ipc transport
+
+    GHCiBridge ghci;
+    size_t exec_counter = 0;
+    bool aborting_queue = false; // set when a cell fails, until the queued requests are drained
+    std::vector<HistoryEntry> history;
+    CommRegistry comms;
+    CommThrottle comm_throttle;
+    std::string display_dir;
+    ModuleCache modules;
+    ExecCache exec_cache;
+    ExpressionTypes expression_types; // which expression cells are IO actions, for the cache and the workers
+    SymbolIndex symbols;
+    std::vector<std::unique_ptr<GHCiWorker>> workers; // parallel expression cells, empty = off
+    bool prompt_state = false; // the main ghci holds bindings the workers do not have
+
+    // Set while a worker thread owns the session. The poller leaves the
+    // sockets of a busy session alone.
+    std::atomic<bool> busy = false;
+
+    // Reads the connection file and binds the five kernel sockets.
+    bool open(zmq::context_t& ctx, const std::string& connection_file) {
+        name = connection_file;
+        std::string conn_json = read_file(connection_file);
+        if (conn_json.empty()) {
+            std::cerr << "Could not read connection file " << connection_file << ".\n";
+            return false;
+        }
+
+        Parser parser(conn_json);
+        JsonValue conn = parser.parse_value();
+
+        std::string transport = conn.o["transport"].s.empty() ? "tcp" : conn.o["transport"].s;
+        std::string ip = conn.o["ip"].s;
+        key = conn.o["key"].s;
+        auto address = [&](const char* port) {
+            int number = (int)conn.o[port].n;
+            if (transport == "ipc") ipc_files.push_back(ip + "-" + std::to_string(number));
+            return zmq_endpoint(transport, ip, number);
+        };
+
+        shell = zmq::socket_t(ctx, zmq::socket_type::router);
+        shell.bind(address("shell_port"));
+        iopub.socket = zmq::socket_t(ctx, zmq::socket_type::xpub);
+        iopub.socket.set(zmq::sockopt::xpub_nodrop, true);
+        iopub.socket.bind(address("iopub_port"));
+        iopub.key = key;
+        stdin_ = zmq::socket_t(ctx, zmq::socket_type::router);
+        stdin_.bind(address("stdin_port"));
+        control = zmq::socket_t(ctx, zmq::socket_type::router);
+        control.bind(address("control_port"));
+        hb = zmq::socket_t(ctx, zmq::socket_type::rep);
+        hb.bind(address("hb_port"));
+        return true;
+    }
+
+    // Closes the sockets and removes the socket files they were bound to.
+    void close() {
+        for (zmq::socket_t* socket : { &shell, &iopub.socket, &stdin_, &control, &hb })
+            socket->close();
+        for (const auto& path : ipc_files) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+        ipc_files.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef MESSAGE_TYPES_HPP
+#define MESSAGE_TYPES_HPP
+
+#include <array>
+#include <string_view>
+#include <cstdint>
+
+// Shell message types the kernel knows, interned once when a message is
+// received. Lookup goes through a perfect hash computed at compile time:
+// one hash, one table probe and one string compare to confirm.
+
+enum class MsgType : uint8_t {
+    kernel_info_request,
+    execute_request,
+    inspect_request,
+    complete_request,
+    history_request,
+    is_complete_request,
+    comm_info_request,
+    comm_open,
+    comm_msg,
+    comm_close,
+    shutdown_request,
+    interrupt_request,
+    debug_request,
+    input_reply,
+    unknown,
+};
+
+constexpr size_t msg_type_count = (size_t)MsgType::unknown + 1;
+
+constexpr std::array<std::string_view, msg_type_count> msg_type_names = {
+    "kernel_info_request",
+    "execute_request",
+    "inspect_request",
+    "complete_request",
+    "history_request",
+    "is_complete_request",
+    "comm_info_request",
+    "comm_open",
+    "comm_msg",
+    "comm_close",
+    "shutdown_request",
+    "interrupt_request",
+    "debug_request",
+    "input_reply",
+    "unknown",
+};
+
+constexpr uint32_t msg_type_hash(std::string_view s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed; // FNV-1a
+    for (char c : s) {
+        h ^= (uint8_t)c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+constexpr size_t msg_type_slots = 32;
+constexpr uint8_t msg_type_empty = 0xFF;
+
+// Finds the first seed for which no two known names share a slot.
+constexpr uint32_t find_msg_type_seed() {
+    for (uint32_t seed = 0; seed < 100000; ++seed) {
+        std::array<bool, msg_type_slots> used{};
+        bool ok = true;
+        for (size_t i = 0; i < (size_t)MsgType::unknown && ok; ++i) {
+            size_t slot = msg_type_hash(msg_type_names[i], seed) % msg_type_slots;
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if (ok) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t msg_type_seed = find_msg_type_seed();
+static_assert(msg_type_seed != UINT32_MAX, "no perfect hash seed for the message types");
+
+constexpr std::array<uint8_t, msg_type_slots> make_msg_type_table() {
+    std::array<uint8_t, msg_type_slots> table{};
+    for (auto& t : table) t = msg_type_empty;
+    for (size_t i = 0; i < (size_t)MsgType::unknown; ++i)
+        table[msg_type_hash(msg_type_names[i], msg_type_seed) % msg_type_slots] = (uint8_t)i;
+    return table;
+}
+
+constexpr std::array<uint8_t, msg_type_slots> msg_type_table = make_msg_type_table();
+
+constexpr MsgType intern_msg_type(std::string_view name) {
+    uint8_t i = msg_type_table[msg_type_hash(name, msg_type_seed) % msg_type_slots];
+    if (i == msg_type_empty || msg_type_names[i] != name) return MsgType::unknown;
+    return (MsgType)i;
+}
+
+static_assert(intern_msg_type("execute_request") == MsgType::execute_request);
+static_assert(intern_msg_type("comm_msg") == MsgType::comm_msg);
+static_assert(intern_msg_type("execute_reply") == MsgType::unknown);
+
+constexpr std::string_view msg_type_name(MsgType type) {
+    return msg_type_names[(size_t)type];
+}
+
+#endif
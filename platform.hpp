@@ -0,0 +1,40 @@
+#ifndef PLATFORM_HPP
+#define PLATFORM_HPP
+
+// The OS calls the kernel needs outside of zmq. Process and pipe handling
+// for ghci lives in ghci_bridge.hpp and ghci_channel.hpp, with a Windows and
+// a POSIX branch each.
+
+#include <ctime>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+uint64_t process_id() {
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return (uint64_t)getpid();
+#endif
+}
+
+// Broken-down UTC time, false if t is out of range.
+bool utc_time(std::time_t t, std::tm& out) {
+#ifdef _WIN32
+    return gmtime_s(&out, &t) == 0;
+#else
+    return gmtime_r(&t, &out) != nullptr;
+#endif
+}
+
+#endif
@@ -0,0 +1,683 @@
+#ifndef PROTOCOL_MESSAGES_HPP
+#define PROTOCOL_MESSAGES_HPP
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "json_parser.hpp"
+
+// Message content as plain structs. Each struct is described by a constexpr
+// table in MessageFields<T>: the JSON name of every field, the member it
+// maps to and whether it is required. decode_message fills a struct in one
+// pass over the JSON, write_json writes one out without building a
+// JsonValue. Fields go out in table order; empty optionals are left out.
+
+template<class S, class M>
+struct Field {
+    std::string_view name;
+    M S::* member;
+    bool required;
+};
+
+template<class S, class M>
+constexpr Field<S, M> field(std::string_view name, M S::* member) {
+    return { name, member, false };
+}
+
+template<class S, class M>
+constexpr Field<S, M> required_field(std::string_view name, M S::* member) {
+    return { name, member, true };
+}
+
+template<class T>
+struct MessageFields;
+
+template<class T>
+concept Described = requires { MessageFields<T>::fields; };
+
+// A described struct that is sent on its own, with its msg_type.
+template<class T>
+concept Message = Described<T> && requires { MessageFields<T>::msg_type; };
+
+// ---- decoding ----
+
+// Reads the value at p.pos into out. Returns false when the JSON type does
+// not fit the field.
+bool read_field(Parser& p, std::string& out);
+bool read_field(Parser& p, bool& out);
+bool read_field(Parser& p, int& out);
+bool read_field(Parser& p, double& out);
+bool read_field(Parser& p, JsonValue& out);
+template<class T> bool read_field(Parser& p, std::optional<T>& out);
+template<class T> bool read_field(Parser& p, std::vector<T>& out);
+template<class T> bool read_field(Parser& p, std::map<std::string, T>& out);
+template<Described T> bool read_field(Parser& p, T& out);
+
+bool read_field(Parser& p, std::string& out) {
+    if (p.text[p.pos] != '"') return false;
+    out = p.parse_string();
+    return true;
+}
+
+bool read_field(Parser& p, bool& out) {
+    if (p.text.compare(p.pos, 4, "true") == 0) {
+        out = true;
+        p.pos += 4;
+        return true;
+    }
+    if (p.text.compare(p.pos, 5, "false") == 0) {
+        out = false;
+        p.pos += 5;
+        return true;
+    }
+    return false;
+}
+
+bool read_field(Parser& p, double& out) {
+    char c = p.text[p.pos];
+    if (c != '-' && !std::isdigit((unsigned char)c)) return false;
+    out = p.parse_number();
+    return true;
+}
+
+bool read_field(Parser& p, int& out) {
+    double n;
+    if (!read_field(p, n)) return false;
+    out = (int)n;
+    return true;
+}
+
+bool read_field(Parser& p, JsonValue& out) {
+    out = p.parse_value();
+    return true;
+}
+
+template<class T>
+bool read_field(Parser& p, std::optional<T>& out) {
+    if (p.text.compare(p.pos, 4, "null") == 0) {
+        out.reset();
+        p.pos += 4;
+        return true;
+    }
+    return read_field(p, out.emplace());
+}
+
+template<class T>
+bool read_field(Parser& p, std::vector<T>& out) {
+    out.clear();
+    if (!p.match('[')) return false;
+    if (p.match(']')) return true;
+    do {
+        p.skip();
+        if (!read_field(p, out.emplace_back())) return false;
+    } while (p.match(','));
+    return p.match(']');
+}
+
+template<class T>
+bool read_field(Parser& p, std::map<std::string, T>& out) {
+    out.clear();
+    if (!p.match('{')) return false;
+    if (p.match('}')) return true;
+    do {
+        p.skip();
+        if (p.text[p.pos] != '"') return false;
+        std::string key = p.parse_string();
+        if (!p.match(':')) return false;
+        p.skip();
+        if (!read_field(p, out[std::move(key)])) return false;
+    } while (p.match(','));
+    return p.match('}');
+}
+
+// Reads the value at p.pos into the member named key, if T has one.
+template<size_t I, class T>
+bool read_member(Parser& p, std::string_view key, T& out, uint64_t& seen) {
+    const auto& f = std::get<I>(MessageFields<T>::fields);
+    if (f.name != key) return false;
+    if (!read_field(p, out.*f.member))
+        throw std::invalid_argument("wrong type for field " + std::string(f.name));
+    seen |= uint64_t(1) << I;
+    return true;
+}
+
+template<class T, size_t... I>
+bool read_any_member(Parser& p, std::string_view key, T& out, uint64_t& seen, std::index_sequence<I...>) {
+    return (read_member<I>(p, key, out, seen) || ...);
+}
+
+template<class T, size_t... I>
+void check_required(uint64_t seen, std::index_sequence<I...>) {
+    auto check = [seen](const auto& f, size_t i) {
+        if (f.required && !(seen & (uint64_t(1) << i)))
+            throw std::invalid_argument("missing field " + std::string(f.name));
+    };
+    (check(std::get<I>(MessageFields<T>::fields), I), ...);
+}
+
+template<class T>
+constexpr auto field_indices() {
+    constexpr size_t count = std::tuple_size_v<std::decay_t<decltype(MessageFields<T>::fields)>>;
+    static_assert(count <= 64, "the required-field mask has 64 bits");
+    return std::make_index_sequence<count>{};
+}
+
+// Nested objects. Unknown keys are skipped without decoding.
+template<Described T>
+bool read_field(Parser& p, T& out) {
+    uint64_t seen = 0;
+    if (!p.match('{')) return false;
+    if (!p.match('}')) {
+        do {
+            p.skip();
+            if (p.text[p.pos] != '"') return false;
+            std::string key = p.parse_string();
+            if (!p.match(':')) return false;
+            p.skip();
+            if (!read_any_member(p, key, out, seen, field_indices<T>()))
+                p.pos = skip_json_value(p.text, p.pos);
+        } while (p.match(','));
+        if (!p.match('}')) return false;
+    }
+    check_required<T>(seen, field_indices<T>());
+    return true;
+}
+
+// Fills T from message content that recv_message has already indexed, so
+// only the members T declares are decoded. Throws std::invalid_argument
+// when a required field is missing or a field has the wrong type.
+template<Described T>
+T decode_message(const LazyJson& content) {
+    T out;
+    uint64_t seen = 0;
+    Parser p(content.text);
+    for (const LazyJson::Member& m : content.members) {
+        std::string_view key(content.text.data() + m.key_start, m.key_len);
+        p.pos = m.value_start;
+        read_any_member(p, key, out, seen, field_indices<T>());
+    }
+    check_required<T>(seen, field_indices<T>());
+    return out;
+}
+
+// ---- encoding ----
+
+void write_json(const std::string& s, std::string& out);
+void write_json(bool b, std::string& out);
+void write_json(int n, std::string& out);
+void write_json(double n, std::string& out);
+void write_json(const JsonValue& v, std::string& out);
+template<class T> void write_json(const std::optional<T>& v, std::string& out);
+template<class T> void write_json(const std::vector<T>& v, std::string& out);
+template<class T> void write_json(const std::map<std::string, T>& v, std::string& out);
+template<Described T> void write_json(const T& v, std::string& out);
+
+void write_json(const std::string& s, std::string& out) {
+    write_json_string(s, out);
+}
+
+void write_json(bool b, std::string& out) {
+    out += b ? "true" : "false";
+}
+
+void write_json(int n, std::string& out) {
+    char buf[16];
+    std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), n);
+    out.append(buf, res.ptr);
+}
+
+void write_json(double n, std::string& out) {
+    write_json_number(n, out);
+}
+
+void write_json(const JsonValue& v, std::string& out) {
+    v.write(out);
+}
+
+template<class T>
+void write_json(const std::optional<T>& v, std::string& out) {
+    if (v) write_json(*v, out);
+    else out += "null";
+}
+
+template<class T>
+void write_json(const std::vector<T>& v, std::string& out) {
+    out += '[';
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i > 0) out += ',';
+        write_json(v[i], out);
+    }
+    out += ']';
+}
+
+template<class T>
+void write_json(const std::map<std::string, T>& v, std::string& out) {
+    out += '{';
+    bool first = true;
+    for (const auto& [key, val] : v) {
+        if (!first) out += ',';
+        first = false;
+        write_json_string(key, out);
+        out += ':';
+        write_json(val, out);
+    }
+    out += '}';
+}
+
+template<class M>
+void write_member(std::string_view name, const M& value, bool& first, std::string& out) {
+    if constexpr (requires { value.has_value(); }) {
+        if (!value.has_value()) return;
+    }
+    if (!first) out += ',';
+    first = false;
+    // field names are plain identifiers, nothing to escape
+    out += '"';
+    out.append(name);
+    out += "\":";
+    write_json(value, out);
+}
+
+template<Described T>
+void write_json(const T& v, std::string& out) {
+    out += '{';
+    bool first = true;
+    std::apply([&](const auto&... f) {
+        (write_member(f.name, v.*(f.member), first, out), ...);
+    }, MessageFields<T>::fields);
+    out += '}';
+}
+
+// ---- messages ----
+
+// {}: metadata and user_expressions the kernel leaves empty.
+struct EmptyObject {};
+
+template<> struct MessageFields<EmptyObject> {
+    static constexpr auto fields = std::make_tuple();
+};
+
+// A mime bundle with at most a text/plain entry.
+struct PlainText {
+    std::optional<std::string> text;
+};
+
+template<> struct MessageFields<PlainText> {
+    static constexpr auto fields = std::make_tuple(
+        field("text/plain", &PlainText::text));
+};
+
+struct ExecuteRequest {
+    std::string code;
+    bool silent = false;
+    bool store_history = true;
+    std::optional<JsonValue> user_expressions;
+    bool allow_stdin = true;
+    bool stop_on_error = true;
+};
+
+template<> struct MessageFields<ExecuteRequest> {
+    static constexpr std::string_view msg_type = "execute_request";
+    static constexpr auto fields = std::make_tuple(
+        required_field("code", &ExecuteRequest::code),
+        field("silent", &ExecuteRequest::silent),
+        field("store_history", &ExecuteRequest::store_history),
+        field("user_expressions", &ExecuteRequest::user_expressions),
+        field("allow_stdin", &ExecuteRequest::allow_stdin),
+        field("stop_on_error", &ExecuteRequest::stop_on_error));
+};
+
+struct ExecuteInput {
+    std::string code;
+    int execution_count = 0;
+};
+
+template<> struct MessageFields<ExecuteInput> {
+    static constexpr std::string_view msg_type = "execute_input";
+    static constexpr auto fields = std::make_tuple(
+        required_field("code", &ExecuteInput::code),
+        required_field("execution_count", &ExecuteInput::execution_count));
+};
+
+struct ExecuteResult {
+    int execution_count = 0;
+    PlainText data;
+    EmptyObject metadata;
+};
+
+template<> struct MessageFields<ExecuteResult> {
+    static constexpr std::string_view msg_type = "execute_result";
+    static constexpr auto fields = std::make_tuple(
+        required_field("execution_count", &ExecuteResult::execution_count),
+        required_field("data", &ExecuteResult::data),
+        field("metadata", &ExecuteResult::metadata));
+};
+
+// An aborted reply only has the status.
+struct ExecuteReply {
+    std::string status = "ok";
+    std::optional<int> execution_count;
+    std::optional<std::string> ename;
+    std::optional<std::string> evalue;
+    std::optional<std::vector<std::string>> traceback;
+    std::optional<EmptyObject> user_expressions;
+    std::optional<std::vector<JsonValue>> payload;
+};
+
+template<> struct MessageFields<ExecuteReply> {
+    static constexpr std::string_view msg_type = "execute_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &ExecuteReply::status),
+        field("execution_count", &ExecuteReply::execution_count),
+        field("ename", &ExecuteReply::ename),
+        field("evalue", &ExecuteReply::evalue),
+        field("traceback", &ExecuteReply::traceback),
+        field("user_expressions", &ExecuteReply::user_expressions),
+        field("payload", &ExecuteReply::payload));
+};
+
+struct Stream {
+    std::string name;
+    std::string text;
+};
+
+template<> struct MessageFields<Stream> {
+    static constexpr std::string_view msg_type = "stream";
+    static constexpr auto fields = std::make_tuple(
+        required_field("name", &Stream::name),
+        required_field("text", &Stream::text));
+};
+
+struct Error {
+    std::string ename;
+    std::string evalue;
+    std::vector<std::string> traceback;
+};
+
+template<> struct MessageFields<Error> {
+    static constexpr std::string_view msg_type = "error";
+    static constexpr auto fields = std::make_tuple(
+        required_field("ename", &Error::ename),
+        required_field("evalue", &Error::evalue),
+        required_field("traceback", &Error::traceback));
+};
+
+// The reply type depends on the request, see send_error_reply.
+struct ErrorReply {
+    std::string status = "error";
+    std::string ename;
+    std::string evalue;
+    std::vector<std::string> traceback;
+};
+
+template<> struct MessageFields<ErrorReply> {
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &ErrorReply::status),
+        required_field("ename", &ErrorReply::ename),
+        required_field("evalue", &ErrorReply::evalue),
+        required_field("traceback", &ErrorReply::traceback));
+};
+
+struct Status {
+    std::string execution_state;
+};
+
+template<> struct MessageFields<Status> {
+    static constexpr std::string_view msg_type = "status";
+    static constexpr auto fields = std::make_tuple(
+        required_field("execution_state", &Status::execution_state));
+};
+
+struct LanguageInfo {
+    std::string name;
+    std::string version;
+    std::string mimetype;
+    std::string file_extension;
+};
+
+template<> struct MessageFields<LanguageInfo> {
+    static constexpr auto fields = std::make_tuple(
+        required_field("name", &LanguageInfo::name),
+        field("version", &LanguageInfo::version),
+        field("mimetype", &LanguageInfo::mimetype),
+        field("file_extension", &LanguageInfo::file_extension));
+};
+
+struct HelpLink {
+    std::string text;
+    std::string url;
+};
+
+template<> struct MessageFields<HelpLink> {
+    static constexpr auto fields = std::make_tuple(
+        required_field("text", &HelpLink::text),
+        required_field("url", &HelpLink::url));
+};
+
+struct KernelInfoReply {
+    std::string status = "ok";
+    std::string protocol_version = "5.3";
+    std::string implementation;
+    std::string implementation_version;
+    LanguageInfo language_info;
+    std::string banner;
+    std::vector<HelpLink> help_links;
+    bool debugger = false;
+};
+
+template<> struct MessageFields<KernelInfoReply> {
+    static constexpr std::string_view msg_type = "kernel_info_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &KernelInfoReply::status),
+        required_field("protocol_version", &KernelInfoReply::protocol_version),
+        required_field("implementation", &KernelInfoReply::implementation),
+        required_field("implementation_version", &KernelInfoReply::implementation_version),
+        required_field("language_info", &KernelInfoReply::language_info),
+        required_field("banner", &KernelInfoReply::banner),
+        field("help_links", &KernelInfoReply::help_links),
+        field("debugger", &KernelInfoReply::debugger));
+};
+
+struct HistoryRequest {
+    bool output = false;
+    bool raw = false;
+    std::string hist_access_type;
+    int session = 0;
+    int start = 0;
+    int stop = 0;
+    int n = 10;
+    std::string pattern;
+    bool unique = false;
+};
+
+template<> struct MessageFields<HistoryRequest> {
+    static constexpr std::string_view msg_type = "history_request";
+    static constexpr auto fields = std::make_tuple(
+        required_field("output", &HistoryRequest::output),
+        required_field("raw", &HistoryRequest::raw),
+        required_field("hist_access_type", &HistoryRequest::hist_access_type),
+        field("session", &HistoryRequest::session),
+        field("start", &HistoryRequest::start),
+        field("stop", &HistoryRequest::stop),
+        field("n", &HistoryRequest::n),
+        field("pattern", &HistoryRequest::pattern),
+        field("unique", &HistoryRequest::unique));
+};
+
+// Entries are [session, line, input] or [session, line, [input, output]],
+// kept as JSON.
+struct HistoryReply {
+    std::string status = "ok";
+    JsonValue history{ JsonValue::Array };
+};
+
+template<> struct MessageFields<HistoryReply> {
+    static constexpr std::string_view msg_type = "history_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &HistoryReply::status),
+        required_field("history", &HistoryReply::history));
+};
+
+struct CompleteRequest {
+    std::string code;
+    int cursor_pos = 0;
+};
+
+template<> struct MessageFields<CompleteRequest> {
+    static constexpr std::string_view msg_type = "complete_request";
+    static constexpr auto fields = std::make_tuple(
+        required_field("code", &CompleteRequest::code),
+        required_field("cursor_pos", &CompleteRequest::cursor_pos));
+};
+
+struct CompletionType {
+    std::string text;
+    std::string type;
+    std::string signature;
+    int start = 0;
+    int end = 0;
+};
+
+template<> struct MessageFields<CompletionType> {
+    static constexpr auto fields = std::make_tuple(
+        required_field("text", &CompletionType::text),
+        field("type", &CompletionType::type),
+        field("signature", &CompletionType::signature),
+        field("start", &CompletionType::start),
+        field("end", &CompletionType::end));
+};
+
+struct CompleteMetadata {
+    std::vector<CompletionType> types;
+};
+
+template<> struct MessageFields<CompleteMetadata> {
+    static constexpr auto fields = std::make_tuple(
+        field("_jupyter_types_experimental", &CompleteMetadata::types));
+};
+
+struct CompleteReply {
+    std::string status = "ok";
+    std::vector<std::string> matches;
+    int cursor_start = 0;
+    int cursor_end = 0;
+    CompleteMetadata metadata;
+};
+
+template<> struct MessageFields<CompleteReply> {
+    static constexpr std::string_view msg_type = "complete_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &CompleteReply::status),
+        required_field("matches", &CompleteReply::matches),
+        required_field("cursor_start", &CompleteReply::cursor_start),
+        required_field("cursor_end", &CompleteReply::cursor_end),
+        field("metadata", &CompleteReply::metadata));
+};
+
+struct InspectRequest {
+    std::string code;
+    int cursor_pos = 0;
+    int detail_level = 0;
+};
+
+template<> struct MessageFields<InspectRequest> {
+    static constexpr std::string_view msg_type = "inspect_request";
+    static constexpr auto fields = std::make_tuple(
+        required_field("code", &InspectRequest::code),
+        required_field("cursor_pos", &InspectRequest::cursor_pos),
+        field("detail_level", &InspectRequest::detail_level));
+};
+
+struct InspectReply {
+    std::string status = "ok";
+    bool found = false;
+    PlainText data;
+    EmptyObject metadata;
+};
+
+template<> struct MessageFields<InspectReply> {
+    static constexpr std::string_view msg_type = "inspect_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &InspectReply::status),
+        required_field("found", &InspectReply::found),
+        required_field("data", &InspectReply::data),
+        field("metadata", &InspectReply::metadata));
+};
+
+struct CommOpen {
+    std::string comm_id;
+    std::string target_name;
+    JsonValue data{ JsonValue::Object };
+};
+
+template<> struct MessageFields<CommOpen> {
+    static constexpr std::string_view msg_type = "comm_open";
+    static constexpr auto fields = std::make_tuple(
+        required_field("comm_id", &CommOpen::comm_id),
+        required_field("target_name", &CommOpen::target_name),
+        required_field("data", &CommOpen::data));
+};
+
+struct CommMsg {
+    std::string comm_id;
+    JsonValue data{ JsonValue::Object };
+};
+
+template<> struct MessageFields<CommMsg> {
+    static constexpr std::string_view msg_type = "comm_msg";
+    static constexpr auto fields = std::make_tuple(
+        required_field("comm_id", &CommMsg::comm_id),
+        required_field("data", &CommMsg::data));
+};
+
+struct CommClose {
+    std::string comm_id;
+    JsonValue data{ JsonValue::Object };
+};
+
+template<> struct MessageFields<CommClose> {
+    static constexpr std::string_view msg_type = "comm_close";
+    static constexpr auto fields = std::make_tuple(
+        required_field("comm_id", &CommClose::comm_id),
+        field("data", &CommClose::data));
+};
+
+struct CommInfoRequest {
+    std::string target_name;
+};
+
+template<> struct MessageFields<CommInfoRequest> {
+    static constexpr std::string_view msg_type = "comm_info_request";
+    static constexpr auto fields = std::make_tuple(
+        field("target_name", &CommInfoRequest::target_name));
+};
+
+struct CommInfo {
+    std::string target_name;
+};
+
+template<> struct MessageFields<CommInfo> {
+    static constexpr auto fields = std::make_tuple(
+        required_field("target_name", &CommInfo::target_name));
+};
+
+struct CommInfoReply {
+    std::string status = "ok";
+    std::map<std::string, CommInfo> comms;
+};
+
+template<> struct MessageFields<CommInfoReply> {
+    static constexpr std::string_view msg_type = "comm_info_reply";
+    static constexpr auto fields = std::make_tuple(
+        required_field("status", &CommInfoReply::status),
+        required_field("comms", &CommInfoReply::comms));
+};
+
+#endif // PROTOCOL_MESSAGES_HPP
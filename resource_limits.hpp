@@ -0,0 +1,133 @@
+#ifndef RESOURCE_LIMITS_HPP
+#define RESOURCE_LIMITS_HPP
+
+#include "platform.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Bounds on the ghci processes of a session. The time limit applies to every
+// round trip to ghci and is enforced by the watchdog; the others hold for
+// the process as a whole.
+struct ResourceLimits {
+    double cell_timeout = 0.0;    // seconds, 0 = none
+    double interrupt_grace = 5.0; // seconds from the interrupt to the kill
+    std::string max_heap;         // RTS -M, e.g. "4g"
+    size_t max_memory_mb = 0;     // whole process, 0 = none
+    double cpu_limit = 0.0;       // cores, 0 = none
+    std::string cgroup;           // delegated cgroup v2 directory to create the ghci cgroups in
+};
+
+// Reports limits the platform cannot enforce, once at startup.
+void check_limits(const ResourceLimits& limits) {
+#ifndef _WIN32
+    if (limits.cpu_limit > 0.0 && limits.cgroup.empty())
+        std::cerr << "--cpu-limit needs --cgroup on this platform, ignored" << std::endl;
+#ifndef __linux__
+    if (!limits.cgroup.empty())
+        std::cerr << "--cgroup is only supported on Linux, ignored" << std::endl;
+#endif
+#else
+    if (!limits.cgroup.empty())
+        std::cerr << "--cgroup is only supported on Linux, limits go through a job object" << std::endl;
+#endif
+}
+
+#ifdef _WIN32
+// Job object every ghci process is assigned to while still suspended, with
+// the memory and CPU limits when there are any. Everything ghci starts joins
+// the job too, so a wrapper (ghcup's ghci.exe shim) and the processes a cell
+// spawns end with it: TerminateJobObject kills them all, and so does closing
+// the last handle.
+HANDLE create_ghci_job(const ResourceLimits& limits) {
+    HANDLE job = CreateJobObjectW(NULL, NULL);
+    if (!job) return NULL;
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info{};
+    info.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (limits.max_memory_mb > 0) {
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+        info.ProcessMemoryLimit = (SIZE_T)limits.max_memory_mb << 20;
+    }
+    SetInformationJobObject(job, JobObjectExtendedLimitInformation, &info, sizeof(info));
+
+    if (limits.cpu_limit > 0.0) {
+        SYSTEM_INFO sys;
+        GetSystemInfo(&sys);
+        // in 1/100 of a percent of all processors
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpu{};
+        cpu.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+        cpu.CpuRate = (DWORD)std::clamp(limits.cpu_limit / sys.dwNumberOfProcessors * 10000.0, 1.0, 10000.0);
+        SetInformationJobObject(job, JobObjectCpuRateControlInformation, &cpu, sizeof(cpu));
+    }
+    return job;
+}
+#else
+// Creates the cgroup <limits.cgroup>/<name> with memory.max and cpu.max set.
+// Returns its path, or "" when there is no cgroup to use, in which case the
+// memory limit falls back to setrlimit. Called with the spawn lock held.
+std::string create_cgroup(const ResourceLimits& limits, const std::string& name) {
+#ifdef __linux__
+    namespace fs = std::filesystem;
+    if (limits.cgroup.empty() || (limits.max_memory_mb == 0 && limits.cpu_limit <= 0.0)) return "";
+
+    std::error_code ec;
+    fs::path dir = fs::path(limits.cgroup) / name;
+    fs::create_directory(dir, ec);
+    auto set = [&](const char* file, const std::string& value) {
+        std::ofstream f(dir / file);
+        f << value << std::flush;
+        return (bool)f;
+    };
+    bool ok = !ec;
+    if (ok && limits.max_memory_mb > 0)
+        ok = set("memory.max", std::to_string((uint64_t)limits.max_memory_mb << 20));
+    if (ok && limits.cpu_limit > 0.0)
+        ok = set("cpu.max", std::to_string((uint64_t)(limits.cpu_limit * 100000)) + " 100000");
+    if (!ok) {
+        static bool warned = false;
+        if (!warned)
+            std::cerr << "Cannot set up cgroup " << dir.string() << ", is " << limits.cgroup << " delegated to this user?" << std::endl;
+        warned = true;
+        fs::remove(dir, ec);
+        return "";
+    }
+    return dir.string();
+#else
+    (void)limits;
+    (void)name;
+    return "";
+#endif
+}
+
+// A cgroup can only be removed once its processes are gone.
+void remove_cgroup(const std::string& path) {
+    if (path.empty()) return;
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+}
+
+// Runs in the forked child before exec, so only async-signal-safe calls.
+// cgroup_procs is the open cgroup.procs of the child's cgroup, or -1.
+void apply_child_limits(const ResourceLimits& limits, int cgroup_procs) {
+    if (cgroup_procs >= 0) {
+        // "0" moves the writing process
+        if (::write(cgroup_procs, "0", 1) == 1) return;
+    }
+    if (limits.max_memory_mb > 0) {
+        // GHC's RTS shrinks its address space reservation until it fits
+        rlimit lim;
+        lim.rlim_cur = lim.rlim_max = (rlim_t)limits.max_memory_mb << 20;
+        ::setrlimit(RLIMIT_AS, &lim);
+    }
+}
+#endif
+
+#endif // RESOURCE_LIMITS_HPP
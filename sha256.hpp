@@ -6,6 +6,8 @@
 #include <vector>
 #include <stdint.h>
 #include <iomanip>
+#include <initializer_list>
+#include <string_view>
 
 static const uint32_t k[64] = {
     0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,
@@ -58,12 +60,14 @@ public:
     }
     std::string digest() {
         finalize();
-        char buf[65];
+        static const char digits[] = "0123456789abcdef";
+        std::string out(64, '0');
         for (int i = 0; i < 8; ++i) {
-            sprintf_s(buf + i * 8, 9, "%08x", state[i]);
+            for (int j = 0; j < 8; ++j) {
+                out[i * 8 + j] = digits[(state[i] >> (28 - 4 * j)) & 0xF];
+            }
         }
-        buf[64] = 0;
-        return std::string(buf);
+        return out;
     }
 
 private:
@@ -169,13 +173,18 @@ private:
     }
 };
 
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
 std::string hex_to_bin(const std::string& hex) {
     std::string out;
     out.reserve(hex.size() / 2);
     for (size_t i = 0; i < hex.size(); i += 2) {
-        unsigned int byte;
-        sscanf_s(hex.substr(i, 2).c_str(), "%02x", &byte);
-        out.push_back(static_cast<char>(byte));
+        out.push_back(static_cast<char>((hex_digit(hex[i]) << 4) | hex_digit(hex[i + 1])));
     }
     return out;
 }
@@ -188,7 +197,9 @@ std::string bin_to_hex(const std::string& bin) {
     return oss.str();
 }
 
-std::string hmac_sha256(const std::string& key, const std::string& message) {
+// HMAC over the concatenation of parts; messages are signed over four
+// frames and the frames need not be copied into one buffer first.
+std::string hmac_sha256(const std::string& key, std::initializer_list<std::string_view> parts) {
     const size_t blockSize = 64;
     std::string key_block = key;
 
@@ -210,7 +221,8 @@ std::string hmac_sha256(const std::string& key, const std::string& message) {
 
     SHA256 sha_inner;
     sha_inner.update(i_key_pad);
-    sha_inner.update(message);
+    for (std::string_view part : parts)
+        sha_inner.update(reinterpret_cast<const uint8_t*>(part.data()), part.size());
     std::string inner_hash = hex_to_bin(sha_inner.digest());
 
     SHA256 sha_outer;
@@ -220,4 +232,8 @@ std::string hmac_sha256(const std::string& key, const std::string& message) {
 
     return bin_to_hex(hmac_bin);  // final result: lowercase hex string
 }
+
+std::string hmac_sha256(const std::string& key, const std::string& message) {
+    return hmac_sha256(key, { std::string_view(message) });
+}
 #endif
\ No newline at end of file
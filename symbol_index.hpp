@@ -0,0 +1,249 @@
+#ifndef SYMBOL_INDEX_HPP
+#define SYMBOL_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+#include "ghci_bridge.hpp"
+#include "ghci_modules.hpp"
+
+// Names in scope at the prompt, for complete_request and inspect_request.
+// The index is rebuilt from :browse output whenever the definition set
+// changes; lookups never talk to ghci.
+
+struct Symbol {
+    std::string name;      // as typed at the prompt, e.g. "M.insert"
+    std::string kind;      // "function", "type" or "class"
+    std::string signature; // the :browse declaration
+    std::string module;
+};
+
+// Prefix trie over symbol names. Children are kept sorted, so completions
+// come out in alphabetical order with exact matches first.
+struct SymbolTrie {
+    struct Node {
+        std::vector<std::pair<char, uint32_t>> children;
+        std::vector<uint32_t> symbols; // several modules can export the same name
+    };
+    std::vector<Node> nodes = std::vector<Node>(1);
+
+    void clear() {
+        nodes.assign(1, Node());
+    }
+
+    void insert(const std::string& key, uint32_t symbol) {
+        uint32_t node = 0;
+        for (char c : key) {
+            auto& children = nodes[node].children;
+            auto it = std::lower_bound(children.begin(), children.end(), c,
+                [](const std::pair<char, uint32_t>& child, char ch) { return child.first < ch; });
+            if (it != children.end() && it->first == c) {
+                node = it->second;
+                continue;
+            }
+            uint32_t next = (uint32_t)nodes.size();
+            children.insert(it, { c, next });
+            nodes.emplace_back(); // invalidates children
+            node = next;
+        }
+        nodes[node].symbols.push_back(symbol);
+    }
+
+    // Returns the node for prefix, or -1.
+    int64_t find(const std::string& prefix) const {
+        uint32_t node = 0;
+        for (char c : prefix) {
+            const auto& children = nodes[node].children;
+            auto it = std::lower_bound(children.begin(), children.end(), c,
+                [](const std::pair<char, uint32_t>& child, char ch) { return child.first < ch; });
+            if (it == children.end() || it->first != c) return -1;
+            node = it->second;
+        }
+        return node;
+    }
+
+    // Symbols whose name starts with prefix, at most limit of them.
+    void collect(const std::string& prefix, size_t limit, std::vector<uint32_t>& out) const {
+        int64_t start = find(prefix);
+        if (start < 0) return;
+
+        std::vector<uint32_t> stack{ (uint32_t)start };
+        while (!stack.empty() && out.size() < limit) {
+            const Node& n = nodes[stack.back()];
+            stack.pop_back();
+            for (uint32_t s : n.symbols) {
+                if (out.size() == limit) break;
+                out.push_back(s);
+            }
+            for (auto it = n.children.rbegin(); it != n.children.rend(); ++it)
+                stack.push_back(it->second);
+        }
+    }
+};
+
+// What an import line brings into scope.
+struct ImportSpec {
+    std::string module;
+    std::string qualifier;    // "M" for "import qualified Data.Map as M"
+    bool unqualified = true;  // names are also usable without the qualifier
+    std::string version;      // content hash of a cell module, part of the browse cache key
+};
+
+ImportSpec parse_import(const std::string& line) {
+    ImportSpec spec;
+    std::vector<std::string> words;
+    size_t pos = 0;
+    std::string text = trim(line);
+    while (pos < text.size()) {
+        size_t end = text.find_first_of(" \t(", pos);
+        if (end == std::string::npos) end = text.size();
+        if (end > pos) words.push_back(text.substr(pos, end - pos));
+        if (end < text.size() && text[end] == '(') break; // import list
+        pos = end + 1;
+    }
+
+    bool qualified = false;
+    for (size_t i = 1; i < words.size(); ++i) {
+        if (words[i] == "qualified") qualified = true;
+        else if (words[i] == "safe") continue;
+        else if (words[i] == "as" && i + 1 < words.size()) spec.qualifier = words[++i];
+        else if (words[i] == "hiding") break;
+        else if (spec.module.empty()) spec.module = words[i];
+    }
+    spec.unqualified = !qualified;
+    if (qualified && spec.qualifier.empty()) spec.qualifier = spec.module;
+    return spec;
+}
+
+// Turns ":browse" output into symbols. Declarations can continue on indented
+// lines; operators are skipped since nobody completes them.
+void parse_browse(const std::string& output, const ImportSpec& spec, std::vector<Symbol>& out) {
+    size_t last = std::string::npos;
+    size_t first = out.size();
+    for (const auto& line : split_lines(output)) {
+        if (line.empty() || line.compare(0, 2, "--") == 0) continue;
+        if (line[0] == ' ' || line[0] == '\t') {
+            if (last == std::string::npos) continue;
+            out[last].signature += "\n" + line;
+
+            // class methods are listed inside the class
+            std::string method = trim(line);
+            size_t sig = method.find(" :: ");
+            if (out[last].kind == "class" && sig != std::string::npos && method[0] != '(') {
+                Symbol m{ method.substr(0, sig), "function", method, spec.module };
+                out.push_back(m);
+            }
+            continue;
+        }
+
+        Symbol sym;
+        sym.module = spec.module;
+        sym.signature = line;
+        if (starts_with_word(line, "class")) {
+            size_t arrow = line.find("=>");
+            sym.kind = "class";
+            sym.name = first_identifier(line, arrow == std::string::npos ? line.find(' ') : arrow + 2);
+        }
+        else if (starts_with_word(line, "data") || starts_with_word(line, "newtype") || starts_with_word(line, "type")) {
+            size_t pos = line.find(' ');
+            if (starts_with_word(line.substr(pos + 1), "family") || starts_with_word(line.substr(pos + 1), "instance"))
+                pos = line.find(' ', pos + 1);
+            sym.kind = "type";
+            sym.name = first_identifier(line, pos);
+        }
+        else {
+            size_t sig = line.find(" :: ");
+            if (sig == std::string::npos) {
+                last = std::string::npos;
+                continue;
+            }
+            sym.kind = "function";
+            sym.name = trim(line.substr(0, sig));
+        }
+
+        if (sym.name.empty() || sym.name[0] == '(' || sym.name.find(' ') != std::string::npos) {
+            last = std::string::npos;
+            continue;
+        }
+        last = out.size();
+        out.push_back(sym);
+    }
+
+    // Qualified copies share the declaration
+    size_t end = out.size();
+    for (size_t i = first; i < end && !spec.qualifier.empty(); ++i) {
+        Symbol q = out[i];
+        q.name = spec.qualifier + "." + q.name;
+        out.push_back(q);
+    }
+    if (!spec.unqualified) out.erase(out.begin() + first, out.begin() + end);
+}
+
+struct SymbolIndex {
+    std::vector<Symbol> symbols;
+    SymbolTrie trie;
+    std::unordered_map<std::string, std::string> browse_cache; // module -> :browse output
+    std::string definitions_hash; // definition set the index was built for
+    bool built = false;
+
+    // Cell modules are cached by their content hash and library modules do
+    // not change, so only modules that were never browsed cost a ghci round
+    // trip.
+    const std::string& browse(GHCiBridge& ghci, const std::string& module, const std::string& version = "") {
+        std::string key = version.empty() ? module : module + "@" + version;
+        auto it = browse_cache.find(key);
+        if (it == browse_cache.end()) {
+            GHCiResult res = ghci.command(":browse " + module);
+            it = browse_cache.emplace(key, res.err.empty() ? res.out : "").first;
+        }
+        return it->second;
+    }
+
+    void rebuild(GHCiBridge& ghci, const ModuleCache& modules) {
+        if (built && definitions_hash == modules.definitions_hash) return;
+
+        std::vector<ImportSpec> scope;
+        scope.push_back({ "Prelude", "", true });
+        for (const auto& cell : modules.cells) {
+            scope.push_back({ cell.name, "", true, cell.hash });
+            for (const auto& imp : cell.imports) scope.push_back(parse_import(imp));
+        }
+        for (const auto& imp : modules.prompt_imports) scope.push_back(parse_import(imp));
+
+        symbols.clear();
+        for (const auto& spec : scope) {
+            if (spec.module.empty()) continue;
+            parse_browse(browse(ghci, spec.module, spec.version), spec, symbols);
+        }
+
+        trie.clear();
+        for (uint32_t i = 0; i < symbols.size(); ++i) trie.insert(symbols[i].name, i);
+        definitions_hash = modules.definitions_hash;
+        built = true;
+    }
+
+    // Distinct names starting with prefix.
+    std::vector<const Symbol*> complete(const std::string& prefix, size_t limit) const {
+        std::vector<uint32_t> found;
+        trie.collect(prefix, limit * 2, found);
+
+        std::vector<const Symbol*> out;
+        for (uint32_t i : found) {
+            if (out.size() == limit) break;
+            if (!out.empty() && out.back()->name == symbols[i].name) continue;
+            out.push_back(&symbols[i]);
+        }
+        return out;
+    }
+
+    const Symbol* find(const std::string& name) const {
+        int64_t node = trie.find(name);
+        if (node < 0 || trie.nodes[node].symbols.empty()) return nullptr;
+        return &symbols[trie.nodes[node].symbols.front()];
+    }
+};
+
+#endif
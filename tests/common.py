@@ -2,6 +2,7 @@ import json, uuid, hmac, hashlib
 import zmq
 from datetime import datetime
 import socket
+import time
 
 def load_connection_file(path):
     with open(path) as f:
@@ -40,6 +41,58 @@ def connect_shell(conn_info, sock_type = zmq.DEALER, port_name = 'shell_port'):
     sock.connect(f"tcp://{conn_info['ip']}:{conn_info[port_name]}")
     return sock
 
+def connect_iopub(conn_info):
+    sock = connect_shell(conn_info, zmq.SUB, 'iopub_port')
+    sock.setsockopt(zmq.SUBSCRIBE, b"")
+    sock.RCVTIMEO = 10000
+    time.sleep(0.5)  # let the subscription reach the kernel
+    return sock
+
+def execute(conn_info, sock_shell, sock_iopub, code):
+    """Runs code and collects the reply, the stream text and the text/plain result (or "ename: evalue") from IOPub."""
+    content = {
+        "code": code,
+        "silent": False,
+        "store_history": True,
+        "user_expressions": {},
+        "allow_stdin": False,
+        "stop_on_error": False
+    }
+    header, parent, meta, content_bin = build_msg("execute_request", content)
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    msg_id = json.loads(header)["msg_id"]
+
+    reply = sock_shell.recv_multipart()
+    out = {"reply": json.loads(reply[-1]), "metadata": json.loads(reply[-2]), "result": None, "stream": ""}
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            parts = sock_iopub.recv_multipart()
+        except zmq.Again:
+            break
+        delim = parts.index(b"<IDS|MSG>")
+        msg_header = json.loads(parts[delim + 2])
+        msg_parent = json.loads(parts[delim + 3])
+        if msg_parent.get("msg_id") != msg_id:
+            continue
+        msg_content = json.loads(parts[delim + 5])
+        if msg_header["msg_type"] == "stream":
+            out["stream"] += msg_content["text"]
+        elif msg_header["msg_type"] in ("execute_result", "display_data"):
+            out["result"] = msg_content["data"].get("text/plain")
+        elif msg_header["msg_type"] == "error":
+            out["result"] = msg_content.get("ename") + ": " + msg_content.get("evalue")
+        elif msg_header["msg_type"] == "status" and msg_content["execution_state"] == "idle":
+            break
+    return out
+
+def check(label, got, expected):
+    if got == expected:
+        print(label, "ok")
+    else:
+        print(label, "expected", repr(expected), "got", repr(got))
+
 def free_port():
     s = socket.socket()
     s.bind(('', 0))
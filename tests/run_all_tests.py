@@ -5,10 +5,19 @@ from pathlib import Path
 from common import generate_connection_file
 import test_kernel_info_request
 import test_execute_request
+import test_execute_error
+import test_execute_timeout
+import test_execute_timeout_child
+import test_definition_cells
+import test_exec_cache_io
 import test_history_request
+import test_complete_request
+import test_inspect_request
 import test_comm_open
 import test_comm_msg
 import test_comm_close
+import test_unknown_request
+import test_iopub_byte_limit
 
 def main():
     conn_file = Path("kernel-test.json")
@@ -19,7 +28,7 @@ def main():
     # Step 2: Start the kernel process
     # NOTE: adjust `./HJNKernel.exe` and args to your build output
     kernel_proc = subprocess.Popen(
-        ["../x64/Debug/HJNKernel.exe", str(conn_file)],
+        ["../x64/Debug/HJNKernel.exe", str(conn_file), "--cell-timeout=5", "--exec-cache-mb=16", "--iopub-queue-mb=1"],
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE
     )
@@ -34,15 +43,31 @@ def main():
         
         print("=== Running execute test ===")
         test_execute_request.run_test(conn_file)
+        test_execute_error.run_test(conn_file)
+        test_execute_timeout.run_test(conn_file)
+        test_execute_timeout_child.run_test(conn_file)
+        test_definition_cells.run_test(conn_file)
+        test_exec_cache_io.run_test(conn_file)
         
         print("=== Running history test ===")
         test_history_request.run_test(conn_file)
         
+        print("=== Running completion test ===")
+        test_complete_request.run_test(conn_file)
+        test_inspect_request.run_test(conn_file)
+        
         print("=== Running comm test ===")
         test_comm_open.run_test(conn_file)
         test_comm_msg.run_test(conn_file)
         test_comm_close.run_test(conn_file)
         
+        print("=== Running IOPub test ===")
+        test_iopub_byte_limit.run_test(conn_file)
+
+        print("=== Running unknown request test ===")
+        test_unknown_request.run_test(conn_file)
+        test_kernel_info_request.run_test(conn_file)
+        
         print("\n All tests finished.")
         
     finally:
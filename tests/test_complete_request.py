@@ -0,0 +1,29 @@
+from common import load_connection_file, connect_shell, build_msg, sign
+import sys
+import json
+import zmq
+
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    
+    content = {
+        "code": "map (+1) (fil",
+        "cursor_pos": 13
+    }
+    
+    header, parent, meta, content_bin = build_msg("complete_request", content)
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    sock_shell.RCVTIMEO = 2000  # 2 seconds
+    try:
+        parts = sock_shell.recv_multipart()
+        reply = json.loads(parts[-1])
+        print(parts)
+        if "filter" not in reply.get("matches", []):
+            print("Expected filter among the matches, got", reply.get("matches"))
+        else:
+            print("cursor_start:", reply["cursor_start"], "cursor_end:", reply["cursor_end"])
+    except zmq.Again:
+        print("No message received within timeout")
@@ -0,0 +1,82 @@
+from common import load_connection_file, connect_shell, build_msg, sign
+import json
+import time
+import zmq
+
+# Definition cells go through the module cache; the names a cell defines decide
+# which earlier cell a re-run replaces, so operators must be recognised as such.
+def execute(sock_shell, sock_iopub, conn_info, code):
+    content = {
+        "code": code,
+        "silent": False,
+        "store_history": True,
+        "user_expressions": {},
+        "allow_stdin": False,
+        "stop_on_error": False
+    }
+    header, parent, meta, content_bin = build_msg("execute_request", content)
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    msg_id = json.loads(header)["msg_id"]
+
+    reply = sock_shell.recv_multipart()
+    status = json.loads(reply[-1]).get("status")
+    result = None
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            parts = sock_iopub.recv_multipart()
+        except zmq.Again:
+            break
+        delim = parts.index(b"<IDS|MSG>")
+        msg_header = json.loads(parts[delim + 2])
+        msg_parent = json.loads(parts[delim + 3])
+        if msg_parent.get("msg_id") != msg_id:
+            continue
+        msg_content = json.loads(parts[delim + 5])
+        if msg_header["msg_type"] in ("execute_result", "display_data"):
+            result = msg_content["data"].get("text/plain")
+        elif msg_header["msg_type"] == "error":
+            result = msg_content.get("ename") + ": " + msg_content.get("evalue")
+        elif msg_header["msg_type"] == "status" and msg_content["execution_state"] == "idle":
+            break
+    return status, result
+
+def check(label, got, expected):
+    if got == expected:
+        print(label, "ok")
+    else:
+        print(label, "expected", repr(expected), "got", repr(got))
+
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    sock_shell.RCVTIMEO = 30000
+    sock_iopub = connect_shell(conn_info, zmq.SUB, 'iopub_port')
+    sock_iopub.setsockopt(zmq.SUBSCRIBE, b"")
+    sock_iopub.RCVTIMEO = 10000
+    time.sleep(0.5)
+
+    try:
+        execute(sock_shell, sock_iopub, conn_info, "a :: Int\na = 1")
+        execute(sock_shell, sock_iopub, conn_info,
+                "infixl 6 <+>\n(<+>) :: Int -> Int -> Int\nx <+> y = x * 10 + y")
+        check("operator definition", execute(sock_shell, sock_iopub, conn_info, "a <+> 2")[1], "12")
+
+        # Same operator, different text: replaces the cell above instead of
+        # being taken for a new definition of x
+        execute(sock_shell, sock_iopub, conn_info,
+                "infixl 6 <+>\n(<+>) :: Int -> Int -> Int\nx <+> y = x - y")
+        check("operator redefinition", execute(sock_shell, sock_iopub, conn_info, "a <+> 2")[1], "-1")
+
+        execute(sock_shell, sock_iopub, conn_info,
+                "plus :: Int -> Int -> Int\nx `plus` y = x + y")
+        check("backquoted definition", execute(sock_shell, sock_iopub, conn_info, "a `plus` 2")[1], "3")
+        execute(sock_shell, sock_iopub, conn_info,
+                "plus :: Int -> Int -> Int\nx `plus` y = x * y")
+        check("backquoted redefinition", execute(sock_shell, sock_iopub, conn_info, "3 `plus` 2")[1], "6")
+
+        execute(sock_shell, sock_iopub, conn_info, "(<->) :: Int -> Int -> Int\n(<->) x y = y - x")
+        check("prefix operator definition", execute(sock_shell, sock_iopub, conn_info, "1 <-> 5")[1], "4")
+    except zmq.Again:
+        print("No message received within timeout")
@@ -0,0 +1,42 @@
+from common import load_connection_file, connect_shell, connect_iopub, execute, check
+import os
+import tempfile
+import zmq
+
+# Needs the kernel started with --exec-cache-mb. A cell that reads a file is
+# an IO action: it must run again, and see the new contents, every time.
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    sock_shell.RCVTIMEO = 30000
+    sock_iopub = connect_iopub(conn_info)
+
+    fd, path = tempfile.mkstemp(suffix=".txt")
+    os.close(fd)
+    read_cell = "readFile " + '"' + path.replace("\\", "\\\\") + '"'
+    try:
+        out = execute(conn_info, sock_shell, sock_iopub, "sum [1..10 :: Int]")
+        if "exec_cache" not in out["metadata"]:
+            print("Kernel runs without --exec-cache-mb, skipping")
+            return
+        out = execute(conn_info, sock_shell, sock_iopub, "sum [1..10 :: Int]")
+        check("pure expression cached", out["metadata"]["exec_cache"]["hit"], True)
+
+        with open(path, "w") as f:
+            f.write("one")
+        out = execute(conn_info, sock_shell, sock_iopub, read_cell)
+        check("first read", out["result"], '"one"')
+
+        with open(path, "w") as f:
+            f.write("two")
+        out = execute(conn_info, sock_shell, sock_iopub, read_cell)
+        check("IO expression re-evaluated", out["metadata"]["exec_cache"]["hit"], False)
+        check("second read", out["result"], '"two"')
+
+        out = execute(conn_info, sock_shell, sock_iopub, "return 5")
+        out = execute(conn_info, sock_shell, sock_iopub, "return 5")
+        check("polymorphic monad runs as IO", out["metadata"]["exec_cache"]["hit"], False)
+    except zmq.Again:
+        print("No message received within timeout")
+    finally:
+        os.remove(path)
@@ -0,0 +1,35 @@
+from common import load_connection_file, connect_shell, build_msg, sign
+import sys
+import json
+import zmq
+
+# Needs the kernel started with --cell-timeout
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    
+    content = {
+        "code": "length [1..]",
+        "silent": False,
+        "store_history": True,
+        "user_expressions": {},
+        "allow_stdin": False,
+        "stop_on_error": False
+    }
+    
+    header, parent, meta, content_bin = build_msg("execute_request", content)
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    sock_shell.RCVTIMEO = 30000  # 30 seconds
+    try:
+        parts = sock_shell.recv_multipart()
+        reply = json.loads(parts[-1])
+        metadata = json.loads(parts[-2])
+        print(parts)
+        if reply.get("ename") != "TimeoutError":
+            print("Expected TimeoutError, got", reply.get("status"), reply.get("ename"))
+        else:
+            print("evalue:", reply["evalue"], "limit:", metadata.get("limit"))
+    except zmq.Again:
+        print("No message received within timeout")
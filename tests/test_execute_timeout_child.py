@@ -0,0 +1,25 @@
+from common import load_connection_file, connect_shell, connect_iopub, execute, check
+import time
+import zmq
+
+# Needs the kernel started with --cell-timeout. The cell starts a process that
+# inherits ghci's output pipes and outlives the timeout; killing ghci alone
+# would leave the pipes open and the request without a reply.
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    sock_shell.RCVTIMEO = 60000
+    sock_iopub = connect_iopub(conn_info)
+
+    code = ('System.Process.callCommand (if System.Info.os == "mingw32" '
+            'then "ping -n 100 127.0.0.1" else "sleep 100")')
+    try:
+        started = time.time()
+        out = execute(conn_info, sock_shell, sock_iopub, code)
+        print("reply after %.1f s" % (time.time() - started))
+        check("child process timed out", out["reply"].get("ename"), "TimeoutError")
+        print("limit:", out["metadata"].get("limit"))
+
+        check("kernel usable afterwards", execute(conn_info, sock_shell, sock_iopub, "1 + 1")["result"], "2")
+    except zmq.Again:
+        print("No reply within 60 s, the child process kept ghci's pipes open")
@@ -0,0 +1,30 @@
+from common import load_connection_file, connect_shell, build_msg, sign
+import sys
+import json
+import zmq
+
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    
+    content = {
+        "code": "foldr (+) 0 [1..10]",
+        "cursor_pos": 3,
+        "detail_level": 0
+    }
+    
+    header, parent, meta, content_bin = build_msg("inspect_request", content)
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    sock_shell.RCVTIMEO = 2000  # 2 seconds
+    try:
+        parts = sock_shell.recv_multipart()
+        reply = json.loads(parts[-1])
+        print(parts)
+        if not reply.get("found"):
+            print("Expected foldr to be found")
+        else:
+            print(reply["data"]["text/plain"])
+    except zmq.Again:
+        print("No message received within timeout")
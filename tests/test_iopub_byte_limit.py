@@ -0,0 +1,21 @@
+from common import load_connection_file, connect_shell, connect_iopub, execute, check
+import zmq
+
+# Needs the kernel started with --iopub-queue-mb=1. Several MB of results go
+# through the IOPub queue; output sent afterwards must still be delivered,
+# the byte limit only applies to what is waiting.
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    sock_shell.RCVTIMEO = 30000
+    sock_iopub = connect_iopub(conn_info)
+
+    try:
+        for i in range(4):
+            out = execute(conn_info, sock_shell, sock_iopub, "replicate 600000 'x'")
+            check("large result %d delivered" % i, len(out["result"] or ""), 600002)
+
+        out = execute(conn_info, sock_shell, sock_iopub, 'System.IO.hPutStrLn System.IO.stderr "still here"')
+        check("stream output after the limit", out["stream"].strip(), "still here")
+    except zmq.Again:
+        print("No message received within timeout")
@@ -0,0 +1,23 @@
+from common import load_connection_file, connect_shell, build_msg, sign
+import sys
+import json
+import zmq
+
+def run_test(conn_file):
+    conn_info = load_connection_file(conn_file)
+    sock_shell = connect_shell(conn_info)
+    
+    header, parent, meta, content_bin = build_msg("made_up_request", {})
+    signature = sign([header, parent, meta, content_bin], conn_info["key"], conn_info["signature_scheme"])
+    
+    sock_shell.send_multipart([b"<IDS|MSG>", signature, header, parent, meta, content_bin])
+    sock_shell.RCVTIMEO = 2000  # 2 seconds
+    try:
+        parts = sock_shell.recv_multipart()
+        reply_header = json.loads(parts[-4])
+        reply = json.loads(parts[-1])
+        print(parts)
+        if reply_header.get("msg_type") != "made_up_reply" or reply.get("status") != "error":
+            print("Expected made_up_reply with status error")
+    except zmq.Again:
+        print("No message received within timeout, kernel may have exited")
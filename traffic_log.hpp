@@ -0,0 +1,171 @@
+#ifndef TRAFFIC_LOG_HPP
+#define TRAFFIC_LOG_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <zmq.hpp>
+
+// Wire-level recording of the shell and IOPub traffic (--record=PATH), the
+// raw multipart frames exactly as received and sent, for replaying real
+// sessions with bench/replay. The file is the magic "HJNTRAF1" followed by
+// records, integers little-endian:
+//
+//   u32 size      of the whole record, header and padding included
+//   u32 frames
+//   u64 time_ns   since the recording started
+//   u16 session   index of the connection file on the command line
+//   u8  channel   TrafficChannel
+//   u8  direction TrafficDirection
+//   u32 reserved
+//   per frame: u32 length, then the bytes
+//   zero padding to a multiple of 8
+//
+// Every record starts 8-byte aligned, so a mapped file can be walked by the
+// size fields alone.
+
+constexpr std::string_view traffic_magic = "HJNTRAF1";
+constexpr size_t traffic_header_size = 24;
+
+enum class TrafficChannel : uint8_t {
+    shell,
+    iopub,
+};
+
+enum class TrafficDirection : uint8_t {
+    received,
+    sent,
+};
+
+struct TrafficSource {
+    uint16_t session;
+    TrafficChannel channel;
+};
+
+void put_le(std::string& out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back((char)(v >> (8 * i)));
+}
+
+uint64_t get_le(const char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+    return v;
+}
+
+struct TrafficLog {
+    std::mutex mutex;
+    std::FILE* file = nullptr;
+    std::chrono::steady_clock::time_point started;
+    std::unordered_map<void*, TrafficSource> sources; // by socket handle, filled before any traffic
+
+    ~TrafficLog() {
+        close();
+    }
+
+    bool open(const std::string& path) {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+        std::fwrite(traffic_magic.data(), 1, traffic_magic.size(), file);
+        started = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void add_source(zmq::socket_t& socket, uint16_t session, TrafficChannel channel) {
+        sources[static_cast<void*>(socket)] = TrafficSource{ session, channel };
+    }
+
+    // The record for a message on socket, empty if the socket is not
+    // recorded. Encoding and writing are separate so the IOPub publisher
+    // can encode before the send takes the frames and write only once the
+    // send went through.
+    std::string encode(void* socket, TrafficDirection direction, const std::vector<zmq::message_t>& frames) const {
+        auto it = sources.find(socket);
+        if (it == sources.end()) return "";
+        uint64_t time_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+
+        size_t size = traffic_header_size;
+        for (const auto& frame : frames) size += 4 + frame.size();
+        size = (size + 7) & ~size_t(7);
+
+        std::string out;
+        out.reserve(size);
+        put_le(out, size, 4);
+        put_le(out, frames.size(), 4);
+        put_le(out, time_ns, 8);
+        put_le(out, it->second.session, 2);
+        put_le(out, (uint8_t)it->second.channel, 1);
+        put_le(out, (uint8_t)direction, 1);
+        put_le(out, 0, 4);
+        for (const auto& frame : frames) {
+            put_le(out, frame.size(), 4);
+            out.append(static_cast<const char*>(frame.data()), frame.size());
+        }
+        out.resize(size, '\0');
+        return out;
+    }
+
+    void write(const std::string& record) {
+        if (record.empty()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file) std::fwrite(record.data(), 1, record.size(), file);
+    }
+
+    void record(void* socket, TrafficDirection direction, const std::vector<zmq::message_t>& frames) {
+        write(encode(socket, direction, frames));
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file) std::fclose(file);
+        file = nullptr;
+    }
+};
+
+TrafficLog* traffic_log = nullptr; // set with --record
+
+struct TrafficRecord {
+    uint64_t time_ns;
+    uint16_t session;
+    TrafficChannel channel;
+    TrafficDirection direction;
+    std::vector<std::string_view> frames; // point into the recording
+};
+
+// Splits a recording into its records. Returns false if data is not a
+// recording; a record cut off at the end (a kernel that did not exit
+// cleanly) is left out.
+bool read_traffic(std::string_view data, std::vector<TrafficRecord>& out) {
+    if (data.substr(0, traffic_magic.size()) != traffic_magic) return false;
+    size_t pos = traffic_magic.size();
+    while (pos + traffic_header_size <= data.size()) {
+        const char* p = data.data() + pos;
+        size_t size = (size_t)get_le(p, 4);
+        if (size < traffic_header_size || pos + size > data.size()) break;
+
+        TrafficRecord record;
+        size_t count = (size_t)get_le(p + 4, 4);
+        record.time_ns = get_le(p + 8, 8);
+        record.session = (uint16_t)get_le(p + 16, 2);
+        record.channel = (TrafficChannel)p[18];
+        record.direction = (TrafficDirection)p[19];
+        size_t at = traffic_header_size;
+        for (size_t i = 0; i < count && at + 4 <= size; ++i) {
+            size_t length = (size_t)get_le(p + at, 4);
+            if (at + 4 + length > size) break;
+            record.frames.push_back(data.substr(pos + at + 4, length));
+            at += 4 + length;
+        }
+        if (record.frames.size() != count) return false;
+        out.push_back(std::move(record));
+        pos += size;
+    }
+    return true;
+}
+
+#endif // TRAFFIC_LOG_HPP
@@ -0,0 +1,106 @@
+#ifndef WATCHDOG_HPP
+#define WATCHDOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// What the watchdog did to an execution that overran its time limit.
+enum class LimitAction : uint8_t {
+    none,
+    interrupted,
+    killed,
+};
+
+// Enforces wall-clock limits for every session from one thread. An
+// execution still running at its deadline is interrupted; if it has not
+// finished after the grace period either, or cannot be interrupted, it is
+// killed.
+struct Watchdog {
+    using clock = std::chrono::steady_clock;
+
+    struct Watch {
+        clock::time_point due;
+        clock::duration grace;
+        std::function<bool()> interrupt; // false when the target cannot be interrupted
+        std::function<void()> kill;
+        std::atomic<LimitAction>* action;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::map<uint64_t, Watch> watches;
+    uint64_t next_id = 0;
+    bool stopping = false;
+    std::thread thread;
+
+    ~Watchdog() {
+        stop();
+    }
+
+    // Starts watching; action reports what was done. Returns the id to
+    // pass to unwatch.
+    uint64_t watch(clock::duration timeout, clock::duration grace,
+        std::function<bool()> interrupt, std::function<void()> kill, std::atomic<LimitAction>& action)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!thread.joinable()) thread = std::thread([this] { run(); });
+        uint64_t id = ++next_id;
+        watches[id] = Watch{ clock::now() + timeout, grace, std::move(interrupt), std::move(kill), &action };
+        wake.notify_one();
+        return id;
+    }
+
+    // Once this returns the watchdog no longer touches the execution.
+    void unwatch(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        watches.erase(id);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            clock::time_point next = clock::time_point::max();
+            for (const auto& [id, w] : watches)
+                if (w.due < next) next = w.due;
+            if (next == clock::time_point::max()) wake.wait(lock);
+            else wake.wait_until(lock, next);
+
+            clock::time_point now = clock::now();
+            for (auto& [id, w] : watches) {
+                if (w.due > now) continue;
+                if (w.action->load() == LimitAction::none && w.interrupt()) {
+                    w.action->store(LimitAction::interrupted);
+                    w.due = now + w.grace;
+                }
+                else {
+                    w.action->store(LimitAction::killed);
+                    w.kill();
+                    w.due = clock::time_point::max();
+                }
+            }
+        }
+    }
+};
+
+// Shared by all sessions, the thread starts with the first watch.
+Watchdog& watchdog() {
+    static Watchdog instance;
+    return instance;
+}
+
+#endif // WATCHDOG_HPP